@@ -0,0 +1,275 @@
+/*
+# admission.c: rate limits and connection caps, before probing
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <sys/mman.h>
+#include "common.h"
+#include "sslh-conf.h"
+#include "backends.h"
+#include "admission.h"
+
+/* Largest rate_limit and rate_burst, so a bucket holds its thousandths of a
+ * token in 32 bits */
+#define RATE_MAX 1000000
+
+/* A bucket is the time it was last updated (low 32 bits of monotonic_ms(),
+ * never 0) in the high half, and what it holds, in thousandths of a token, in
+ * the low half. 0 is a bucket no one used yet: it's full. */
+struct admission {
+    int probing;
+    uint32_t seed[2];
+    uint64_t bucket[2][ADMISSION_BUCKETS];
+};
+
+/* NULL if not set up (echosrv, inetd) */
+static struct admission* admission;
+
+#define ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+
+static uint32_t random_seed(void)
+{
+    uint32_t seed = 0;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        if (read(fd, &seed, sizeof(seed)) != sizeof(seed))
+            seed = 0;
+        close(fd);
+    }
+    if (!seed)
+        seed = monotonic_ms() * 2654435761u ^ getpid();
+    return seed;
+}
+
+void admission_setup(void)
+{
+    admission = mmap(NULL, sizeof(*admission), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (admission == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(admission, 0, sizeof(*admission));
+    /* So clients can't choose addresses that all fall in the same buckets */
+    admission->seed[0] = random_seed();
+    admission->seed[1] = random_seed();
+}
+
+int admission_check_config(struct sslhcfg_item* c)
+{
+    int i;
+
+    if (c->rate_limit < 0 || c->rate_limit > RATE_MAX ||
+        c->rate_burst < 1 || c->rate_burst > RATE_MAX) {
+        fprintf(stderr, "rate_limit must be 0 to %d, and rate_burst 1 to %d\n",
+                RATE_MAX, RATE_MAX);
+        return 1;
+    }
+    if (c->rate_prefix4 < 0 || c->rate_prefix4 > 32 ||
+        c->rate_prefix6 < 0 || c->rate_prefix6 > 128) {
+        fprintf(stderr, "rate_prefix4 must be 0 to 32, and rate_prefix6 0 to 128\n");
+        return 1;
+    }
+    if (c->max_probing < 0) {
+        fprintf(stderr, "max_probing must be positive\n");
+        return 1;
+    }
+    for (i = 0; i < c->protocols_len; i++) {
+        if (c->protocols[i].max_connections < 0) {
+            fprintf(stderr, "%s: max_connections must be positive\n", c->protocols[i].name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void refused(struct connection* cnx, const char* limit)
+{
+    print_verbose(1, "fd %d: over %s, refused\n", cnx->q[0].fd, limit);
+    metrics_refused();
+}
+
+/* Hashes the network of addr (per rate_prefix4 or rate_prefix6) with seed */
+static uint32_t source_hash(const struct sockaddr_storage* addr, uint32_t seed)
+{
+    const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*)addr;
+    const unsigned char* p;
+    unsigned char net[16];
+    uint32_t h = 2166136261u ^ seed;
+    int i, len, prefix;
+
+    if (addr->ss_family == AF_INET) {
+        p = (const unsigned char*)&((const struct sockaddr_in*)addr)->sin_addr;
+        len = 4;
+        prefix = cfg.rate_prefix4;
+    } else if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+        p = (const unsigned char*)&sin6->sin6_addr + 12;
+        len = 4;
+        prefix = cfg.rate_prefix4;
+    } else {
+        p = (const unsigned char*)&sin6->sin6_addr;
+        len = 16;
+        prefix = cfg.rate_prefix6;
+    }
+
+    memset(net, 0, sizeof(net));
+    memcpy(net, p, prefix / 8);
+    if (prefix % 8)
+        net[prefix / 8] = p[prefix / 8] & (0xff00 >> (prefix % 8));
+
+    h ^= len;
+    h *= 16777619u;
+    for (i = 0; i < len; i++) {
+        h ^= net[i];
+        h *= 16777619u;
+    }
+    /* FNV's low bits, which pick the bucket, mix poorly on their own */
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+/* Another process updating a bucket at the same time is at most that far
+ * ahead of us; a stamp further ahead is one that wrapped around, of a bucket
+ * left alone for more than 24 days */
+#define BUCKET_SKEW_MS 1000
+
+/* Refills the bucket for the time elapsed, and takes a token from it. Returns
+ * 1 if there was one, 0 otherwise. */
+static int take_token(uint64_t* bucket, uint32_t now)
+{
+    uint64_t old, new, tokens, full = (uint64_t)cfg.rate_burst * 1000;
+    uint32_t stamp;
+    int32_t elapsed;
+    int taken;
+
+    if (!now)
+        now = 1;
+    old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+    do {
+        stamp = now;
+        if (!old) {
+            tokens = full;
+        } else {
+            /* Another process may just have updated it with a later time */
+            elapsed = now - (uint32_t)(old >> 32);
+            if (elapsed < -BUCKET_SKEW_MS) {
+                tokens = full;
+            } else {
+                if (elapsed < 0) {
+                    elapsed = 0;
+                    stamp = old >> 32;
+                }
+                /* rate_limit per second is as many thousandths per millisecond */
+                tokens = (uint32_t)old + (uint64_t)elapsed * cfg.rate_limit;
+                if (tokens > full)
+                    tokens = full;
+            }
+        }
+        taken = (tokens >= 1000);
+        if (taken)
+            tokens -= 1000;
+        new = (uint64_t)stamp << 32 | tokens;
+    } while (!__atomic_compare_exchange_n(bucket, &old, new, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return taken;
+}
+
+int admission_source(struct connection* cnx)
+{
+    uint32_t now;
+    int i, taken = 0;
+
+    if (!admission || !cfg.rate_limit || !cnx->peer_len)
+        return 0;
+
+    now = monotonic_ms();
+    for (i = 0; i < 2; i++) {
+        taken |= take_token(&admission->bucket[i][source_hash(&cnx->peer, admission->seed[i])
+                                                  % ADMISSION_BUCKETS],
+                            now);
+    }
+    if (!taken) {
+        refused(cnx, "rate_limit");
+        return -1;
+    }
+    return 0;
+}
+
+int admission_accepted(struct connection* cnx)
+{
+    if (!admission)
+        return 0;
+
+    if (!cnx->proxy_header && admission_source(cnx))
+        return -1;
+
+    /* Counted even without a limit, so one set by a reload is right */
+    if (ADD(admission->probing, 1) >= cfg.max_probing && cfg.max_probing) {
+        ADD(admission->probing, -1);
+        refused(cnx, "max_probing");
+        return -1;
+    }
+    cnx->admission.probing = 1;
+    return 0;
+}
+
+int admission_probed(struct connection* cnx)
+{
+    struct sslhcfg_protocols_item* p = cnx->proto;
+    int* active;
+
+    if (!admission)
+        return 0;
+
+    if (cnx->admission.probing) {
+        ADD(admission->probing, -1);
+        cnx->admission.probing = 0;
+    }
+
+    if (!p->pool)
+        return 0;
+    active = p->pool->active;
+    if (ADD(*active, 1) >= p->max_connections && p->max_connections) {
+        ADD(*active, -1);
+        refused(cnx, "max_connections");
+        return -1;
+    }
+    cnx->admission.active = active;
+    return 0;
+}
+
+void admission_closed(struct connection* cnx)
+{
+    if (cnx->admission.probing)
+        ADD(admission->probing, -1);
+    if (cnx->admission.active)
+        ADD(*cnx->admission.active, -1);
+    memset(&cnx->admission, 0, sizeof(cnx->admission));
+}
+
+void admission_reset(int fd)
+{
+    struct linger linger = { 1, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+}
@@ -0,0 +1,67 @@
+/* API for admission.c: who gets in, before probing
+ *
+ * Clients that open connections and send nothing keep them probing until
+ * `timeout`, which costs a slot (or a process, in sslh-fork) each. Three limits
+ * refuse connections as early as possible, with a reset:
+ *
+ * - `rate_limit`: connections per second from one source network (a /24 in
+ *   IPv4 and a /64 in IPv6, see `rate_prefix4` and `rate_prefix6`), with
+ *   bursts of up to `rate_burst`. Checked when the connection is accepted, or
+ *   once its PROXY header gives the client address.
+ * - `max_probing`: connections being probed at once, checked when the
+ *   connection is accepted.
+ * - `max_connections` of a protocol: connections to its targets at once,
+ *   checked once the connection is found to be of that protocol.
+ *
+ * Source networks share token buckets in a fixed-size table: each network
+ * takes one bucket in each of two rows, chosen by different hashes, and only
+ * gets refused when both are empty (as in a count-min sketch), so a busy
+ * network colliding with another one slows it down only if they collide in
+ * both rows.
+ *
+ * Everything lives in shared memory updated with atomic operations, so the
+ * processes of sslh-fork and the threads of sslh-threads share the limits.
+ * UDP is not covered.
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+struct connection;
+struct sslhcfg_item;
+
+/* Token buckets in each row */
+#define ADMISSION_BUCKETS 4096
+
+/* What a connection has been counted in */
+struct cnx_admission {
+    int probing;    /* counted in max_probing */
+    int* active;    /* counted in max_connections of the protocol, or NULL */
+};
+
+/* Allocates the counters. Call before forking. Dies on error. */
+void admission_setup(void);
+
+/* Returns 0 if the limits of c make sense; says what's wrong and returns 1
+ * otherwise */
+int admission_check_config(struct sslhcfg_item* c);
+
+/* cnx has just been accepted: returns 0 and counts it as probing if it may
+ * come in, -1 if not. The source is only checked if cnx->proxy_header is not
+ * set. */
+int admission_accepted(struct connection* cnx);
+
+/* Returns 0 if the source of cnx (cnx->peer) is within rate_limit, -1 if not */
+int admission_source(struct connection* cnx);
+
+/* cnx->proto is known: returns 0 and counts cnx in it if it has room, -1 if
+ * not */
+int admission_probed(struct connection* cnx);
+
+/* cnx is closed */
+void admission_closed(struct connection* cnx);
+
+/* Makes close(fd) send a reset, for refused connections */
+void admission_reset(int fd);
+
+#endif
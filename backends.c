@@ -0,0 +1,481 @@
+/*
+# backends.c: load balancing and health tracking of targets
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "sslh-conf.h"
+#include "backends.h"
+
+static const char* balance_names[] = {
+    [BALANCE_ROUNDROBIN] = "roundrobin",
+    [BALANCE_LEASTCONN] = "leastconn",
+    [BALANCE_SOURCE] = "source",
+};
+
+/* Memory shared with the processes we fork */
+static void* shared_alloc(size_t size)
+{
+    void* p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(p, 0, size);
+    return p;
+}
+
+#define FNV1A_INIT 2166136261u
+
+/* FNV-1a, going on from h */
+static uint32_t fnv1a(uint32_t h, const void* data, size_t len)
+{
+    const unsigned char* p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Splits "host:port" into b->host and b->port, and resolves them. Returns 0,
+ * or the status to exit with. */
+static int backend_resolve(struct backend* b, const char* fullname)
+{
+    struct addrinfo* ai;
+    char* sep;
+    int res;
+
+    b->host = strdup(fullname);
+    CHECK_ALLOC(b->host, "strdup");
+    sep = strrchr(b->host, ':');
+    if (!sep) {
+        fprintf(stderr, "%s: names must be fully specified as hostname:port\n", fullname);
+        return 1;
+    }
+    *sep = 0;
+    b->port = sep + 1;
+
+    res = resolve_split_name(&ai, b->host, b->port);
+    if (res) {
+        fprintf(stderr, "cannot resolve %s\n", fullname);
+        return 4;
+    }
+    b->addrs = addr_list_new(ai);
+    return 0;
+}
+
+static int same_string(const char* a, const char* b)
+{
+    return a == b || (a && b && !strcmp(a, b));
+}
+
+/* Returns true if p and q go to the same targets in the same way */
+static int same_targets(struct sslhcfg_protocols_item* p, struct sslhcfg_protocols_item* q)
+{
+    int i;
+
+    if (strcmp(p->host, q->host) || strcmp(p->port, q->port) ||
+        p->is_udp != q->is_udp || !same_string(p->balance, q->balance) ||
+        p->backends_len != q->backends_len)
+        return 0;
+    for (i = 0; i < p->backends_len; i++)
+        if (strcmp(p->backends[i], q->backends[i]))
+            return 0;
+    return 1;
+}
+
+/* Returns true if the address lists a and b are the same, in the same order */
+static int same_addrs(struct addrinfo* a, struct addrinfo* b)
+{
+    for (; a && b; a = a->ai_next, b = b->ai_next)
+        if (a->ai_addrlen != b->ai_addrlen || memcmp(a->ai_addr, b->ai_addr, a->ai_addrlen))
+            return 0;
+    return !a && !b;
+}
+
+/* What a pool of num targets keeps in shared memory: the statistics of each,
+ * then the round-robin counter and the connection count */
+static size_t shared_size(int num)
+{
+    return num * sizeof(struct backend_stats) + sizeof(unsigned) + sizeof(int);
+}
+
+int backends_reuse(struct sslhcfg_protocols_item* p, struct sslhcfg_item* previous)
+{
+    struct sslhcfg_protocols_item* q;
+    struct addr_list* addrs;
+    int i, same;
+
+    for (i = 0; previous && i < previous->protocols_len; i++) {
+        q = &previous->protocols[i];
+        if (!q->pool || !same_targets(p, q))
+            continue;
+        /* The resolver may be changing them */
+        addrs = addr_list_get(&q->pool->backend[0]);
+        same = same_addrs(p->saddr, addrs->ai);
+        addr_list_put(addrs);
+        if (same) {
+            __atomic_add_fetch(&q->pool->refcnt, 1, __ATOMIC_RELAXED);
+            p->pool = q->pool;
+            /* The same addresses as the first target, which has its own */
+            freeaddrinfo(p->saddr);
+            p->saddr = q->pool->backend[0].addrs->ai;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int backends_setup(struct sslhcfg_protocols_item* p)
+{
+    struct backend_pool* pool;
+    struct backend_stats* stats;
+    struct backend* b;
+    size_t len;
+    int i, res;
+
+    pool = calloc(1, sizeof(*pool));
+    CHECK_ALLOC(pool, "calloc");
+    pool->refcnt = 1;
+
+    pool->balance = BALANCE_ROUNDROBIN;
+    for (i = 0; p->balance && i < ARRAY_SIZE(balance_names); i++)
+        if (!strcmp(p->balance, balance_names[i]))
+            pool->balance = i;
+    if (p->balance && strcmp(p->balance, balance_names[pool->balance])) {
+        fprintf(stderr, "%s: unknown balance method '%s'\n", p->name, p->balance);
+        return 1;
+    }
+
+    pool->num = 1 + p->backends_len;
+    if (pool->num > BACKENDS_MAX) {
+        fprintf(stderr, "%s: more than %d targets\n", p->name, BACKENDS_MAX);
+        return 1;
+    }
+
+    pool->backend = calloc(pool->num, sizeof(*pool->backend));
+    CHECK_ALLOC(pool->backend, "calloc");
+    stats = shared_alloc(shared_size(pool->num));
+    pool->next = (unsigned*)&stats[pool->num];
+    pool->active = (int*)&pool->next[1];
+
+    for (i = 0; i < pool->num; i++) {
+        pool->backend[i].index = i;
+        pool->backend[i].stats = &stats[i];
+    }
+    /* From here on, for a failed reload to free it */
+    p->pool = pool;
+
+    /* The first target is host:port, in one block like the others */
+    len = strlen(p->host) + 1;
+    pool->backend[0].host = malloc(len + strlen(p->port) + 1);
+    CHECK_ALLOC(pool->backend[0].host, "malloc");
+    strcpy(pool->backend[0].host, p->host);
+    pool->backend[0].port = pool->backend[0].host + len;
+    strcpy(pool->backend[0].port, p->port);
+    pool->backend[0].addrs = addr_list_new(p->saddr);
+    for (i = 1; i < pool->num; i++) {
+        res = backend_resolve(&pool->backend[i], p->backends[i - 1]);
+        if (res)
+            return res;
+    }
+
+    for (i = 0; i < pool->num; i++) {
+        b = &pool->backend[i];
+        b->name_hash = fnv1a(FNV1A_INIT, b->host, strlen(b->host) + 1);
+        b->name_hash = fnv1a(b->name_hash, b->port, strlen(b->port));
+    }
+    return 0;
+}
+
+void backends_put(struct backend_pool* pool)
+{
+    int i;
+
+    if (!pool || __atomic_sub_fetch(&pool->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    for (i = 0; i < pool->num; i++) {
+        addr_list_put(pool->backend[i].addrs);
+        free(pool->backend[i].host);
+    }
+    munmap(pool->backend[0].stats, shared_size(pool->num));
+    free(pool->backend);
+    free(pool);
+}
+
+uint32_t backend_hash_addr(const struct sockaddr* addr)
+{
+    const unsigned char* p;
+    size_t len;
+
+    switch (addr->sa_family) {
+    case AF_INET:
+        p = (const unsigned char*)&((const struct sockaddr_in*)addr)->sin_addr;
+        len = sizeof(struct in_addr);
+        break;
+    case AF_INET6:
+        p = (const unsigned char*)&((const struct sockaddr_in6*)addr)->sin6_addr;
+        len = sizeof(struct in6_addr);
+        break;
+    default:
+        return 0;
+    }
+
+    return fnv1a(FNV1A_INIT, p, len);
+}
+
+/* Mixes the client hash with what identifies a target (rendezvous hashing:
+ * each client goes to the target with the highest weight, so adding or
+ * removing a target, wherever it is in the list, only moves its own clients) */
+static uint32_t weight(uint32_t client_hash, uint32_t target_hash)
+{
+    uint32_t h = client_hash ^ target_hash;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+struct backend* backend_choose(struct sslhcfg_protocols_item* p, uint32_t client_hash,
+                               uint64_t tried)
+{
+    struct backend_pool* pool = p->pool;
+    struct backend *b, *best = NULL;
+    uint64_t now = monotonic_ms(), up = 0, usable;
+    unsigned start;
+    int i, k, active, best_active = 0;
+    uint32_t w, best_w = 0;
+
+    for (i = 0; i < pool->num; i++) {
+        if (__atomic_load_n(&pool->backend[i].stats->down_until, __ATOMIC_RELAXED) <= now)
+            up |= 1ULL << i;
+    }
+    usable = up & ~tried;
+    if (!usable) {
+        /* All down: better try one anyway */
+        for (i = 0; i < pool->num; i++)
+            usable |= 1ULL << i;
+        usable &= ~tried;
+    }
+    if (!usable)
+        return NULL;
+
+    start = __atomic_fetch_add(pool->next, 1, __ATOMIC_RELAXED);
+    for (k = 0; k < pool->num; k++) {
+        i = (start + k) % pool->num;
+        if (!(usable & (1ULL << i)))
+            continue;
+        b = &pool->backend[i];
+
+        switch (pool->balance) {
+        case BALANCE_ROUNDROBIN:
+            if (!best) best = b;
+            break;
+
+        case BALANCE_LEASTCONN:
+            /* Starting at the round-robin position spreads ties */
+            active = __atomic_load_n(&b->stats->active, __ATOMIC_RELAXED);
+            if (!best || active < best_active) {
+                best = b;
+                best_active = active;
+            }
+            break;
+
+        case BALANCE_SOURCE:
+            w = weight(client_hash, b->name_hash);
+            if (!best || w > best_w) {
+                best = b;
+                best_w = w;
+            }
+            break;
+        }
+    }
+
+    __atomic_fetch_add(&best->stats->active, 1, __ATOMIC_RELAXED);
+    return best;
+}
+
+void backend_release(struct connection* cnx)
+{
+    if (!cnx->backend)
+        return;
+
+    __atomic_fetch_sub(&cnx->backend->stats->active, 1, __ATOMIC_RELAXED);
+    cnx->backend = NULL;
+}
+
+void backend_failed(struct sslhcfg_protocols_item* p, struct backend* b)
+{
+    if (p->pool->num == 1)
+        return; /* nowhere else to go anyway */
+
+    log_message(LOG_WARNING, "%s: %s:%s failed, left out for %ds\n",
+                p->name, b->host, b->port, p->fail_timeout);
+    __atomic_store_n(&b->stats->down_until, monotonic_ms() + p->fail_timeout * 1000,
+                     __ATOMIC_RELAXED);
+}
+
+/* Returns 0 if one of the addresses of b accepts a connection within
+ * timeout seconds */
+static int check_backend(struct backend* b, int timeout)
+{
+    struct addr_list* addrs = addr_list_get(b);
+    struct pollfd pfd;
+    struct addrinfo* a;
+    socklen_t len;
+    int fd, res, err = -1;
+
+    for (a = addrs->ai; a; a = a->ai_next) {
+        fd = socket(a->ai_family, SOCK_STREAM, 0);
+        if (fd == -1)
+            continue;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        res = connect(fd, a->ai_addr, a->ai_addrlen);
+        err = (res == -1) ? errno : 0;
+        if (err == EINPROGRESS) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            res = poll(&pfd, 1, timeout * 1000);
+            len = sizeof(err);
+            if (res <= 0)
+                err = ETIMEDOUT;
+            else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+                err = errno;
+        }
+        close(fd);
+        if (!err)
+            break;
+    }
+    addr_list_put(addrs);
+    return err ? -1 : 0;
+}
+
+static void check_protocol(struct sslhcfg_protocols_item* p)
+{
+    struct backend* b;
+    uint64_t down_until;
+    int i;
+
+    for (i = 0; i < p->pool->num; i++) {
+        b = &p->pool->backend[i];
+        down_until = __atomic_load_n(&b->stats->down_until, __ATOMIC_RELAXED);
+
+        if (check_backend(b, p->connect_timeout)) {
+            if (down_until <= monotonic_ms())
+                log_message(LOG_WARNING, "%s: %s:%s is down\n", p->name, b->host, b->port);
+            /* Until the next check says otherwise */
+            down_until = monotonic_ms() + 2 * p->health_check * 1000;
+        } else {
+            if (down_until > monotonic_ms())
+                log_message(LOG_WARNING, "%s: %s:%s is up\n", p->name, b->host, b->port);
+            down_until = 0;
+        }
+        __atomic_store_n(&b->stats->down_until, down_until, __ATOMIC_RELAXED);
+    }
+}
+
+/* A checker thread works on the protocols of one configuration, like the
+ * resolver: after a reload, it leaves the next time it wakes up */
+struct checker_job {
+    struct sslhcfg_protocols_item* protocols;
+    int num;
+    int generation;     /* config_generation of the protocols */
+    struct config_ref* config;  /* holds them */
+    uint64_t next_check[];
+};
+
+static void* checker_main(void* arg)
+{
+    struct checker_job* job = arg;
+    struct sslhcfg_protocols_item* p;
+    uint64_t now, next;
+    int i;
+
+    while (__atomic_load_n(&config_generation, __ATOMIC_ACQUIRE) == job->generation) {
+        now = monotonic_ms();
+        /* Wake up at least every second to notice a reload */
+        next = now + 1000;
+        for (i = 0; i < job->num; i++) {
+            p = &job->protocols[i];
+            if (p->health_check <= 0 || p->is_udp)
+                continue;
+            if (job->next_check[i] <= now) {
+                check_protocol(p);
+                job->next_check[i] = monotonic_ms() + p->health_check * 1000;
+            }
+            if (job->next_check[i] < next)
+                next = job->next_check[i];
+        }
+        now = monotonic_ms();
+        if (next > now)
+            poll(NULL, 0, next - now);
+    }
+    config_put(job->config);
+    free(job);
+    return NULL;
+}
+
+void start_health_checks(void)
+{
+    struct checker_job* job;
+    pthread_t thread;
+    sigset_t all, old;
+    int i, res, any = 0;
+
+    for (i = 0; i < cfg.protocols_len; i++)
+        if (cfg.protocols[i].health_check > 0 && !cfg.protocols[i].is_udp)
+            any = 1;
+    if (!any)
+        return;
+
+    job = calloc(1, sizeof(*job) + cfg.protocols_len * sizeof(*job->next_check));
+    CHECK_ALLOC(job, "calloc");
+    job->protocols = cfg.protocols;
+    job->num = cfg.protocols_len;
+    job->generation = config_generation;
+    job->config = config_get();
+
+    /* Signals are for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    res = pthread_create(&thread, NULL, checker_main, job);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res) {
+        log_message(LOG_ERR, "pthread_create: %s -- targets will not be checked\n",
+                    strerror(res));
+        config_put(job->config);
+        free(job);
+        return;
+    }
+    pthread_detach(thread);
+}
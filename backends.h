@@ -0,0 +1,91 @@
+/* API for backends.c: spreads the connections of a protocol over its targets
+ *
+ * A protocol connects to its host:port and to each of its `backends`, chosen
+ * for each connection by round-robin, least connections, or a hash of the
+ * client address ("source", so a client keeps going to the same target). A
+ * target that fails to connect is left out for `fail_timeout` seconds, and
+ * with `health_check` set, a separate process checks all targets can be
+ * connected to every that many seconds.
+ *
+ * Target statistics live in shared memory, so all the processes of sslh-fork
+ * and all the threads of sslh-threads see the same.
+ */
+
+#ifndef BACKENDS_H
+#define BACKENDS_H
+
+#include "common.h"
+#include "resolver.h"
+
+/* At most that many targets per protocol */
+#define BACKENDS_MAX 64
+
+enum balance {
+    BALANCE_ROUNDROBIN,
+    BALANCE_LEASTCONN,
+    BALANCE_SOURCE
+};
+
+struct backend_stats {
+    int active;             /* connections to this target */
+    uint64_t down_until;    /* left out until then (see monotonic_ms()) */
+};
+
+struct backend {
+    int index;              /* in the pool */
+    char *host, *port;
+    struct addr_list* addrs;        /* see resolver.h */
+    struct backend_stats* stats;    /* shared */
+    int numeric;                    /* host is an address: no need to resolve it */
+    uint32_t name_hash;             /* of host and port, for BALANCE_SOURCE */
+    uint64_t next_resolve;
+};
+
+struct backend_pool {
+    int refcnt;             /* protocols using it, see backends_reuse() */
+    enum balance balance;
+    int num;
+    struct backend* backend;
+    unsigned* next;         /* round-robin counter (shared) */
+    int* active;            /* connections to the protocol, for max_connections
+                               (shared, see admission.h) */
+};
+
+/* Sets up the targets of p, once p->saddr is resolved. The first target takes
+ * p->saddr over, so it only remains valid until start_resolver(). Returns 0,
+ * or the status sslh exits with: 1 if the targets are wrong, 4 if one can't be
+ * resolved. */
+int backends_setup(struct sslhcfg_protocols_item* p);
+
+/* If a protocol of the previous configuration (NULL for none) has the same
+ * targets as p, and its first target still has the addresses p->saddr was
+ * resolved to, gives p its targets, with their statistics, and returns 1:
+ * p->saddr is then the first target's, as after backends_setup(). Returns 0
+ * otherwise. */
+int backends_reuse(struct sslhcfg_protocols_item* p, struct sslhcfg_item* previous);
+
+/* p no longer uses its targets: frees them if no other protocol does. NULL is
+ * ignored. */
+void backends_put(struct backend_pool* pool);
+
+/* Hashes the address (not the port) of a client, for BALANCE_SOURCE */
+uint32_t backend_hash_addr(const struct sockaddr* addr);
+
+/* Picks a target of p for a new connection, not including those in `tried`
+ * (bit i set for target i). Targets that are down are only used if all others
+ * are. Returns NULL if all targets have been tried. */
+struct backend* backend_choose(struct sslhcfg_protocols_item* p, uint32_t client_hash,
+                               uint64_t tried);
+
+/* cnx->backend is no longer used by cnx */
+void backend_release(struct connection* cnx);
+
+/* b failed to connect: leave it out for a while */
+void backend_failed(struct sslhcfg_protocols_item* p, struct backend* b);
+
+/* Starts the thread that checks the targets of protocols that have
+ * health_check set, if any. After a reload, call again: the thread of the
+ * previous configuration leaves by itself. */
+void start_health_checks(void);
+
+#endif
@@ -0,0 +1,796 @@
+/*
+# bench.c: load generator and latency benchmark for sslh
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+/* sslh-bench [options] <sslh binary>...
+ *
+ * For each sslh binary, starts one echosrv per protocol (each with its own
+ * prefix, so we can check connections end up at the right place), starts
+ * sslh in front of them, then:
+ * - opens many idle connections and measures how much memory sslh uses for
+ *   them (proportional set size of sslh and all its processes, so the pages
+ *   sslh-fork processes share are not counted again for each one);
+ * - runs client threads that each connect, send the opening message of a
+ *   protocol picked from the mix, wait for the echo, send and receive a
+ *   payload, and disconnect, in a loop.
+ *
+ * The probe latency is what the client sees: from sending the first message
+ * until it comes back, which includes probing, connecting to the target and
+ * the echo itself.
+ *
+ * Linux only (memory is read from /proc).
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum bench_proto { P_SSH, P_TLS, P_HTTP, P_OPENVPN, P_UDP, P_NUM };
+
+struct proto_desc {
+    const char* name;
+    const char* sslh_option;    /* NULL for UDP, which needs a config file */
+    unsigned char msg[256];     /* opening message */
+    size_t len;
+    int weight;                 /* share of the mix */
+};
+
+static struct proto_desc protos[P_NUM] = {
+    [P_SSH] = { "ssh", "--ssh" },
+    [P_TLS] = { "tls", "--tls" },
+    [P_HTTP] = { "http", "--http" },
+    [P_OPENVPN] = { "openvpn", "--openvpn" },
+    [P_UDP] = { "udp", NULL },
+};
+
+/* Settings */
+static int num_threads = 16;
+static int duration = 5;
+static int payload_size = 16384;
+static int idle_cnx = 1000;
+static int base_port = 24000;
+static const char* echosrv = "./echosrv";
+static int json = 0;
+static int verbose = 0;
+
+static struct sockaddr_in sslh_tcp, sslh_udp;
+static volatile int stop;
+
+/* Per thread results */
+struct worker {
+    pthread_t thread;
+    unsigned int seed;
+    uint64_t cnx[P_NUM];
+    uint64_t errors;
+    uint64_t bytes;
+    uint32_t* lat;              /* probe latencies, in microseconds */
+    size_t lat_len, lat_size;
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void put16(unsigned char* p, unsigned v) { p[0] = v >> 8; p[1] = v; }
+static void put24(unsigned char* p, unsigned v) { p[0] = v >> 16; p[1] = v >> 8; p[2] = v; }
+
+/* A TLS 1.2 ClientHello with a server name. Returns its length. */
+static size_t make_client_hello(unsigned char* buf, const char* sni)
+{
+    size_t sni_len = strlen(sni), ext_len = sni_len + 9;
+    unsigned char* p = buf + 9;     /* skip record and handshake headers */
+    size_t hs_len;
+
+    *p++ = 3; *p++ = 3;                         /* version */
+    memset(p, 0x42, 32); p += 32;               /* random */
+    *p++ = 0;                                   /* session id */
+    put16(p, 2); p += 2;                        /* cipher suites */
+    *p++ = 0x13; *p++ = 0x01;
+    *p++ = 1; *p++ = 0;                         /* compression: null */
+    put16(p, ext_len); p += 2;                  /* extensions */
+    put16(p, 0); p += 2;                        /* server_name */
+    put16(p, sni_len + 5); p += 2;
+    put16(p, sni_len + 3); p += 2;
+    *p++ = 0;                                   /* host_name */
+    put16(p, sni_len); p += 2;
+    memcpy(p, sni, sni_len); p += sni_len;
+
+    hs_len = p - buf - 9;
+    buf[0] = 0x16; buf[1] = 3; buf[2] = 1;      /* handshake record */
+    put16(buf + 3, hs_len + 4);
+    buf[5] = 1;                                 /* ClientHello */
+    put24(buf + 6, hs_len);
+    return p - buf;
+}
+
+static void setup_messages(void)
+{
+    static const unsigned char openvpn[] = {
+        0x00, 0x0e,         /* length */
+        0x38,               /* P_CONTROL_HARD_RESET_CLIENT_V2 */
+        1, 2, 3, 4, 5, 6, 7, 8, 0, 0, 0, 0, 0
+    };
+
+#define SET_TEXT(p, s) do { strcpy((char*)protos[p].msg, s); protos[p].len = strlen(s); } while (0)
+    SET_TEXT(P_SSH, "SSH-2.0-sslh-bench\r\n");
+    SET_TEXT(P_HTTP, "GET / HTTP/1.1\r\nHost: bench.example.org\r\n\r\n");
+    SET_TEXT(P_UDP, "sslh-bench datagram\n");
+#undef SET_TEXT
+    memcpy(protos[P_OPENVPN].msg, openvpn, sizeof(openvpn));
+    protos[P_OPENVPN].len = sizeof(openvpn);
+    protos[P_TLS].len = make_client_hello(protos[P_TLS].msg, "bench.example.org");
+}
+
+/* Parses "ssh=30,tls=30,..." */
+static void parse_mix(const char* mix)
+{
+    char name[32];
+    int i, n, weight;
+
+    for (i = 0; i < P_NUM; i++)
+        protos[i].weight = 0;
+    while (*mix) {
+        if (sscanf(mix, "%31[a-z]=%d%n", name, &weight, &n) != 2) {
+            fprintf(stderr, "bad mix: %s\n", mix);
+            exit(1);
+        }
+        for (i = 0; i < P_NUM && strcmp(name, protos[i].name); i++)
+            ;
+        if (i == P_NUM) {
+            fprintf(stderr, "unknown protocol: %s\n", name);
+            exit(1);
+        }
+        protos[i].weight = weight;
+        mix += n;
+        if (*mix == ',')
+            mix++;
+    }
+}
+
+static int pick_proto(struct worker* w)
+{
+    int i, total = 0, r;
+
+    for (i = 0; i < P_NUM; i++)
+        total += protos[i].weight;
+    r = rand_r(&w->seed) % total;
+    for (i = 0; r >= protos[i].weight; i++)
+        r -= protos[i].weight;
+    return i;
+}
+
+static void set_timeouts(int fd, int seconds)
+{
+    struct timeval tv = { .tv_sec = seconds };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* Reads the echo of the opening message of p. Returns 0 if it came with the
+ * right prefix, -1 otherwise. */
+static int read_echo(int fd, int p)
+{
+    char buf[512];
+    size_t prefix_len = strlen(protos[p].name) + 2;
+    size_t want = prefix_len + protos[p].len, got = 0;
+    ssize_t n;
+
+    while (got < want) {
+        n = recv(fd, buf + got, sizeof(buf) - got, 0);
+        if (n <= 0)
+            return -1;
+        got += n;
+        if (protos[p].sslh_option == NULL)
+            break; /* a datagram comes in one piece */
+    }
+    if (got < prefix_len || memcmp(buf, protos[p].name, prefix_len - 2) || buf[prefix_len - 2] != ':')
+        return -1;
+    return 0;
+}
+
+/* Connects to sslh and sends the opening message of p. Returns the socket,
+ * or -1 */
+static int open_cnx(int p)
+{
+    int fd, one = 1;
+
+    if (protos[p].sslh_option) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1)
+            return -1;
+        set_timeouts(fd, 5);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, (struct sockaddr*)&sslh_tcp, sizeof(sslh_tcp)) == -1)
+            goto fail;
+    } else {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd == -1)
+            return -1;
+        set_timeouts(fd, 2);
+        if (connect(fd, (struct sockaddr*)&sslh_udp, sizeof(sslh_udp)) == -1)
+            goto fail;
+    }
+    if (send(fd, protos[p].msg, protos[p].len, MSG_NOSIGNAL) != (ssize_t)protos[p].len)
+        goto fail;
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/* Sends payload_size bytes and reads at least as many back (echosrv adds its
+ * prefix to each read). Returns the number of bytes moved, or -1. */
+static ssize_t transfer(int fd)
+{
+    static char payload[16384];
+    char buf[65536];
+    struct pollfd pfd = { .fd = fd };
+    size_t sent = 0, received = 0, chunk;
+    ssize_t n;
+
+    while (received < (size_t)payload_size) {
+        pfd.events = POLLIN | (sent < (size_t)payload_size ? POLLOUT : 0);
+        if (poll(&pfd, 1, 5000) != 1)
+            return -1;
+        if (pfd.revents & POLLIN) {
+            n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n == 0 || (n == -1 && errno != EAGAIN))
+                return -1;
+            if (n > 0)
+                received += n;
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            return -1;
+        }
+        if (sent < (size_t)payload_size && (pfd.revents & POLLOUT)) {
+            chunk = payload_size - sent;
+            if (chunk > sizeof(payload))
+                chunk = sizeof(payload);
+            n = send(fd, payload, chunk, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n == -1 && errno != EAGAIN)
+                return -1;
+            if (n > 0)
+                sent += n;
+        }
+    }
+    return sent + received;
+}
+
+static void record_latency(struct worker* w, uint64_t us)
+{
+    if (w->lat_len == w->lat_size) {
+        w->lat_size = w->lat_size ? w->lat_size * 2 : 4096;
+        w->lat = realloc(w->lat, w->lat_size * sizeof(*w->lat));
+        if (!w->lat) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    w->lat[w->lat_len++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static void* worker_run(void* arg)
+{
+    struct worker* w = arg;
+    uint64_t start;
+    ssize_t n;
+    int p, fd;
+
+    while (!stop) {
+        p = pick_proto(w);
+        start = now_us();
+        fd = open_cnx(p);
+        if (fd == -1 || read_echo(fd, p)) {
+            w->errors++;
+            if (fd != -1)
+                close(fd);
+            continue;
+        }
+        record_latency(w, now_us() - start);
+        w->bytes += 2 * protos[p].len;
+
+        if (protos[p].sslh_option && payload_size) {
+            n = transfer(fd);
+            if (n == -1) {
+                w->errors++;
+                close(fd);
+                continue;
+            }
+            w->bytes += n;
+        }
+        close(fd);
+        w->cnx[p]++;
+    }
+    return NULL;
+}
+
+
+/* Processes */
+
+static pid_t spawn(char* const argv[])
+{
+    pid_t pid;
+    int fd;
+
+    if (verbose) {
+        int i;
+        for (i = 0; argv[i]; i++)
+            fprintf(stderr, "%s ", argv[i]);
+        fprintf(stderr, "\n");
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid)
+        return pid;
+
+    /* Own process group, so everything it starts can be stopped at once */
+    setpgid(0, 0);
+    if (!verbose) {
+        fd = open("/dev/null", O_WRONLY);
+        dup2(fd, 1);
+        dup2(fd, 2);
+    }
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+}
+
+static void stop_process(pid_t pid)
+{
+    kill(-pid, SIGTERM);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    /* Whatever is left in the group (e.g. shovelers) */
+    usleep(100000);
+    kill(-pid, SIGKILL);
+}
+
+/* Waits until something accepts connections on port. Returns 0, or -1 if
+ * process pid died or nothing came up in 5 seconds */
+static int wait_port(int port, pid_t pid)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int i, fd, res;
+
+    for (i = 0; i < 100; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        res = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+        close(fd);
+        if (!res)
+            return 0;
+        usleep(50000);
+    }
+    return -1;
+}
+
+/* Memory of pid and all its descendants, in kB: proportional set size if the
+ * kernel gives it, resident set size otherwise */
+static long tree_memory_kb(pid_t root)
+{
+    struct { pid_t pid, ppid; int in; } *procs = NULL;
+    int num = 0, size = 0, i, changed;
+    char path[64], line[256], *s;
+    struct dirent* de;
+    long total = 0, kb, pages;
+    DIR* dir;
+    FILE* f;
+
+    dir = opendir("/proc");
+    if (!dir)
+        return -1;
+    while ((de = readdir(dir))) {
+        pid_t pid = atoi(de->d_name);
+        if (pid <= 0)
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        f = fopen(path, "r");
+        if (!f)
+            continue;
+        s = fgets(line, sizeof(line), f) ? strrchr(line, ')') : NULL;
+        fclose(f);
+        if (!s)
+            continue;
+        if (num == size) {
+            size = size ? size * 2 : 1024;
+            procs = realloc(procs, size * sizeof(*procs));
+            if (!procs) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        procs[num].pid = pid;
+        procs[num].ppid = atoi(s + 4);  /* after ") S " */
+        procs[num].in = pid == root;
+        num++;
+    }
+    closedir(dir);
+
+    do {
+        changed = 0;
+        for (i = 0; i < num; i++) {
+            int j;
+            if (procs[i].in)
+                continue;
+            for (j = 0; j < num; j++) {
+                if (procs[j].in && procs[j].pid == procs[i].ppid) {
+                    procs[i].in = changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+
+    for (i = 0; i < num; i++) {
+        if (!procs[i].in)
+            continue;
+        kb = -1;
+        snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", procs[i].pid);
+        f = fopen(path, "r");
+        if (f) {
+            while (fgets(line, sizeof(line), f))
+                if (sscanf(line, "Pss: %ld", &kb) == 1)
+                    break;
+            fclose(f);
+        }
+        if (kb == -1) {
+            snprintf(path, sizeof(path), "/proc/%d/statm", procs[i].pid);
+            f = fopen(path, "r");
+            if (f) {
+                if (fscanf(f, "%*d %ld", &pages) == 1)
+                    kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+                fclose(f);
+            }
+        }
+        if (kb > 0)
+            total += kb;
+    }
+    free(procs);
+    return total;
+}
+
+/* Opens idle_cnx connections, and returns how much more memory sslh uses
+ * with them, per 1000 connections, in kB; -1 if that failed */
+static long measure_idle_memory(pid_t sslh)
+{
+    int* fds = calloc(idle_cnx, sizeof(*fds));
+    long before, after = -1;
+    int i, n, p;
+
+    /* A TCP protocol of the mix; preferably not ssh, which sslh-select forks
+     * for when it's set up on the command line */
+    for (p = P_NUM - 1; p >= 0 && !(protos[p].weight && protos[p].sslh_option); p--)
+        ;
+    if (!fds || !idle_cnx || p < 0) {
+        free(fds);
+        return -1;
+    }
+
+    before = tree_memory_kb(sslh);
+    for (n = 0; n < idle_cnx; n++) {
+        fds[n] = open_cnx(p);
+        if (fds[n] == -1 || read_echo(fds[n], p)) {
+            if (fds[n] != -1)
+                close(fds[n]);
+            break;
+        }
+    }
+    if (n == idle_cnx) {
+        usleep(200000); /* let processes settle */
+        after = tree_memory_kb(sslh);
+    } else {
+        fprintf(stderr, "only %d idle connections could be opened\n", n);
+    }
+    for (i = 0; i < n; i++)
+        close(fds[i]);
+    free(fds);
+
+    if (after == -1)
+        return -1;
+    return (after - before) * 1000 / idle_cnx;
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(uint32_t* sorted, size_t len, double q)
+{
+    return len ? sorted[(size_t)((len - 1) * q)] : 0;
+}
+
+static const char* config_file;
+
+/* Writes a config file with the UDP listener and target, which can't be set
+ * on the command line. Returns its name. */
+static const char* write_udp_config(void)
+{
+    static char name[64];
+    FILE* f;
+
+    snprintf(name, sizeof(name), "/tmp/sslh-bench-%d.cfg", getpid());
+    f = fopen(name, "w");
+    if (!f) {
+        perror(name);
+        exit(1);
+    }
+    fprintf(f, "listen: ( { host: \"127.0.0.1\"; port: \"%d\"; is_udp: true; } );\n"
+            "protocols: ( { name: \"anyprot\"; host: \"127.0.0.1\"; port: \"%d\"; is_udp: true; } );\n",
+            base_port + 1, base_port + 20);
+    fclose(f);
+    return name;
+}
+
+static void run(const char* sslh)
+{
+    char ports[P_NUM][32], listen[32], prefixes[P_NUM][32], udp_echo_cfg[64];
+    char* sslh_argv[32];
+    pid_t echo_pids[P_NUM], sslh_pid;
+    struct worker* workers;
+    uint64_t start, elapsed, cnx_total = 0, errors = 0, bytes = 0;
+    uint32_t* lat;
+    size_t lat_len = 0;
+    long mem;
+    int i, j, argc = 0;
+    FILE* f;
+
+    /* Targets: an echosrv per protocol */
+    for (i = 0; i < P_NUM; i++) {
+        echo_pids[i] = 0;
+        if (!protos[i].weight)
+            continue;
+        snprintf(ports[i], sizeof(ports[i]), "127.0.0.1:%d", base_port + 10 + i);
+        snprintf(prefixes[i], sizeof(prefixes[i]), "%s: ", protos[i].name);
+        if (protos[i].sslh_option) {
+            char* argv[] = { (char*)echosrv, "--listen", ports[i], "--prefix", prefixes[i], NULL };
+            echo_pids[i] = spawn(argv);
+        } else {
+            snprintf(udp_echo_cfg, sizeof(udp_echo_cfg), "/tmp/sslh-bench-echo-%d.cfg", getpid());
+            f = fopen(udp_echo_cfg, "w");
+            if (!f) {
+                perror(udp_echo_cfg);
+                exit(1);
+            }
+            fprintf(f, "listen: ( { host: \"127.0.0.1\"; port: \"%d\"; is_udp: true; } );\n",
+                    base_port + 20);
+            fclose(f);
+            char* argv[] = { (char*)echosrv, "-F", udp_echo_cfg, "--prefix", prefixes[i], NULL };
+            echo_pids[i] = spawn(argv);
+        }
+    }
+    for (i = 0; i < P_NUM; i++) {
+        if (echo_pids[i] && protos[i].sslh_option && wait_port(base_port + 10 + i, echo_pids[i])) {
+            fprintf(stderr, "%s: echosrv for %s did not start\n", sslh, protos[i].name);
+            goto stop_echo;
+        }
+    }
+
+    snprintf(listen, sizeof(listen), "127.0.0.1:%d", base_port);
+    sslh_argv[argc++] = (char*)sslh;
+    sslh_argv[argc++] = "-f";
+    sslh_argv[argc++] = "--numeric";
+    sslh_argv[argc++] = "--syslog-facility";
+    sslh_argv[argc++] = "none";
+    sslh_argv[argc++] = "-p";
+    sslh_argv[argc++] = listen;
+    if (config_file) {
+        sslh_argv[argc++] = "-F";
+        sslh_argv[argc++] = (char*)config_file;
+    }
+    for (i = 0; i < P_NUM; i++) {
+        if (protos[i].weight && protos[i].sslh_option) {
+            sslh_argv[argc++] = (char*)protos[i].sslh_option;
+            sslh_argv[argc++] = ports[i];
+        }
+    }
+    sslh_argv[argc] = NULL;
+    sslh_pid = spawn(sslh_argv);
+    if (wait_port(base_port, sslh_pid)) {
+        fprintf(stderr, "%s did not start\n", sslh);
+        stop_process(sslh_pid);
+        goto stop_echo;
+    }
+
+    mem = measure_idle_memory(sslh_pid);
+
+    workers = calloc(num_threads, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        exit(1);
+    }
+    stop = 0;
+    start = now_us();
+    for (i = 0; i < num_threads; i++) {
+        workers[i].seed = i + 1;
+        pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    }
+    sleep(duration);
+    stop = 1;
+    for (i = 0; i < num_threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    elapsed = now_us() - start;
+
+    stop_process(sslh_pid);
+
+    /* Results */
+    for (i = 0; i < num_threads; i++) {
+        lat_len += workers[i].lat_len;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        for (j = 0; j < P_NUM; j++)
+            cnx_total += workers[i].cnx[j];
+    }
+    lat = malloc((lat_len + 1) * sizeof(*lat));
+    if (!lat) {
+        perror("malloc");
+        exit(1);
+    }
+    lat_len = 0;
+    for (i = 0; i < num_threads; i++) {
+        memcpy(lat + lat_len, workers[i].lat, workers[i].lat_len * sizeof(*lat));
+        lat_len += workers[i].lat_len;
+    }
+    qsort(lat, lat_len, sizeof(*lat), cmp_u32);
+
+    if (json) {
+        printf("{\"server\":\"%s\",\"threads\":%d,\"duration_s\":%.3f,"
+               "\"connections\":%llu,\"errors\":%llu,\"cps\":%.1f,"
+               "\"probe_p50_us\":%u,\"probe_p99_us\":%u,\"probe_p999_us\":%u,"
+               "\"bytes_per_s\":%.0f,\"mem_kb_per_1k\":%ld",
+               sslh, num_threads, elapsed / 1e6,
+               (unsigned long long)cnx_total, (unsigned long long)errors,
+               cnx_total * 1e6 / elapsed,
+               percentile(lat, lat_len, .5), percentile(lat, lat_len, .99),
+               percentile(lat, lat_len, .999),
+               bytes * 1e6 / elapsed, mem);
+        for (j = 0; j < P_NUM; j++) {
+            uint64_t n = 0;
+            for (i = 0; i < num_threads; i++)
+                n += workers[i].cnx[j];
+            printf(",\"cnx_%s\":%llu", protos[j].name, (unsigned long long)n);
+        }
+        printf("}\n");
+    } else {
+        printf("%s:\n", sslh);
+        printf("  %llu connections in %.1fs: %.0f/s, %llu errors\n",
+               (unsigned long long)cnx_total, elapsed / 1e6,
+               cnx_total * 1e6 / elapsed, (unsigned long long)errors);
+        printf("  probe latency: p50 %uus  p99 %uus  p99.9 %uus\n",
+               percentile(lat, lat_len, .5), percentile(lat, lat_len, .99),
+               percentile(lat, lat_len, .999));
+        printf("  throughput: %.1f MB/s\n", bytes / (elapsed / 1e6) / 1e6);
+        if (mem >= 0)
+            printf("  memory: %ld kB per 1000 idle connections\n", mem);
+    }
+    fflush(stdout);
+
+    for (i = 0; i < num_threads; i++)
+        free(workers[i].lat);
+    free(workers);
+    free(lat);
+
+stop_echo:
+    for (i = 0; i < P_NUM; i++)
+        if (echo_pids[i])
+            stop_process(echo_pids[i]);
+    if (protos[P_UDP].weight)
+        unlink(udp_echo_cfg);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: sslh-bench [options] <sslh binary>...\n"
+            "  -t <n>     client threads (default %d)\n"
+            "  -d <s>     seconds of load for each binary (default %d)\n"
+            "  -m <mix>   protocol mix (default ssh=25,tls=25,http=25,openvpn=15,udp=10)\n"
+            "  -s <n>     bytes sent and echoed on each TCP connection (default %d)\n"
+            "  -k <n>     idle connections to measure memory with (default %d)\n"
+            "  -p <port>  first port to use (default %d)\n"
+            "  -e <path>  echosrv binary (default %s)\n"
+            "  -j         print results as JSON, one line per binary\n"
+            "  -v         show the commands run and their output\n",
+            num_threads, duration, payload_size, idle_cnx, base_port, echosrv);
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    struct rlimit rl;
+    int c, i, total = 0;
+
+    parse_mix("ssh=25,tls=25,http=25,openvpn=15,udp=10");
+    while ((c = getopt(argc, argv, "t:d:m:s:k:p:e:jv")) != -1) {
+        switch (c) {
+        case 't': num_threads = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'm': parse_mix(optarg); break;
+        case 's': payload_size = atoi(optarg); break;
+        case 'k': idle_cnx = atoi(optarg); break;
+        case 'p': base_port = atoi(optarg); break;
+        case 'e': echosrv = optarg; break;
+        case 'j': json = 1; break;
+        case 'v': verbose = 1; break;
+        default: usage();
+        }
+    }
+    for (i = 0; i < P_NUM; i++)
+        total += protos[i].weight;
+    if (optind == argc || num_threads < 1 || duration < 1 || total < 1)
+        usage();
+
+    setup_messages();
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Idle connections need many file descriptors, in sslh too */
+    if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    memset(&sslh_tcp, 0, sizeof(sslh_tcp));
+    sslh_tcp.sin_family = AF_INET;
+    sslh_tcp.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sslh_tcp.sin_port = htons(base_port);
+    sslh_udp = sslh_tcp;
+    sslh_udp.sin_port = htons(base_port + 1);
+
+    if (protos[P_UDP].weight)
+        config_file = write_udp_config();
+
+    for (i = optind; i < argc; i++)
+        run(argv[i]);
+
+    if (config_file)
+        unlink(config_file);
+    return 0;
+}
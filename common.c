@@ -13,10 +13,13 @@
 #include <sys/types.h>
 #include <ifaddrs.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "common.h"
 #include "probe.h"
 #include "sslh-conf.h"
+#include "backends.h"
+#include "regex-probe.h"
 
 /* Added to make the code compilable under CYGWIN
  * */
@@ -38,6 +41,68 @@
  * Settings that depend on the command line or the config file
  */
 struct sslhcfg_item cfg;
+int config_generation = 1;
+volatile sig_atomic_t reload_requested = 0;
+volatile sig_atomic_t upgrade_requested = 0;
+volatile sig_atomic_t drain_requested = 0;
+
+/* The protocols of a configuration, kept until nothing uses them anymore */
+struct config_ref {
+    int refcnt;
+    struct sslhcfg_protocols_item* protocols;
+    size_t protocols_len;
+};
+
+/* Those of cfg, NULL before config_track() */
+static struct config_ref* current_config = NULL;
+
+void config_free_protocols(struct sslhcfg_protocols_item* protocols, size_t len)
+{
+    struct sslhcfg_protocols_item* p;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        p = &protocols[i];
+        if (!strcmp(p->name, "tls"))
+            tls_data_free(p->data);
+        if (!strcmp(p->name, "regex"))
+            regex_free(p);
+        backends_put(p->pool);
+    }
+    free(protocols);
+}
+
+void config_track(void)
+{
+    struct config_ref* previous = current_config;
+
+    current_config = calloc(1, sizeof(*current_config));
+    CHECK_ALLOC(current_config, "calloc");
+    current_config->refcnt = 1;     /* for being cfg's */
+    current_config->protocols = cfg.protocols;
+    current_config->protocols_len = cfg.protocols_len;
+    config_put(previous);
+}
+
+struct config_ref* config_get(void)
+{
+    if (current_config)
+        __atomic_add_fetch(&current_config->refcnt, 1, __ATOMIC_RELAXED);
+    return current_config;
+}
+
+void config_put(struct config_ref* c)
+{
+    if (!c || __atomic_sub_fetch(&c->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+    print_verbose(1, "freeing a previous configuration, %zu protocols\n",
+                  c->protocols_len);
+    config_free_protocols(c->protocols, c->protocols_len);
+    free(c);
+}
+
+/* Main process of the sslh we take over from (see upgrade_start()), or 0 */
+static pid_t upgrade_pid = 0;
 
 struct addrinfo *addr_listen = NULL; /* what addresses do we listen to? */
 
@@ -70,6 +135,126 @@ void check_res_dump(CR_ACTION act, int res, struct addrinfo *addr, char* syscall
     }
 }
 
+/* Returns 1 if inherited socket fd is one of the listen entries that expects
+ * PROXY headers */
+static int fd_proxy_protocol(int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    struct addrinfo *addr, *start_addr;
+    int i, found = 0;
+
+    if (getsockname(fd, (struct sockaddr*)&ss, &len) == -1)
+        return 0;
+
+    for (i = 0; !found && i < cfg.listen_len; i++) {
+        if (!cfg.listen[i].proxy_protocol || cfg.listen[i].is_udp)
+            continue;
+        if (resolve_split_name(&start_addr, cfg.listen[i].host, cfg.listen[i].port))
+            continue;
+        for (addr = start_addr; addr && !found; addr = addr->ai_next)
+            found = (addr->ai_addrlen == len && !memcmp(addr->ai_addr, &ss, len));
+        freeaddrinfo(start_addr);
+    }
+    return found;
+}
+
+/* Makes `copies` sets of the inherited sockets, by duplicating the file
+ * descriptors: all copies share the same socket.
+ * Returns the total number of sockets. */
+static int copy_fd_sockets(struct listen_endpoint *sockfd[], int num_addr, int copies)
+{
+    int i, c;
+
+    *sockfd = realloc(*sockfd, num_addr * copies * sizeof(**sockfd));
+    CHECK_ALLOC(*sockfd, "realloc");
+    for (c = 1; c < copies; c++) {
+        for (i = 0; i < num_addr; i++) {
+            (*sockfd)[c * num_addr + i].socketfd = dup((*sockfd)[i].socketfd);
+            CHECK_RES_DIE((*sockfd)[c * num_addr + i].socketfd, "dup");
+            (*sockfd)[c * num_addr + i].type = (*sockfd)[i].type;
+            (*sockfd)[c * num_addr + i].proxy_protocol = (*sockfd)[i].proxy_protocol;
+        }
+    }
+    return num_addr * copies;
+}
+
+/* Gets the listening sockets handed over by the sslh we are upgrading (see
+ * upgrade_start()), in the environment: SSLH_LISTEN_FDS lists them, in the
+ * order of its own copies (SSLH_LISTEN_COPIES of them), and SSLH_UPGRADE_PID
+ * says who to tell once we are ready (see upgrade_finish()).
+ * Returns the number of sockets, 0 if not upgrading. */
+static int get_upgrade_sockets(struct listen_endpoint *sockfd[], int copies)
+{
+    char *fds, *end;
+    const char* s;
+    int i, n = 0, old_copies = 1;
+    socklen_t len;
+    long fd;
+
+    fds = getenv("SSLH_LISTEN_FDS");
+    if (!fds)
+        return 0;
+
+    *sockfd = NULL;
+    for (s = fds; *s; s = end) {
+        fd = strtol(s, &end, 10);
+        if (end == s || (*end && *end != ',')) {
+            fprintf(stderr, "SSLH_LISTEN_FDS: %s: bad value\n", fds);
+            exit(1);
+        }
+        if (*end) end++;
+        n++;
+        *sockfd = realloc(*sockfd, n * sizeof(**sockfd));
+        CHECK_ALLOC(*sockfd, "realloc");
+        (*sockfd)[n - 1].socketfd = fd;
+        len = sizeof((*sockfd)[n - 1].type);
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &(*sockfd)[n - 1].type, &len) == -1) {
+            fprintf(stderr, "SSLH_LISTEN_FDS: %ld: %s\n", fd, strerror(errno));
+            exit(1);
+        }
+        (*sockfd)[n - 1].proxy_protocol = fd_proxy_protocol(fd);
+    }
+
+    s = getenv("SSLH_LISTEN_COPIES");
+    if (s && atoi(s) > 0 && !(n % atoi(s)))
+        old_copies = atoi(s);
+    s = getenv("SSLH_UPGRADE_PID");
+    if (s)
+        upgrade_pid = atoi(s);
+
+    /* Not for whatever we might start */
+    unsetenv("SSLH_LISTEN_FDS");
+    unsetenv("SSLH_LISTEN_COPIES");
+    unsetenv("SSLH_UPGRADE_PID");
+
+    print_verbose(1, "taking over %d listening sockets from %d\n", n, upgrade_pid);
+    if (old_copies == copies)
+        return n;
+
+    /* The number of threads changed: keep the first copy only. The other
+     * copies lose the connections queued on them when the old sslh closes
+     * them. */
+    log_message(LOG_WARNING, "%d listening sockets per address inherited, %d wanted\n",
+                old_copies, copies);
+    n /= old_copies;
+    for (i = n; i < n * old_copies; i++)
+        close((*sockfd)[i].socketfd);
+    return copy_fd_sockets(sockfd, n, copies);
+}
+
+void upgrade_finish(void)
+{
+    if (!upgrade_pid)
+        return;
+
+    if (kill(upgrade_pid, SIGQUIT) == -1)
+        log_message(LOG_ERR, "upgrade: cannot stop %d: %s\n", upgrade_pid, strerror(errno));
+    else
+        log_message(LOG_INFO, "upgrade: took over from %d\n", upgrade_pid);
+    upgrade_pid = 0;
+}
+
 int get_fd_sockets(struct listen_endpoint *sockfd[])
 {
     int sd = 0;
@@ -87,6 +272,7 @@ int get_fd_sockets(struct listen_endpoint *sockfd[])
       for (i = 0; i < sd; i++) {
         (*sockfd)[i].socketfd = SD_LISTEN_FDS_START + i;
         (*sockfd)[i].type = SOCK_STREAM;
+        (*sockfd)[i].proxy_protocol = fd_proxy_protocol(SD_LISTEN_FDS_START + i);
       }
     }
 #endif
@@ -95,9 +281,9 @@ int get_fd_sockets(struct listen_endpoint *sockfd[])
 }
 
 /* Set TCP_FASTOPEN on listening socket if all client protocols support it */
-int make_listen_tfo(int s)
+int make_listen_tfo(int s, int qlen)
 {
-    int i, qlen = 5;
+    int i;
 
     /* Don't do it if not supported */
     if (!TCP_FASTOPEN)
@@ -109,16 +295,27 @@ int make_listen_tfo(int s)
             return 0;
     }
 
-    return setsockopt(s, SOL_SOCKET, TCP_FASTOPEN, (char*)&qlen, sizeof(qlen));
+    return setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, (char*)&qlen, sizeof(qlen));
 }
 
 /* Starts listening on a single address 
+ * entry: the listen entry with the socket options, or NULL for a plain TCP
+ * socket
+ * If reuseport is set, SO_REUSEPORT is set so several sockets can be bound to
+ * the same address, the kernel spreading incoming connections between them.
  * Returns a socket filehandle, or dies with message in case of major error */
-int listen_single_addr(struct addrinfo* addr, int keepalive, int udp)
+int listen_single_addr(struct addrinfo* addr, const struct sslhcfg_listen_item* entry, int reuseport)
 {
     struct sockaddr_storage *saddr;
+    int keepalive = 0, udp = 0, backlog = 50;
     int sockfd, one, res;
 
+    if (entry) {
+        keepalive = entry->keepalive;
+        udp = entry->is_udp;
+        backlog = entry->backlog;
+    }
+
     saddr = (struct sockaddr_storage*)addr->ai_addr;
 
     sockfd = socket(saddr->ss_family, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
@@ -128,8 +325,30 @@ int listen_single_addr(struct addrinfo* addr, int keepalive, int udp)
     res = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char*)&one, sizeof(one));
     check_res_dump(CR_DIE, res, addr, "setsockopt(SO_REUSEADDR)");
 
-    res = make_listen_tfo(sockfd);
-    check_res_dump(CR_WARN, res, addr, "setsockopt(TCP_FASTOPEN)");
+#ifdef SO_REUSEPORT
+    if (reuseport) {
+        res = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (char*)&one, sizeof(one));
+        check_res_dump(CR_DIE, res, addr, "setsockopt(SO_REUSEPORT)");
+    }
+#else
+    if (reuseport) {
+        fprintf(stderr, "SO_REUSEPORT is not supported on this system\n");
+        exit(1);
+    }
+#endif
+
+    if (entry && !udp) {
+        res = make_listen_tfo(sockfd, entry->tfo_queue);
+        check_res_dump(CR_WARN, res, addr, "setsockopt(TCP_FASTOPEN)");
+    }
+
+#ifdef TCP_DEFER_ACCEPT
+    if (entry && !udp && entry->defer_accept) {
+        res = setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                         &entry->defer_accept, sizeof(entry->defer_accept));
+        check_res_dump(CR_WARN, res, addr, "setsockopt(TCP_DEFER_ACCEPT)");
+    }
+#endif
 
     if (keepalive) {
         res = setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, (char*)&one, sizeof(one));
@@ -150,7 +369,7 @@ int listen_single_addr(struct addrinfo* addr, int keepalive, int udp)
     check_res_dump(CR_DIE, res, addr, "bind");
 
     if (!udp) {
-        res = listen (sockfd, 50);
+        res = listen (sockfd, backlog);
         check_res_dump(CR_DIE, res, addr, "listen");
     }
 
@@ -158,57 +377,73 @@ int listen_single_addr(struct addrinfo* addr, int keepalive, int udp)
 }
 
 /* Starts listening sockets on specified addresses.
+ * copies: number of sockets to bind to each address (using SO_REUSEPORT if
+ * more than one). All the sockets of copy 0 come first, then all the
+ * sockets of copy 1, and so on.
  * OUT: *sockfd[]  pointer to newly-allocated array of listen_endpoint objects
- * Returns number of addresses bound
+ * Returns number of sockets bound
    */
-int start_listen_sockets(struct listen_endpoint *sockfd[])
+int start_listen_sockets(struct listen_endpoint *sockfd[], int copies)
 {
     struct addrinfo *addr, *start_addr;
     char buf[NI_MAXHOST];
-    int i, res;
-    int num_addr = 0, keepalive = 0, udp = 0;
+    int i, c, res;
+    int num_addr = 0, udp = 0;
     int sd_socks = 0;
 
+    sd_socks = get_upgrade_sockets(sockfd, copies);
+    if (sd_socks > 0)
+        return sd_socks;
+
     sd_socks = get_fd_sockets(sockfd);
 
     if (sd_socks > 0) {
-        return sd_socks;
+        return copy_fd_sockets(sockfd, sd_socks, copies);
     }
 
     *sockfd = NULL;
 
-    if (cfg.verbose) fprintf(stderr, "Listening to:\n");
-
-    for (i = 0; i < cfg.listen_len; i++) {
-        keepalive = cfg.listen[i].keepalive;
-        udp = cfg.listen[i].is_udp;
-
-        res = resolve_split_name(&start_addr, cfg.listen[i].host, cfg.listen[i].port);
-        if (res) exit(4);
-
-        for (addr = start_addr; addr; addr = addr->ai_next) {
-            num_addr++;
-            *sockfd = realloc(*sockfd, num_addr * sizeof(*sockfd));
-            (*sockfd)[num_addr-1].socketfd = listen_single_addr(addr, keepalive, udp);
-            (*sockfd)[num_addr-1].type = udp ? SOCK_DGRAM : SOCK_STREAM;
-            if (cfg.verbose)
-                fprintf(stderr, "%d:\t%s\t[%s]\n", (*sockfd)[num_addr-1].socketfd, sprintaddr(buf, sizeof(buf), addr),
-                        cfg.listen[i].keepalive ? "keepalive" : "");
+    print_verbose(1, "Listening to:\n");
+
+    for (c = 0; c < copies; c++) {
+        for (i = 0; i < cfg.listen_len; i++) {
+            udp = cfg.listen[i].is_udp;
+
+            res = resolve_split_name(&start_addr, cfg.listen[i].host, cfg.listen[i].port);
+            if (res) exit(4);
+
+            for (addr = start_addr; addr; addr = addr->ai_next) {
+                num_addr++;
+                *sockfd = realloc(*sockfd, num_addr * sizeof(**sockfd));
+                CHECK_ALLOC(*sockfd, "realloc");
+                (*sockfd)[num_addr-1].socketfd = listen_single_addr(addr, &cfg.listen[i], copies > 1);
+                (*sockfd)[num_addr-1].type = udp ? SOCK_DGRAM : SOCK_STREAM;
+                (*sockfd)[num_addr-1].proxy_protocol = !udp && cfg.listen[i].proxy_protocol;
+                print_verbose(1, "%d:\t%s\t[%s%s]\n", (*sockfd)[num_addr-1].socketfd, sprintaddr(buf, sizeof(buf), addr),
+                              cfg.listen[i].keepalive ? "keepalive" : "",
+                              (*sockfd)[num_addr-1].proxy_protocol ? " proxy_protocol" : "");
+            }
+            freeaddrinfo(start_addr);
         }
-        freeaddrinfo(start_addr);
     }
 
     return num_addr;
 }
 
 
-/* returns 1 if given address is on the local machine: iterate through all
- * network interfaces and check their addresses */
+/* returns 1 if given address is on the local machine: look it up in the
+ * cache of interface addresses or, without it, iterate through all network
+ * interfaces and check their addresses */
 int is_same_machine(struct addrinfo* from)
 {
     struct ifaddrs *ifaddrs_p = NULL, *ifa;
-    int match = 0;
+    int match;
+
+    match = localaddr_lookup(from->ai_addr);
+    if (match != -1)
+        return match;
 
+    match = 0;
     getifaddrs(&ifaddrs_p);
 
     for (ifa = ifaddrs_p; ifa != NULL; ifa = ifa->ifa_next)
@@ -243,10 +478,29 @@ int is_same_machine(struct addrinfo* from)
 }
 
 
+/* Copies the client address of cnx to addr, whose ai_addr must point to a
+ * struct sockaddr_storage. Only calls getpeername() if accept() didn't give
+ * it. Returns -1 on error. */
+int get_peer_addr(const struct connection* cnx, struct addrinfo* addr)
+{
+    socklen_t len = sizeof(struct sockaddr_storage);
+    int res;
+
+    if (cnx->peer_len) {
+        memcpy(addr->ai_addr, &cnx->peer, cnx->peer_len);
+        addr->ai_addrlen = cnx->peer_len;
+        return 0;
+    }
+
+    res = getpeername(cnx->q[0].fd, addr->ai_addr, &len);
+    addr->ai_addrlen = len;
+    return res;
+}
+
 /* Transparent proxying: bind the peer address of fd to the peer address of
- * fd_from */
+ * the client of cnx */
 #define IP_TRANSPARENT 19
-int bind_peer(int fd, int fd_from)
+int bind_peer(int fd, const struct connection* cnx)
 {
     struct addrinfo from;
     struct sockaddr_storage ss;
@@ -254,11 +508,10 @@ int bind_peer(int fd, int fd_from)
 
     memset(&from, 0, sizeof(from));
     from.ai_addr = (struct sockaddr*)&ss;
-    from.ai_addrlen = sizeof(ss);
 
     /* getpeername can fail with ENOTCONN if connection was dropped before we
      * got here */
-    res = getpeername(fd_from, from.ai_addr, &from.ai_addrlen);
+    res = get_peer_addr(cnx, &from);
     CHECK_RES_RETURN(res, "getpeername", res);
 
     /* if the destination is the same machine, there's no need to do bind */
@@ -285,88 +538,139 @@ int bind_peer(int fd, int fd_from)
     return 0;
 }
 
-/* Connect to first address that works and returns a file descriptor, or -1 if
- * none work.
- * If transparent proxying is on, use fd_from peer address on external address
- * of new file descriptor. */
-int connect_addr(struct connection *cnx, int fd_from)
+/* splice() shoveling (Linux): data is moved from the socket it was read from
+ * to a pipe, then from the pipe to the target socket, so it never gets copied
+ * to user space. Each queue has its own pipe, which holds the data read for
+ * it that could not be written yet. */
+#ifdef SPLICE_F_MOVE
+/* As much as a pipe holds by default */
+#define SPLICE_SIZE 65536
+
+/* Writes as much of the pipe of q as possible to q's socket.
+ * Returns number of bytes written, or -1 if nothing could be written */
+static int flush_pipe(struct queue *q)
 {
-    struct addrinfo *a, from;
-    struct sockaddr_storage ss;
-    char buf[NI_MAXHOST];
-    int fd, res, one;
-    int transparent = cnx->proto->transparent || cfg.transparent;
+    ssize_t n;
+    int total = 0;
+
+    while (q->pipe_data_size) {
+        n = splice(q->pipe_fd[0], NULL, q->fd, NULL, q->pipe_data_size, SPLICE_F_MOVE);
+        if (n <= 0)
+            return total ? total : -1;
+        q->pipe_data_size -= n;
+        total += n;
+    }
+    return total;
+}
 
-    memset(&from, 0, sizeof(from));
-    from.ai_addr = (struct sockaddr*)&ss;
-    from.ai_addrlen = sizeof(ss);
+/* Same as fd2fd(), through the pipe of target_q */
+static int fd2fd_splice(struct queue *target_q, struct queue *from_q)
+{
+    ssize_t size_r;
+    int res;
 
-    res = getpeername(fd_from, from.ai_addr, &from.ai_addrlen);
-    CHECK_RES_RETURN(res, "getpeername", res);
+    size_r = splice(from_q->fd, NULL, target_q->pipe_fd[1], NULL, SPLICE_SIZE,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (size_r == -1) {
+        switch (errno) {
+        case EAGAIN:
+            print_verbose(1, "splicing 0 from %d\n", from_q->fd);
+            return FD_NODATA;
+
+        case ECONNRESET:
+        case EPIPE:
+            return FD_CNXCLOSED;
+        }
+    }
 
-    for (a = cnx->proto->saddr; a; a = a->ai_next) {
-        /* When transparent, make sure both connections use the same address family */
-        if (transparent && a->ai_family != from.ai_addr->sa_family)
-            continue;
-        if (cfg.verbose)
-            fprintf(stderr, "connecting to %s family %d len %d\n",
-                    sprintaddr(buf, sizeof(buf), a),
-                    a->ai_addr->sa_family, a->ai_addrlen);
-
-        /* XXX Needs to match ai_family from fd_from when being transparent! */
-        fd = socket(a->ai_family, SOCK_STREAM, 0);
-        if (fd == -1) {
-            log_message(LOG_ERR, "forward to %s failed:socket: %s\n",
-                        cnx->proto->name, strerror(errno));
-        } else {
-            one = 1;
-            setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
-            /* no need to check return value; if it's not supported, that's okay */
-
-            if (transparent) {
-                res = bind_peer(fd, fd_from);
-                CHECK_RES_RETURN(res, "bind_peer", res);
-            }
-            res = connect(fd, a->ai_addr, a->ai_addrlen);
-            if (res == -1) {
-                switch (errno) {
-                case EINPROGRESS: 
-                    /* Can't be done yet, or TFO already done */
-                    break;
+    CHECK_RES_RETURN(size_r, "splice", FD_CNXCLOSED);
 
-                default:
-                    log_message(LOG_ERR, "forward to %s failed:connect: %s\n",
-                                cnx->proto->name, strerror(errno));
-                    close(fd);
-                }
-            } else {
-                if (cnx->proto->keepalive) {
-                    res = setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (char*)&one, sizeof(one));
-                    CHECK_RES_RETURN(res, "setsockopt(SO_KEEPALIVE)", res);
-                }
-                return fd;
-            }
+    if (size_r == 0)
+        return FD_CNXCLOSED;
+
+    from_q->bytes += size_r;
+    target_q->pipe_data_size += size_r;
+
+    /* Older data is still waiting in the buffer: it has to go first */
+    if (target_q->deferred_data)
+        return FD_STALLED;
+
+    res = flush_pipe(target_q);
+    if (res == -1) {
+        switch (errno) {
+        case EAGAIN:
+            return FD_STALLED;
+
+        case ECONNRESET:
+        case EPIPE:
+            return FD_CNXCLOSED;
+        }
+    }
+
+    CHECK_RES_RETURN(res, "splice", FD_CNXCLOSED);
+
+    if (target_q->pipe_data_size)
+        return FD_STALLED;
+
+    return size_r;
+}
+#endif
+
+/* Sets up splice() shoveling for cnx if its protocol asks for it. This is not
+ * fatal if it fails: fd2fd() just falls back to read() and write() */
+void setup_splice(struct connection *cnx)
+{
+#ifdef SPLICE_F_MOVE
+    int i, res;
+
+    if (!cnx->proto || !cnx->proto->splice)
+        return;
+
+    for (i = 0; i < 2; i++) {
+        res = pipe2(cnx->q[i].pipe_fd, O_NONBLOCK | O_CLOEXEC);
+        if (res == -1) {
+            log_message(LOG_ERR, "pipe2: %s -- not using splice\n", strerror(errno));
+            cnx->q[i].pipe_fd[0] = cnx->q[i].pipe_fd[1] = -1;
+            release_splice(cnx);
+            return;
+        }
+    }
+#endif
+}
+
+/* Closes the pipes of cnx, if any */
+void release_splice(struct connection *cnx)
+{
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            if (cnx->q[i].pipe_fd[j] != -1)
+                close(cnx->q[i].pipe_fd[j]);
+            cnx->q[i].pipe_fd[j] = -1;
         }
+        cnx->q[i].pipe_data_size = 0;
     }
-    return -1;
 }
 
-/* Store some data to write to the queue later */
+/* Store some data to write to the queue later.
+ * Returns -1 if the data did not all fit below the high-water mark (callers
+ * are expected to check deferred_data_space() first) */
 int defer_write(struct queue *q, void* data, int data_size)
 {
-    char *p;
-    ptrdiff_t data_offset = q->deferred_data - q->begin_deferred_data;
-    if (cfg.verbose)
-        fprintf(stderr, "**** writing deferred on fd %d\n", q->fd);
+    size_t n;
 
-    p = realloc(q->begin_deferred_data, data_offset + q->deferred_data_size + data_size);
-    CHECK_ALLOC(p, "realloc");
+    print_verbose(1, "**** writing deferred on fd %d\n", q->fd);
 
-    q->begin_deferred_data = p;
-    q->deferred_data = p + data_offset;
-    p += data_offset + q->deferred_data_size;
-    q->deferred_data_size += data_size;
-    memcpy(p, data, data_size);
+    if (!q->deferred_data)
+        q->deferred_data = ring_new();
+
+    n = ring_write(q->deferred_data, data, data_size);
+    if (n < data_size) {
+        log_message(LOG_ERR, "deferred data overflow on fd %d: %d bytes lost\n",
+                    q->fd, data_size - (int)n);
+        return -1;
+    }
 
     return 0;
 }
@@ -377,46 +681,131 @@ int defer_write(struct queue *q, void* data, int data_size)
  * */
 int flush_deferred(struct queue *q)
 {
-    int n;
+    struct iovec iov[2];
+    int n = 0, iovcnt;
 
-    if (cfg.verbose)
-        fprintf(stderr, "flushing deferred data to fd %d\n", q->fd);
+    print_verbose(1, "flushing deferred data to fd %d\n", q->fd);
 
-    n = write(q->fd, q->deferred_data, q->deferred_data_size);
-    if (n == -1)
-        return n;
+    if (q->deferred_data) {
+        iovcnt = ring_iov(q->deferred_data, iov);
+        n = iovcnt ? writev(q->fd, iov, iovcnt) : 0;
+        if (n == -1)
+            return n;
 
-    if (n == q->deferred_data_size) {
-        /* All has been written -- release the memory */
-        free(q->begin_deferred_data);
-        q->begin_deferred_data = NULL;
-        q->deferred_data = NULL;
-        q->deferred_data_size = 0;
-    } else {
-        /* There is data left */
-        q->deferred_data += n;
-        q->deferred_data_size -= n;
+        ring_consume(q->deferred_data, n);
+        if (ring_len(q->deferred_data)) {
+            /* There is data left */
+            return n;
+        }
+
+        /* All has been written -- give the buffer back */
+        release_deferred_data(q);
     }
 
+#ifdef SPLICE_F_MOVE
+    /* Data that came through splice() is more recent than the buffer, so it
+     * goes once the buffer is empty */
+    if (q->pipe_data_size) {
+        int res = flush_pipe(q);
+        if (res == -1)
+            return n ? n : res;
+        n += res;
+    }
+#endif
+
     return n;
 }
 
+/* Returns true if some data is waiting to be written to the queue */
+int has_deferred_data(struct queue *q)
+{
+    return (q->deferred_data && ring_len(q->deferred_data)) || q->pipe_data_size;
+}
+
+/* Returns true if no more data should be read for that queue until some has
+ * been written: the buffer reached the high-water mark, or data is waiting in
+ * the splice pipe */
+int deferred_data_full(struct queue *q)
+{
+    return !deferred_data_space(q) || q->pipe_data_size;
+}
+
+/* Number of bytes that can still be deferred on that queue */
+int deferred_data_space(struct queue *q)
+{
+    if (!q->deferred_data)
+        return ring_capacity();
+    return ring_space(q->deferred_data);
+}
+
+/* Returns the deferred data as one contiguous block (this is used to probe
+ * the data before it gets sent), or NULL if there is none */
+void* get_deferred_data(struct queue *q, int *data_size)
+{
+    if (!q->deferred_data) {
+        *data_size = 0;
+        return NULL;
+    }
+
+    *data_size = ring_len(q->deferred_data);
+    return ring_linearize(q->deferred_data);
+}
+
+/* Drops whatever data is deferred on the queue */
+void release_deferred_data(struct queue *q)
+{
+    if (q->deferred_data)
+        ring_free(q->deferred_data);
+    q->deferred_data = NULL;
+}
+
 
 void init_cnx(struct connection *cnx)
 {
+    int i;
+
     memset(cnx, 0, sizeof(*cnx));
-    cnx->q[0].fd = -1;
-    cnx->q[1].fd = -1;
+    for (i = 0; i < 2; i++) {
+        cnx->q[i].fd = -1;
+        cnx->q[i].pipe_fd[0] = -1;
+        cnx->q[i].pipe_fd[1] = -1;
+    }
     cnx->proto = NULL;
 }
 
+/* Gives cnx the state it needs to be probed and connected. Returns 0, or -1
+ * if it can't be allocated. */
+int cnx_setup_new(struct connection *cnx)
+{
+    cnx->setup = calloc(1, sizeof(*cnx->setup));
+    if (!cnx->setup)
+        return -1;
+    connect_init(cnx);
+    metrics_memory(MEM_SETUP, sizeof(*cnx->setup));
+    return 0;
+}
+
+/* Frees the setup state of cnx, if it has one */
+void cnx_setup_free(struct connection *cnx)
+{
+    if (!cnx->setup)
+        return;
+    free(cnx->setup);
+    cnx->setup = NULL;
+    metrics_memory(MEM_SETUP, -(long)sizeof(struct cnx_setup));
+}
+
 void dump_connection(struct connection *cnx)
 {
+    void* data;
+    int i, size;
+
     printf("state: %d\n", cnx->state);
-    printf("0: fd %d, %d deferred\n", cnx->q[0].fd, cnx->q[0].deferred_data_size);
-    hexdump(cnx->q[0].deferred_data, cnx->q[0].deferred_data_size);
-    printf("1: fd %d, %d deferred\n", cnx->q[1].fd, cnx->q[1].deferred_data_size);
-    hexdump(cnx->q[1].deferred_data, cnx->q[1].deferred_data_size);
+    for (i = 0; i < 2; i++) {
+        data = get_deferred_data(&cnx->q[i], &size);
+        printf("%d: fd %d, %d deferred\n", i, cnx->q[i].fd, size);
+        hexdump(data, size);
+    }
 }
 
 
@@ -434,15 +823,26 @@ int fd2fd(struct queue *target_q, struct queue *from_q)
    char buffer[BUFSIZ];
    int target, from, size_r, size_w;
 
+#ifdef SPLICE_F_MOVE
+   if (target_q->pipe_fd[0] != -1)
+       return fd2fd_splice(target_q, from_q);
+#endif
+
    target = target_q->fd;
    from = from_q->fd;
 
-   size_r = read(from, buffer, sizeof(buffer));
+   /* Don't read more than we can defer */
+   size_r = deferred_data_space(target_q);
+   if (!size_r)
+       return FD_STALLED;
+   if (size_r > sizeof(buffer))
+       size_r = sizeof(buffer);
+
+   size_r = read(from, buffer, size_r);
    if (size_r == -1) {
        switch (errno) {
        case EAGAIN:
-           if (cfg.verbose)
-               fprintf(stderr, "reading 0 from %d\n", from);
+           print_verbose(1, "reading 0 from %d\n", from);
            return FD_NODATA;
 
        case ECONNRESET:
@@ -456,6 +856,14 @@ int fd2fd(struct queue *target_q, struct queue *from_q)
    if (size_r == 0)
       return FD_CNXCLOSED;
 
+   from_q->bytes += size_r;
+
+   /* Data is already waiting: this goes after it */
+   if (has_deferred_data(target_q)) {
+       defer_write(target_q, buffer, size_r);
+       return FD_STALLED;
+   }
+
    size_w = write(target, buffer, size_r);
    /* process -1 when we know how to deal with it */
    if (size_w == -1) {
@@ -575,6 +983,7 @@ void resolve_name(struct addrinfo **out, char* fullname)
 /* Log to syslog or stderr if foreground */
 void log_message(int type, const char* msg, ...)
 {
+    char buf[LOG_MSG_LEN];
     va_list ap;
 
     va_start(ap, msg);
@@ -584,8 +993,10 @@ void log_message(int type, const char* msg, ...)
 
     if (do_syslog) {
         va_start(ap, msg);
-        vsyslog(type, msg, ap);
+        vsnprintf(buf, sizeof(buf), msg, ap);
         va_end(ap);
+        if (log_queue(type, buf))
+            syslog(type, "%s", buf);
     }
 }
 
@@ -598,9 +1009,8 @@ int get_connection_desc(struct connection_desc* desc, const struct connection *c
     struct sockaddr_storage ss;
 
     addr.ai_addr = (struct sockaddr*)&ss;
-    addr.ai_addrlen = sizeof(ss);
 
-    res = getpeername(cnx->q[0].fd, addr.ai_addr, &addr.ai_addrlen);
+    res = get_peer_addr(cnx, &addr);
     if (res == -1) return 0; /* Can happen if connection drops before we get here.
                                In that case, don't log anything (there is no connection) */
     sprintaddr(desc->peer, sizeof(desc->peer), &addr);
@@ -632,7 +1042,7 @@ void log_connection(struct connection_desc* desc, const struct connection *cnx)
 {
     struct connection_desc d;
 
-    if (cnx->proto->log_level < 1)
+    if (cnx->proto->log_level < 1 || !(cfg.foreground || do_syslog))
         return;
 
     if (!desc) {
@@ -648,6 +1058,32 @@ void log_connection(struct connection_desc* desc, const struct connection *cnx)
                 desc->target);
 }
 
+/* With log_level 2, logs a summary of a connection that is about to be
+ * closed, as one logfmt record */
+void log_connection_end(const struct connection *cnx)
+{
+    const struct cnx_metrics* m = &cnx->metrics;
+    struct connection_desc desc;
+
+    if (!cnx->proto || cnx->proto->log_level < 2 || !(cfg.foreground || do_syslog))
+        return;
+    if (cnx->q[0].fd == -1 || cnx->q[1].fd == -1)
+        return; /* never got connected */
+    if (!get_connection_desc(&desc, cnx))
+        return;
+
+    log_message(LOG_INFO, "event=close protocol=%s peer=%s service=%s local=%s target=%s "
+                "probe_ms=%llu connect_ms=%llu duration_ms=%llu "
+                "bytes_client=%llu bytes_target=%llu\n",
+                cnx->proto->name,
+                desc.peer, desc.service, desc.local, desc.target,
+                (unsigned long long)(m->probed_us - m->start_us) / 1000,
+                (unsigned long long)(m->connected_us - m->connect_us) / 1000,
+                (unsigned long long)(monotonic_us() - m->start_us) / 1000,
+                (unsigned long long)cnx->q[0].bytes,
+                (unsigned long long)cnx->q[1].bytes);
+}
+
 void set_proctitle_shovel(struct connection_desc* desc, const struct connection *cnx)
 {
 #ifdef LIBBSD
@@ -673,25 +1109,27 @@ void set_proctitle_shovel(struct connection_desc* desc, const struct connection
  *
  * Returns -1 if access is denied, 0 otherwise
  */
-int check_access_rights(int in_socket, const char* service)
+int check_access_rights(const struct connection* cnx, const char* service)
 {
 #ifdef LIBWRAP
     union {
         struct sockaddr saddr;
         struct sockaddr_storage ss;
     } peer;
-    socklen_t size = sizeof(peer);
+    struct addrinfo addr;
+    socklen_t size;
     char addr_str[NI_MAXHOST], host[NI_MAXHOST];
     int res;
 
-    res = getpeername(in_socket, &peer.saddr, &size);
+    addr.ai_addr = &peer.saddr;
+    res = get_peer_addr(cnx, &addr);
     CHECK_RES_RETURN(res, "getpeername", res);
+    size = addr.ai_addrlen;
 
     /* extract peer address */
     res = getnameinfo(&peer.saddr, size, addr_str, sizeof(addr_str), NULL, 0, NI_NUMERICHOST);
     if (res) {
-        if (cfg.verbose)
-            fprintf(stderr, "getnameinfo(NI_NUMERICHOST):%s\n", gai_strerror(res));
+        print_verbose(1, "getnameinfo(NI_NUMERICHOST):%s\n", gai_strerror(res));
         strcpy(addr_str, STRING_UNKNOWN);
     }
     /* extract peer name */
@@ -699,22 +1137,35 @@ int check_access_rights(int in_socket, const char* service)
     if (!cfg.numeric) {
         res = getnameinfo(&peer.saddr, size, host, sizeof(host), NULL, 0, NI_NAMEREQD);
         if (res) {
-            if (cfg.verbose)
-                fprintf(stderr, "getnameinfo(NI_NAMEREQD):%s\n", gai_strerror(res));
+            print_verbose(1, "getnameinfo(NI_NAMEREQD):%s\n", gai_strerror(res));
         }
     }
 
     if (!hosts_ctl(service, host, addr_str, STRING_UNKNOWN)) {
-        if (cfg.verbose)
-            fprintf(stderr, "access denied\n");
+        print_verbose(1, "access denied\n");
         log_message(LOG_INFO, "connection from %s(%s): access denied", host, addr_str);
-        close(in_socket);
+        close(cnx->q[0].fd);
         return -1;
     }
 #endif
     return 0;
 }
 
+static void request_reload(int sig)
+{
+    reload_requested = 1;
+}
+
+static void request_upgrade(int sig)
+{
+    upgrade_requested = 1;
+}
+
+static void request_drain(int sig)
+{
+    drain_requested = 1;
+}
+
 void setup_signals(void)
 {
     int res;
@@ -740,6 +1191,30 @@ void setup_signals(void)
     res = sigaction(SIGPIPE, &action, NULL);
     CHECK_RES_DIE(res, "sigaction");
 
+    /* SIGHUP reloads the configuration. Without SA_RESTART, so it interrupts
+     * the main loop of the server, which does the reload. Processes forked
+     * to handle connections ignore it. */
+    action.sa_handler = request_reload;
+    res = sigaction(SIGHUP, &action, NULL);
+    CHECK_RES_DIE(res, "sigaction");
+
+    /* Likewise, SIGUSR2 starts a new sslh binary that takes the listening
+     * sockets over (see upgrade_start()), and SIGQUIT stops accepting
+     * connections, and exits once those under way are done */
+    action.sa_handler = request_upgrade;
+    res = sigaction(SIGUSR2, &action, NULL);
+    CHECK_RES_DIE(res, "sigaction");
+
+    action.sa_handler = request_drain;
+    res = sigaction(SIGQUIT, &action, NULL);
+    CHECK_RES_DIE(res, "sigaction");
+}
+
+void setup_child_signals(void)
+{
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
 }
 
 /* Open syslog connection with appropriate banner;
@@ -770,6 +1245,7 @@ void setup_syslog(const char* bin_name) {
     /* Don't free name2, as openlog(3) uses it (at least in glibc) */
 
     log_message(LOG_INFO, "%s %s started\n", server_type, VERSION);
+    log_setup();
 }
 
 /* Ask OS to keep capabilities over a setuid(nonzero) */
@@ -834,13 +1310,11 @@ void drop_privileges(const char* user_name, const char* chroot_path)
             fprintf(stderr, "%s: not found\n", user_name);
             exit(2);
         }
-        if (cfg.verbose)
-            fprintf(stderr, "turning into %s\n", user_name);
+        print_verbose(1, "turning into %s\n", user_name);
     }
 
     if (chroot_path) {
-        if (cfg.verbose)
-            fprintf(stderr, "chrooting into %s\n", chroot_path);
+        print_verbose(1, "chrooting into %s\n", chroot_path);
 
         res = chroot(chroot_path);
         CHECK_RES_DIE(res, "chroot");
@@ -34,6 +34,13 @@
 #endif
 
 #include "version.h"
+#include "ring.h"
+#include "timers.h"
+#include "connect.h"
+#include "metrics.h"
+#include "admission.h"
+#include "log.h"
+#include "localaddr.h"
 
 #define CHECK_RES_DIE(res, str) \
     if (res == -1) {    \
@@ -71,31 +78,73 @@
 #define TCP_FASTOPEN 0
 #endif
 
-#ifndef TCP_FASTOPEN_CONNECT
-#define TCP_FASTOPEN_CONNECT 30 /* Attempt FastOpen with connect.  */
-#endif
-
 enum connection_state {
     ST_PROBING=1,    /* Waiting for timeout to find where to forward */
-    ST_SHOVELING   /* Connexion is established */
+    ST_CONNECTING, /* Connecting to the target (see connect.h) */
+    ST_SHOVELING,  /* Connexion is established */
+    ST_UDP         /* UDP flow (see udp-listener.h) */
 };
 
 /* this is used to pass protocols through the command-line parameter parsing */
 #define PROT_SHIFT 1000  /* protocol options will be 1000, 1001, etc */
 
 /* A 'queue' is composed of a file descriptor (which can be read from or
- * written to), and a queue for deferred write data */
+ * written to), and a queue for deferred write data (see ring.h). Reading from
+ * the other side of the connection stops when the queue is full. */
 struct queue {
     int fd;
-    void *begin_deferred_data;
-    void *deferred_data;
-    int deferred_data_size;
+    struct ring *deferred_data;     /* NULL when there is none */
+
+    /* With splice(), data read for this queue goes through a pipe; whatever
+     * could not be written yet is left in there (see setup_splice()) */
+    int pipe_fd[2];
+    int pipe_data_size;
+
+    uint64_t bytes;     /* read from fd so far */
+};
+
+/* How far probing has gone on a connection, so each new read only costs work
+ * proportional to its length (see probe.c) */
+struct probe_state {
+    uint64_t eliminated;    /* bit i set: cfg.protocols[i] can't match */
+    int http_scanned;       /* bytes searched for "HTTP" */
+    int xmpp_scanned;       /* bytes searched for "jabber" */
+    int tls_status;         /* parse_tls_header() result, 0 if not parsed yet */
+    uint64_t tls_matches;   /* which tls protocols match, see tls.h */
+    int generation;         /* config_generation the above is about */
+};
+
+/* What a connection only needs until it's connected to its target. It's
+ * allocated when the connection is accepted and freed once it's shoveling
+ * (see cnx_setup_new()), so long-lived connections don't carry it. */
+struct cnx_setup {
+    struct probe_state probe;
+    struct connect_state connect;
+
+    /* The address the client connected to, from the PROXY header (see
+     * proxy-protocol.h); local_len is 0 without one */
+    struct sockaddr_storage local;
+    socklen_t local_len;
 };
 
 struct connection {
     enum connection_state state;
-    time_t probe_timeout;
+    struct timer timeout;   /* probe or connect timeout, in the event loops */
+    struct cnx_setup* setup;    /* NULL once shoveling, and for UDP flows */
     struct sslhcfg_protocols_item* proto;
+    struct config_ref* config;  /* holds proto, see config_get() */
+    struct backend* backend;    /* target of proto in use (see backends.h) */
+    struct cnx_metrics metrics;
+    struct cnx_admission admission;
+
+    /* Client address, as returned by accept(); peer_len is 0 if it's not
+     * known (e.g. inetd), see get_peer_addr() */
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+
+    /* Set while the PROXY header the client must send first is not all
+     * there (see proxy-protocol.h) */
+    int proxy_header;
 
     /* q[0]: queue for external connection (client);
      * q[1]: queue for internal connection (httpd or sshd);
@@ -106,6 +155,7 @@ struct connection {
 struct listen_endpoint {
     int socketfd;       /* file descriptor of listening socket */
     int type;           /* SOCK_DGRAM | SOCK_STREAM */
+    int proxy_protocol; /* clients send a PROXY header first */
 };
 
 #define FD_CNXCLOSED    0
@@ -122,15 +172,24 @@ struct connection_desc {
 
 /* common.c */
 void init_cnx(struct connection *cnx);
-int connect_addr(struct connection *cnx, int fd_from);
+int cnx_setup_new(struct connection *cnx);
+void cnx_setup_free(struct connection *cnx);
+int get_peer_addr(const struct connection* cnx, struct addrinfo* addr);
+int bind_peer(int fd, const struct connection* cnx);
 int fd2fd(struct queue *target, struct queue *from);
 char* sprintaddr(char* buf, size_t size, struct addrinfo *a);
 void resolve_name(struct addrinfo **out, char* fullname);
 int get_connection_desc(struct connection_desc* desc, const struct connection *cnx);
 void log_connection(struct connection_desc* desc, const struct connection *cnx);
+void log_connection_end(const struct connection *cnx);
 void set_proctitle_shovel(struct connection_desc* desc, const struct connection *cnx);
-int check_access_rights(int in_socket, const char* service);
+int check_access_rights(const struct connection* cnx, const char* service);
 void setup_signals(void);
+/* For processes forked to serve connections: the signals above are for the
+ * main process */
+void setup_child_signals(void);
+/* Tells the sslh we took the listening sockets over from, if any, to leave */
+void upgrade_finish(void);
 void setup_syslog(const char* bin_name);
 void drop_privileges(const char* user_name, const char* chroot_path);
 void write_pid_file(const char* pidfile);
@@ -138,19 +197,73 @@ void log_message(int type, const char* msg, ...);
 void dump_connection(struct connection *cnx);
 int resolve_split_name(struct addrinfo **out, char* hostname, char* port);
 
-int start_listen_sockets(struct listen_endpoint *sockfd[]);
+struct sslhcfg_listen_item;
+int listen_single_addr(struct addrinfo* addr, const struct sslhcfg_listen_item* entry, int reuseport);
+int start_listen_sockets(struct listen_endpoint *sockfd[], int copies);
 
 int defer_write(struct queue *q, void* data, int data_size);
 int flush_deferred(struct queue *q);
+int has_deferred_data(struct queue *q);
+int deferred_data_full(struct queue *q);
+int deferred_data_space(struct queue *q);
+void* get_deferred_data(struct queue *q, int *data_size);
+void release_deferred_data(struct queue *q);
+
+void setup_splice(struct connection *cnx);
+void release_splice(struct connection *cnx);
 
 extern struct sslhcfg_item cfg;
+/* Incremented each time a new configuration is swapped in (see
+ * reload_install()) */
+extern int config_generation;
+/* Set by SIGHUP, SIGUSR2 and SIGQUIT (see setup_signals()) */
+extern volatile sig_atomic_t reload_requested;
+extern volatile sig_atomic_t upgrade_requested;
+extern volatile sig_atomic_t drain_requested;
 extern struct addrinfo *addr_listen;
 extern const char* USAGE_STRING;
 extern const char* server_type;
 
+/* sslh-main.c: configuration reload. reload_prepare() reads the
+ * configuration again and sets up its protocols without touching cfg, so the
+ * event loops can keep going meanwhile; it returns NULL if the configuration
+ * is wrong. reload_install() swaps it in, while nothing else looks at cfg:
+ * connections probed already keep their protocol, those still probing start
+ * again with the new ones. Listening sockets and startup-only settings (user,
+ * listen, metrics...) stay as they are. */
+struct sslhcfg_item* reload_prepare(void);
+void reload_install(struct sslhcfg_item* new_cfg);
+
+/* common.c: what keeps a configuration's protocols around. Connections take a
+ * reference when they get their protocol, and the threads of a configuration
+ * (resolver, health checks) when they start; cfg holds one as well until the
+ * next config_track(). The protocols are freed with the last reference, but
+ * the strings conf2struct read aren't: it doesn't say which it allocated.
+ * config_get() must be called while cfg can't change (see reload_install());
+ * it returns NULL before config_track(), as in echosrv and probe-bench. */
+struct config_ref;
+void config_track(void);
+struct config_ref* config_get(void);
+void config_put(struct config_ref* c);
+/* Frees what prepare_protocols() set up, also for a configuration that failed */
+void config_free_protocols(struct sslhcfg_protocols_item* protocols, size_t len);
+
+/* sslh-main.c: binary upgrade. upgrade_start() runs the binary sslh was
+ * started from again, with the same arguments, handing it the listening
+ * sockets; once it's up, it sends us SIGQUIT. */
+void upgrade_start(void);
+
 /* sslh-fork.c */
 void start_shoveler(int);
 
 void main_loop(struct listen_endpoint *listen_sockets, int num_addr_listen);
 
+/* Number of copies of the listening sockets the server needs (one per event
+ * loop); main_loop() gets them all */
+int server_threads(void);
+
+/* Turns off what cfg asks for that the server can't do; called again after
+ * each reload */
+void server_config_check(void);
+
 #endif
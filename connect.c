@@ -0,0 +1,396 @@
+/*
+# connect.c: non-blocking connection to targets, with Happy Eyeballs
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <poll.h>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "sslh-conf.h"
+#include "connect.h"
+#include "backends.h"
+
+void connect_init(struct connection* cnx)
+{
+    int i;
+
+    memset(&cnx->setup->connect, 0, sizeof(cnx->setup->connect));
+    for (i = 0; i < CONNECT_MAX_ATTEMPTS; i++)
+        cnx->setup->connect.fd[i] = -1;
+}
+
+/* Returns the k-th address of list that is (same != 0) or isn't (same == 0)
+ * of address family `family`, or NULL */
+static struct addrinfo* nth_of_family(struct addrinfo* list, int family, int same, int k)
+{
+    struct addrinfo* a;
+
+    for (a = list; a; a = a->ai_next) {
+        if ((a->ai_family == family) == !!same && !k--)
+            return a;
+    }
+    return NULL;
+}
+
+static int count_family(struct addrinfo* list, int family, int same)
+{
+    struct addrinfo* a;
+    int n = 0;
+
+    for (a = list; a; a = a->ai_next)
+        if ((a->ai_family == family) == !!same)
+            n++;
+    return n;
+}
+
+/* Returns the n-th address to connect to, or NULL if there are no more.
+ * Addresses alternate between the family of the first address (the one
+ * preferred by getaddrinfo()) and the others (RFC 8305, section 4). */
+static struct addrinfo* connect_order(struct connection* cnx, int n)
+{
+    struct addrinfo* list = cnx->setup->connect.addrs ? cnx->setup->connect.addrs->ai : NULL;
+    int first, num_first, num_other, pairs;
+
+    /* Transparent proxying only works within the family of the client */
+    if (cnx->setup->connect.family != AF_UNSPEC)
+        return nth_of_family(list, cnx->setup->connect.family, 1, n);
+
+    if (!list)
+        return NULL;
+
+    first = list->ai_family;
+    num_first = count_family(list, first, 1);
+    num_other = count_family(list, first, 0);
+    pairs = num_first < num_other ? num_first : num_other;
+
+    if (n < 2 * pairs)
+        return nth_of_family(list, first, !(n & 1), n / 2);
+
+    /* Only one family left */
+    return nth_of_family(list, first, num_first > pairs, n - pairs);
+}
+
+static int attempts_in_progress(struct connect_state* st)
+{
+    int i, n = 0;
+
+    for (i = 0; i < CONNECT_MAX_ATTEMPTS; i++)
+        if (st->fd[i] != -1)
+            n++;
+    return n;
+}
+
+static void drop_attempt(struct connection* cnx, int i, T_CONNECT_WATCH watch, void* arg)
+{
+    if (watch)
+        watch(cnx, cnx->setup->connect.fd[i], 0, arg);
+    close(cnx->setup->connect.fd[i]);
+    cnx->setup->connect.fd[i] = -1;
+}
+
+/* Connects fd to a, with the deferred data in the SYN if the protocol takes
+ * TFO and it's the only attempt. Falls back to connect() where TFO is not
+ * available. Returns like connect(). */
+static int tfo_connect(struct connection* cnx, int i, int fd, struct addrinfo* a)
+{
+    struct connect_state* st = &cnx->setup->connect;
+    ssize_t n;
+    void* data;
+    int size;
+
+    st->tfo_sent[i] = -1;
+#ifdef MSG_FASTOPEN
+    data = get_deferred_data(&cnx->q[1], &size);
+    if (cnx->proto->tfo_ok && size && !attempts_in_progress(st)) {
+        /* Without a cookie, the kernel asks for one and sends nothing */
+        n = sendto(fd, data, size, MSG_FASTOPEN, a->ai_addr, a->ai_addrlen);
+        if (n >= 0 || errno == EINPROGRESS) {
+            st->tfo_sent[i] = n > 0 ? n : 0;
+            return n >= 0 ? 0 : -1;
+        }
+        if (errno != EOPNOTSUPP)
+            return -1;
+        /* TFO is disabled on this host */
+    }
+#endif
+    return connect(fd, a->ai_addr, a->ai_addrlen);
+}
+
+/* The attempt in slot i, which sent fd's SYN with TFO, connected: the data
+ * that went in the SYN is not deferred any more */
+static void tfo_connected(struct connection* cnx, int i, int fd)
+{
+    int sent = cnx->setup->connect.tfo_sent[i], accepted = 0;
+#ifdef TCPI_OPT_SYN_DATA
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (sent && !getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len))
+        accepted = !!(info.tcpi_options & TCPI_OPT_SYN_DATA);
+#endif
+
+    if (sent) {
+        ring_consume(cnx->q[1].deferred_data, sent);
+        if (!has_deferred_data(&cnx->q[1]))
+            release_deferred_data(&cnx->q[1]);
+    }
+    metrics_tfo(cnx, sent > 0, accepted);
+}
+
+/* Starts connecting to a in slot i of the attempts. Returns 0, or -1 if it
+ * failed right away */
+static int start_attempt(struct connection* cnx, int i, struct addrinfo* a,
+                         T_CONNECT_WATCH watch, void* arg)
+{
+    char buf[NI_MAXHOST];
+    int fd, res;
+
+    print_verbose(1, "connecting to %s family %d len %d\n",
+                  sprintaddr(buf, sizeof(buf), a),
+                  a->ai_addr->sa_family, a->ai_addrlen);
+
+    fd = socket(a->ai_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        log_message(LOG_ERR, "forward to %s failed:socket: %s\n",
+                    cnx->proto->name, strerror(errno));
+        return -1;
+    }
+
+    res = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (res == -1) {
+        log_message(LOG_ERR, "forward to %s failed:fcntl: %s\n",
+                    cnx->proto->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (cnx->setup->connect.family != AF_UNSPEC && bind_peer(fd, cnx) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    res = tfo_connect(cnx, i, fd, a);
+    /* If it is connected already (local target), the socket is writable and
+     * connect_ready() takes it from there */
+    if (res == -1 && errno != EINPROGRESS) {
+        log_message(LOG_ERR, "forward to %s failed:connect: %s\n",
+                    cnx->proto->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    cnx->setup->connect.fd[i] = fd;
+    cnx->setup->connect.deadline[i] = monotonic_ms() + cnx->proto->connect_timeout * 1000;
+    if (watch)
+        watch(cnx, fd, 1, arg);
+    return 0;
+}
+
+int connect_update(struct connection* cnx, T_CONNECT_WATCH watch, void* arg)
+{
+    struct connect_state* st = &cnx->setup->connect;
+    struct addrinfo* a;
+    uint64_t now = monotonic_ms();
+    int i;
+
+    for (i = 0; i < CONNECT_MAX_ATTEMPTS; i++) {
+        if (st->fd[i] != -1 && now >= st->deadline[i]) {
+            log_message(LOG_ERR, "forward to %s failed:connect: timed out\n",
+                        cnx->proto->name);
+            drop_attempt(cnx, i, watch, arg);
+            st->next_start = now;
+        }
+    }
+
+    while (1) {
+        while ((a = connect_order(cnx, st->next_addr))) {
+            if (attempts_in_progress(st) && now < st->next_start)
+                break;
+
+            for (i = 0; i < CONNECT_MAX_ATTEMPTS && st->fd[i] != -1; i++)
+                /* find a free slot */;
+            if (i == CONNECT_MAX_ATTEMPTS)
+                break;
+
+            st->next_addr++;
+            if (!start_attempt(cnx, i, a, watch, arg))
+                st->next_start = now + CONNECT_ATTEMPT_DELAY;
+        }
+
+        if (attempts_in_progress(st))
+            return CONNECT_PENDING;
+
+        /* All addresses of this target failed: on to the next one */
+        backend_failed(cnx->proto, cnx->backend);
+        st->tried |= 1ULL << cnx->backend->index;
+        backend_release(cnx);
+        addr_list_put(st->addrs);
+        st->addrs = NULL;
+        cnx->backend = backend_choose(cnx->proto, st->client_hash, st->tried);
+        if (!cnx->backend) {
+            metrics_connect_failed(cnx);
+            return CONNECT_FAILED;
+        }
+        st->addrs = addr_list_get(cnx->backend);
+        st->next_addr = 0;
+        st->next_start = now;
+    }
+}
+
+int connect_begin(struct connection* cnx, T_CONNECT_WATCH watch, void* arg)
+{
+    struct sockaddr_storage ss;
+    struct addrinfo peer;
+    int res;
+
+    connect_init(cnx);
+    cnx->setup->connect.family = AF_UNSPEC;
+    metrics_connect_begin(cnx);
+
+    peer.ai_addr = (struct sockaddr*)&ss;
+    res = get_peer_addr(cnx, &peer);
+    if (cnx->proto->transparent || cfg.transparent) {
+        CHECK_RES_RETURN(res, "getpeername", CONNECT_FAILED);
+        cnx->setup->connect.family = ss.ss_family;
+    }
+    if (res == 0)
+        cnx->setup->connect.client_hash = backend_hash_addr(peer.ai_addr);
+
+    if (!cnx->backend)
+        cnx->backend = backend_choose(cnx->proto, cnx->setup->connect.client_hash, 0);
+    cnx->setup->connect.addrs = addr_list_get(cnx->backend);
+
+    cnx->setup->connect.next_start = monotonic_ms();
+    return connect_update(cnx, watch, arg);
+}
+
+int connect_ready(struct connection* cnx, int fd, T_CONNECT_WATCH watch, void* arg)
+{
+    struct connect_state* st = &cnx->setup->connect;
+    socklen_t len = sizeof(int);
+    int i, j, res, err, one = 1;
+
+    for (i = 0; i < CONNECT_MAX_ATTEMPTS && st->fd[i] != fd; i++)
+        /* find it */;
+    if (i == CONNECT_MAX_ATTEMPTS)
+        return CONNECT_PENDING;
+
+    res = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (res == -1)
+        err = errno;
+    if (err) {
+        log_message(LOG_ERR, "forward to %s failed:connect: %s\n",
+                    cnx->proto->name, strerror(err));
+        drop_attempt(cnx, i, watch, arg);
+        /* Try the next address right away */
+        st->next_start = monotonic_ms();
+        return connect_update(cnx, watch, arg);
+    }
+
+    /* We have a winner */
+    for (j = 0; j < CONNECT_MAX_ATTEMPTS; j++)
+        if (j != i && st->fd[j] != -1)
+            drop_attempt(cnx, j, watch, arg);
+    st->fd[i] = -1;
+    cnx->q[1].fd = fd;
+    if (st->tfo_sent[i] >= 0)
+        tfo_connected(cnx, i, fd);
+    addr_list_put(st->addrs);
+    st->addrs = NULL;
+    metrics_connected(cnx);
+
+    if (cnx->proto->keepalive) {
+        res = setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (char*)&one, sizeof(one));
+        if (res == -1)
+            perror("setsockopt(SO_KEEPALIVE)");
+    }
+
+    return CONNECT_DONE;
+}
+
+int connect_wait_ms(struct connection* cnx)
+{
+    struct connect_state* st = &cnx->setup->connect;
+    uint64_t now = monotonic_ms(), next = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < CONNECT_MAX_ATTEMPTS; i++)
+        if (st->fd[i] != -1 && st->deadline[i] < next)
+            next = st->deadline[i];
+
+    if (next == UINT64_MAX)
+        return -1;
+
+    if (attempts_in_progress(st) < CONNECT_MAX_ATTEMPTS &&
+        connect_order(cnx, st->next_addr) && st->next_start < next)
+        next = st->next_start;
+
+    return next > now ? (int)(next - now) : 0;
+}
+
+void connect_abort(struct connection* cnx, T_CONNECT_WATCH watch, void* arg)
+{
+    int i;
+
+    if (!cnx->setup)
+        return;
+    for (i = 0; i < CONNECT_MAX_ATTEMPTS; i++)
+        if (cnx->setup->connect.fd[i] != -1)
+            drop_attempt(cnx, i, watch, arg);
+    addr_list_put(cnx->setup->connect.addrs);
+    cnx->setup->connect.addrs = NULL;
+}
+
+int connect_addr(struct connection *cnx)
+{
+    struct pollfd pfd[CONNECT_MAX_ATTEMPTS];
+    int i, n, res, fd;
+
+    res = connect_begin(cnx, NULL, NULL);
+    while (res == CONNECT_PENDING) {
+        for (i = n = 0; i < CONNECT_MAX_ATTEMPTS; i++) {
+            if (cnx->setup->connect.fd[i] == -1) continue;
+            pfd[n].fd = cnx->setup->connect.fd[i];
+            pfd[n].events = POLLOUT;
+            n++;
+        }
+
+        res = poll(pfd, n, connect_wait_ms(cnx));
+        if (res == -1 && errno != EINTR) {
+            perror("poll");
+            connect_abort(cnx, NULL, NULL);
+            return -1;
+        }
+
+        res = CONNECT_PENDING;
+        for (i = 0; i < n && res == CONNECT_PENDING; i++)
+            if (pfd[i].revents)
+                res = connect_ready(cnx, pfd[i].fd, NULL, NULL);
+        if (res == CONNECT_PENDING)
+            res = connect_update(cnx, NULL, NULL);
+    }
+
+    if (res == CONNECT_FAILED)
+        return -1;
+
+    fd = cnx->q[1].fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
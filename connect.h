@@ -0,0 +1,81 @@
+/* API for connect.c: non-blocking connection to targets
+ *
+ * The addresses of the target are tried in turn, alternating between address
+ * families (RFC 8305, "Happy Eyeballs"): a new attempt starts every
+ * CONNECT_ATTEMPT_DELAY ms while earlier ones are still pending, or as soon
+ * as one fails. Each attempt gives up after the protocol's connect_timeout,
+ * and the first one to connect wins. When all addresses of a target failed,
+ * the next target of the protocol is tried (see backends.h).
+ *
+ * Event loops watch the sockets of the attempts for writing, and call
+ * connect_ready() when one is writable and connect_update() when
+ * connect_wait_ms() has elapsed. connect_addr() does all that in a blocking
+ * way.
+ *
+ * For protocols whose targets take TCP Fast Open (tfo_ok), the data probed so
+ * far goes in the SYN, when the kernel has a cookie for the target's
+ * address. Only an attempt started while no other is in progress carries it,
+ * so that a target that loses the race never sees it.
+ */
+
+#ifndef CONNECT_H
+#define CONNECT_H
+
+#include <stdint.h>
+
+/* Time between attempts, in ms */
+#define CONNECT_ATTEMPT_DELAY   250
+/* Attempts in progress at the same time */
+#define CONNECT_MAX_ATTEMPTS    2
+
+struct connection;
+struct addr_list;
+
+struct connect_state {
+    struct addr_list* addrs;    /* of the target, while connecting (see resolver.h) */
+    int next_addr;          /* next address to try, in connection order */
+    uint64_t next_start;    /* when to try it (see monotonic_ms()) */
+    int family;             /* only address family to use, or AF_UNSPEC */
+    int fd[CONNECT_MAX_ATTEMPTS];           /* attempts in progress, or -1 */
+    uint64_t deadline[CONNECT_MAX_ATTEMPTS];
+    int tfo_sent[CONNECT_MAX_ATTEMPTS];     /* bytes in the SYN, -1 without TFO */
+    uint64_t tried;         /* targets that failed already (see backends.h) */
+    uint32_t client_hash;
+};
+
+enum connect_status {
+    CONNECT_PENDING,    /* attempts in progress */
+    CONNECT_DONE,       /* connected: the socket is in cnx->q[1].fd */
+    CONNECT_FAILED      /* all targets failed */
+};
+
+/* Called with each socket an attempt opens (opened = 1), and with each socket
+ * of an attempt that fails, before closing it (opened = 0). Not called for the
+ * socket that connects. */
+typedef void (*T_CONNECT_WATCH)(struct connection* cnx, int fd, int opened, void* arg);
+
+/* Clears cnx->setup->connect */
+void connect_init(struct connection* cnx);
+
+/* Starts connecting cnx to cnx->proto. Returns a connect_status. */
+int connect_begin(struct connection* cnx, T_CONNECT_WATCH watch, void* arg);
+
+/* Socket fd is writable. Returns a connect_status. */
+int connect_ready(struct connection* cnx, int fd, T_CONNECT_WATCH watch, void* arg);
+
+/* Times out attempts and starts new ones when it is time. Returns a
+ * connect_status. */
+int connect_update(struct connection* cnx, T_CONNECT_WATCH watch, void* arg);
+
+/* Returns the number of ms until connect_update() must be called, or -1 if
+ * nothing is in progress */
+int connect_wait_ms(struct connection* cnx);
+
+/* Closes the sockets of all attempts, if cnx is connecting */
+void connect_abort(struct connection* cnx, T_CONNECT_WATCH watch, void* arg);
+
+/* Connects cnx to cnx->proto, blocking until it can be done. Returns the
+ * (blocking) socket, also set in cnx->q[1].fd, or -1 if no address works. */
+int connect_addr(struct connection *cnx);
+
+#endif
@@ -7,6 +7,10 @@
  * then we connect test clients that can then check they get the proper data
  * back (thus testing that shoveling works both ways) with the correct prefix
  * (thus testing it connected to the expected service).
+ *
+ * Each connection is served by its own thread, so it keeps up with the load
+ * sslh-bench puts on it. UDP listening sockets (from a config file) echo
+ * each datagram back, with the prefix.
  * **/
 
 #define _GNU_SOURCE
@@ -21,12 +25,14 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <pwd.h>
 #include <syslog.h>
 #include <libgen.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "sslh-conf.h"
@@ -39,49 +45,97 @@
 
 const char* server_type = "echsrv"; /* keep setup_syslog happy */
 
+#define ECHO_BUFSIZE    (1 << 20)
+
 void start_echo(int fd)
 {
     int res;
-    char buffer[1 << 20];
+    char* buffer;
     int ret, prefix_len;
 
     prefix_len = strlen(cfg.prefix);
 
-    memset(buffer, 0, sizeof(buffer));
+    /* Only what gets read into is touched, so idle connections stay small */
+    buffer = malloc(ECHO_BUFSIZE);
+    CHECK_ALLOC(buffer, "malloc");
     strcpy(buffer, cfg.prefix);
 
     while (1) {
-        ret = read(fd, buffer + prefix_len, sizeof(buffer) - prefix_len);
-        if (ret == -1) {
-            fprintf(stderr, "%s", strerror(errno));
-            return;
+        ret = read(fd, buffer + prefix_len, ECHO_BUFSIZE - prefix_len);
+        if (ret <= 0) {
+            if (ret == -1)
+                fprintf(stderr, "%s", strerror(errno));
+            break;
         }
         res = write(fd, buffer, ret + prefix_len);
         if (res < 0) {
             fprintf(stderr, "%s", strerror(errno));
-            return;
+            break;
         }
     }
+    free(buffer);
+}
+
+static void* echo_thread(void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+
+    start_echo(fd);
+    close(fd);
+    return NULL;
+}
+
+static void udp_echo(int fd)
+{
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    char buffer[65536];
+    int ret, prefix_len;
+
+    prefix_len = strlen(cfg.prefix);
+    strcpy(buffer, cfg.prefix);
+
+    while (1) {
+        from_len = sizeof(from);
+        ret = recvfrom(fd, buffer + prefix_len, sizeof(buffer) - prefix_len, 0,
+                       (struct sockaddr*)&from, &from_len);
+        if (ret == -1) {
+            fprintf(stderr, "%s", strerror(errno));
+            continue;
+        }
+        sendto(fd, buffer, ret + prefix_len, 0, (struct sockaddr*)&from, from_len);
+    }
 }
 
 void main_loop(struct listen_endpoint listen_sockets[], int num_addr_listen)
 {
-    int in_socket, i;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int in_socket, i, one = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
 
     for (i = 0; i < num_addr_listen; i++) {
         if (!fork()) {
+            if (listen_sockets[i].type == SOCK_DGRAM)
+                udp_echo(listen_sockets[i].socketfd);
+
             while (1)
             {
                 in_socket = accept(listen_sockets[i].socketfd, 0, 0);
+                if (in_socket == -1) {
+                    perror("accept");
+                    continue;
+                }
                 if (cfg.verbose) fprintf(stderr, "accepted fd %d\n", in_socket);
+                /* Echo small writes right away */
+                setsockopt(in_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-                if (!fork())
-                {
-                    close(listen_sockets[i].socketfd);
-                    start_echo(in_socket);
-                    exit(0);
-                }
-                close(in_socket);
+                if (pthread_create(&thread, &attr, echo_thread, (void*)(intptr_t)in_socket))
+                    close(in_socket);
             }
         }
     }
@@ -124,7 +178,7 @@ int main(int argc, char *argv[])
    sslhcfg_fprint(stdout, &cfg, 0);
 
    config_resolve_listen(&addr_listen);
-   num_addr_listen = start_listen_sockets(&listen_sockets);
+   num_addr_listen = start_listen_sockets(&listen_sockets, 1);
 
    main_loop(listen_sockets, num_addr_listen);
 
@@ -0,0 +1,285 @@
+/*
+# localaddr.c: cache of the addresses of the local interfaces
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <poll.h>
+#include <ifaddrs.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include "common.h"
+#include "sslh-conf.h"
+#include "localaddr.h"
+
+/* Must be a power of 2. Hosts with more than half that many addresses don't
+ * use the set. */
+#define LOCALADDR_SLOTS     8192
+#define LOCALADDR_MAX       (LOCALADDR_SLOTS / 2)
+
+/* Without netlink, seconds between checks of the interfaces */
+#define LOCALADDR_RESCAN    10
+
+struct localaddr_key {
+    uint32_t family;            /* 0 for an empty slot */
+    unsigned char addr[16];
+};
+
+/* Open addressing with linear probing. `seq` is odd while the monitor
+ * updates the set: readers try again if it changed while they looked. */
+struct localaddr_set {
+    uint64_t seq;
+    int overflow;
+    struct localaddr_key slot[LOCALADDR_SLOTS];
+};
+
+static struct localaddr_set* set;
+static int nl_socket = -1;
+
+/* Returns 0 and fills key if addr is IPv4 or IPv6, -1 otherwise */
+static int make_key(struct localaddr_key* key, const struct sockaddr* addr)
+{
+    memset(key, 0, sizeof(*key));
+    switch (addr->sa_family) {
+    case AF_INET:
+        memcpy(key->addr, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+        break;
+    case AF_INET6:
+        memcpy(key->addr, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+        break;
+    default:
+        return -1;
+    }
+    key->family = addr->sa_family;
+    return 0;
+}
+
+/* FNV-1a */
+static uint32_t hash_key(const struct localaddr_key* key)
+{
+    const unsigned char* p = (const unsigned char*)key;
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Returns the slot of key in table, or the empty slot where it would go */
+static struct localaddr_key* find_slot(struct localaddr_key* table,
+                                       const struct localaddr_key* key)
+{
+    uint32_t i = hash_key(key);
+    int n;
+
+    for (n = 0; n < LOCALADDR_SLOTS; n++, i++) {
+        struct localaddr_key* s = &table[i & (LOCALADDR_SLOTS - 1)];
+        if (!s->family || !memcmp(s, key, sizeof(*key)))
+            return s;
+    }
+    return NULL; /* can't happen, the table is never more than half full */
+}
+
+/* Lists the interfaces again and updates the set if they changed */
+static void fill_set(void)
+{
+    static struct localaddr_set new;
+    struct ifaddrs *ifaddrs_p = NULL, *ifa;
+    struct localaddr_key key, *s;
+    int n = 0;
+
+    if (getifaddrs(&ifaddrs_p) == -1) {
+        log_message(LOG_ERR, "getifaddrs: %s\n", strerror(errno));
+        return;
+    }
+
+    memset(&new, 0, sizeof(new));
+    for (ifa = ifaddrs_p; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || make_key(&key, ifa->ifa_addr))
+            continue;
+        if (n == LOCALADDR_MAX) {
+            new.overflow = 1;
+            break;
+        }
+        s = find_slot(new.slot, &key);
+        if (!s->family) {
+            *s = key;
+            n++;
+        }
+    }
+    freeifaddrs(ifaddrs_p);
+
+    if (set->overflow == new.overflow && !memcmp(set->slot, new.slot, sizeof(new.slot)))
+        return;
+
+    print_verbose(2, "local addresses changed: %d now\n", n);
+    __atomic_fetch_add(&set->seq, 1, __ATOMIC_ACQ_REL);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    set->overflow = new.overflow;
+    memcpy(set->slot, new.slot, sizeof(new.slot));
+    __atomic_fetch_add(&set->seq, 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __linux__
+/* Returns a socket that receives address change notifications, or -1 */
+static int open_netlink(void)
+{
+    struct sockaddr_nl snl;
+    int fd, res;
+
+    fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (fd == -1) {
+        log_message(LOG_ERR, "netlink socket: %s\n", strerror(errno));
+        return -1;
+    }
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+    snl.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    res = bind(fd, (struct sockaddr*)&snl, sizeof(snl));
+    if (res == -1) {
+        log_message(LOG_ERR, "netlink bind: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#else
+static int open_netlink(void)
+{
+    return -1;
+}
+#endif
+
+static int transparent_used(void)
+{
+    int i;
+
+    if (cfg.transparent)
+        return 1;
+    for (i = 0; i < cfg.protocols_len; i++)
+        if (cfg.protocols[i].transparent)
+            return 1;
+    return 0;
+}
+
+void localaddr_setup(void)
+{
+    if (!transparent_used())
+        return;
+
+    set = mmap(NULL, sizeof(*set), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (set == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(set, 0, sizeof(*set));
+
+    /* Subscribe first, so no change gets missed */
+    nl_socket = open_netlink();
+    fill_set();
+}
+
+static void localaddr_monitor(pid_t parent)
+{
+    struct pollfd pfd = { .fd = nl_socket, .events = POLLIN };
+    char buf[8192];
+    int ticks = 0;
+    ssize_t n;
+
+    /* Check every second that sslh is still there */
+    while (getppid() == parent) {
+        if (nl_socket == -1) {
+            poll(NULL, 0, 1000);
+            if (++ticks == LOCALADDR_RESCAN) {
+                ticks = 0;
+                fill_set();
+            }
+            continue;
+        }
+
+        if (poll(&pfd, 1, 1000) != 1)
+            continue;
+        /* What the notifications say doesn't matter: list the interfaces
+         * again. ENOBUFS means some were lost, which doesn't matter either. */
+        do {
+            n = recv(nl_socket, buf, sizeof(buf), MSG_DONTWAIT);
+        } while (n > 0 || (n == -1 && errno == ENOBUFS));
+        fill_set();
+    }
+    exit(0);
+}
+
+void start_localaddr_monitor(struct listen_endpoint* listen_sockets, int num_addr_listen)
+{
+    pid_t parent = getpid();
+    int i;
+
+    if (!set)
+        return;
+
+    switch (fork()) {
+    case -1:
+        log_message(LOG_ERR, "fork failed: err %d: %s\n", errno, strerror(errno));
+        break;
+
+    case 0:
+        for (i = 0; i < num_addr_listen; i++)
+            close(listen_sockets[i].socketfd);
+        localaddr_monitor(parent);
+
+    default:
+        break;
+    }
+    if (nl_socket != -1)
+        close(nl_socket);
+    nl_socket = -1;
+}
+
+int localaddr_lookup(const struct sockaddr* addr)
+{
+    struct localaddr_key key, *s;
+    uint64_t seq;
+    int found, tries = 0;
+
+    if (!set || make_key(&key, addr))
+        return -1;
+
+    while (1) {
+        /* The monitor may have died halfway through an update */
+        if (++tries > 1000)
+            return -1;
+        seq = __atomic_load_n(&set->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        if (set->overflow)
+            return -1;
+        s = find_slot(set->slot, &key);
+        found = s && s->family;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&set->seq, __ATOMIC_RELAXED) == seq)
+            return found;
+    }
+}
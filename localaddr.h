@@ -0,0 +1,27 @@
+/* API for localaddr.c: cache of the addresses of the local interfaces
+ *
+ * With transparent proxying, each connection needs to know whether the client
+ * is on the same machine. Instead of listing all interfaces for each
+ * connection, their addresses are kept in a hash set in shared memory. A
+ * separate process fills it again whenever the kernel tells of an address
+ * change (netlink on Linux; elsewhere, every few seconds).
+ */
+
+#ifndef LOCALADDR_H
+#define LOCALADDR_H
+
+struct sockaddr;
+struct listen_endpoint;
+
+/* Allocates the set and fills it, if any protocol is transparent. Call before
+ * forking. Dies on error. */
+void localaddr_setup(void);
+
+/* Forks the process that keeps the set up to date */
+void start_localaddr_monitor(struct listen_endpoint* listen_sockets, int num_addr_listen);
+
+/* Returns 1 if addr is the address of a local interface, 0 if it's not, -1 if
+ * there is no set to tell */
+int localaddr_lookup(const struct sockaddr* addr);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+# log.c: asynchronous logging to syslog
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "sslh-conf.h"
+#include "log.h"
+
+/* Must be a power of 2 */
+#define LOG_RING_SIZE   1024
+
+/* Bounded multi-producer queue (D. Vyukov's): a producer claims slot `pos`
+ * by moving `head` past it, and releases it by setting its `seq` to pos + 1.
+ * The writer frees it for the next round by setting `seq` to
+ * pos + LOG_RING_SIZE. */
+struct log_slot {
+    uint64_t seq;
+    int type;
+    char msg[LOG_MSG_LEN];
+};
+
+struct log_ring {
+    uint64_t head;      /* next slot to fill */
+    uint64_t tail;      /* next slot to write out (writer only) */
+    uint64_t dropped;
+    struct log_slot slot[LOG_RING_SIZE];
+};
+
+static struct log_ring* ring;
+static int writer_started;
+
+void log_setup(void)
+{
+    int i;
+
+    ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(ring, 0, sizeof(*ring));
+    for (i = 0; i < LOG_RING_SIZE; i++)
+        ring->slot[i].seq = i;
+}
+
+int log_queue(int type, const char* msg)
+{
+    struct log_slot* s;
+    uint64_t pos, seq;
+
+    if (!writer_started)
+        return -1;
+
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while (1) {
+        s = &ring->slot[pos & (LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            /* pos now has the new head: try again */
+        } else if (seq < pos) {
+            /* Full: the writer hasn't got to that slot yet */
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    s->type = type;
+    strncpy(s->msg, msg, sizeof(s->msg) - 1);
+    s->msg[sizeof(s->msg) - 1] = 0;
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Writes out all queued messages. Returns how many there were. */
+static int log_drain(void)
+{
+    struct log_slot* s;
+    uint64_t tail;
+    int n = 0;
+
+    while (1) {
+        tail = ring->tail;
+        s = &ring->slot[tail & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            return n;
+
+        syslog(s->type, "%s", s->msg);
+        __atomic_store_n(&s->seq, tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        ring->tail = tail + 1;
+        n++;
+    }
+}
+
+static void log_writer(pid_t parent)
+{
+    uint64_t dropped, reported = 0;
+    int wait = 1;
+
+    while (1) {
+        if (log_drain()) {
+            wait = 1;
+        } else {
+            if (getppid() != parent)
+                exit(0);
+            /* Nothing to do: sleep, longer and longer up to 50ms */
+            poll(NULL, 0, wait);
+            if (wait < 50)
+                wait *= 2;
+        }
+
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != reported) {
+            syslog(LOG_WARNING, "%llu log messages dropped\n",
+                   (unsigned long long)(dropped - reported));
+            reported = dropped;
+        }
+    }
+}
+
+void start_log_writer(struct listen_endpoint* listen_sockets, int num_addr_listen)
+{
+    pid_t parent = getpid();
+    int i;
+
+    if (!ring)
+        return;
+
+    switch (fork()) {
+    case -1:
+        log_message(LOG_ERR, "fork failed: err %d: %s\n", errno, strerror(errno));
+        return;
+
+    case 0:
+        for (i = 0; i < num_addr_listen; i++)
+            close(listen_sockets[i].socketfd);
+        log_writer(parent);
+        exit(0);
+
+    default:
+        writer_started = 1;
+        return;
+    }
+}
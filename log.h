@@ -0,0 +1,43 @@
+/* API for log.c: debug output and asynchronous syslog
+ *
+ * print_verbose() is for debug output: it prints to stderr when running with
+ * at least that much verbosity. Levels above VERBOSE_MAX are compiled out, so
+ * building with e.g. -DVERBOSE_MAX=0 removes debug output (and its tests of
+ * cfg.verbose) from the hot paths.
+ *
+ * log_message() (in common.c) does not call syslog() itself once
+ * start_log_writer() has run: messages go through a ring buffer in shared
+ * memory, and a separate process sends them to syslog. Queueing never blocks
+ * nor takes a lock; if the ring is full, the message is dropped, and the
+ * writer reports how many were.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#ifndef VERBOSE_MAX
+#define VERBOSE_MAX 9
+#endif
+
+#define print_verbose(level, ...) \
+    do { \
+        if ((level) <= VERBOSE_MAX && cfg.verbose >= (level)) \
+            fprintf(stderr, __VA_ARGS__); \
+    } while (0)
+
+/* Longer messages are truncated */
+#define LOG_MSG_LEN     512
+
+struct listen_endpoint;
+
+/* Allocates the ring buffer. Call before forking. */
+void log_setup(void);
+
+/* Forks the process that writes queued messages to syslog */
+void start_log_writer(struct listen_endpoint* listen_sockets, int num_addr_listen);
+
+/* Queues a message for syslog. Returns 0 if it's been queued (or dropped), -1
+ * if there is no writer process. */
+int log_queue(int type, const char* msg);
+
+#endif
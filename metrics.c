@@ -0,0 +1,434 @@
+/*
+# metrics.c: connection statistics, served in Prometheus text format
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "sslh-conf.h"
+#include "metrics.h"
+
+struct metrics {
+    uint64_t accepted;
+    uint64_t refused;
+    int64_t probing;
+    int64_t memory[MEM_NUM];
+    int draining;       /* the metrics server leaves, see metrics_drain() */
+    struct proto_metrics proto[METRICS_PROTOCOLS];
+};
+
+/* NULL if metrics are off */
+static struct metrics* metrics;
+static int metrics_socket = -1;
+
+#define ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void record(struct histogram* h, uint64_t us)
+{
+    int i = us ? 64 - __builtin_clzll(us) : 0;
+
+    if (i >= METRICS_BUCKETS)
+        i = METRICS_BUCKETS - 1;
+    ADD(h->bucket[i], 1);
+    ADD(h->sum_us, us);
+    ADD(h->count, 1);
+}
+
+static int open_metrics_socket(char* name)
+{
+    struct sockaddr_un sun;
+    struct addrinfo* addr;
+    char* fullname;
+    int fd, res;
+
+    if (name[0] != '/') {
+        fullname = strdup(name);
+        CHECK_ALLOC(fullname, "strdup");
+        resolve_name(&addr, fullname);
+        free(fullname);
+#ifdef SO_REUSEPORT
+        /* So an sslh we upgrade to can bind it too */
+        fd = listen_single_addr(addr, NULL, 1);
+#else
+        fd = listen_single_addr(addr, NULL, 0);
+#endif
+        freeaddrinfo(addr);
+        return fd;
+    }
+
+    if (strlen(name) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", name);
+        exit(1);
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, name);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK_RES_DIE(fd, "socket");
+    unlink(name);
+    res = bind(fd, (struct sockaddr*)&sun, sizeof(sun));
+    CHECK_RES_DIE(res, "bind");
+    res = listen(fd, 5);
+    CHECK_RES_DIE(res, "listen");
+    return fd;
+}
+
+void metrics_setup(void)
+{
+    if (!cfg.metrics)
+        return;
+
+    metrics = mmap(NULL, sizeof(*metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(metrics, 0, sizeof(*metrics));
+    metrics_set_protocols();
+
+    metrics_socket = open_metrics_socket(cfg.metrics);
+}
+
+void metrics_drain(void)
+{
+    if (metrics)
+        __atomic_store_n(&metrics->draining, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_set_protocols(void)
+{
+    struct sslhcfg_protocols_item* p;
+    struct proto_metrics* m;
+    char labels[METRICS_LABELS_LEN];
+    int i, j, free_slot;
+
+    if (!metrics) return;
+
+    for (i = 0; i < cfg.protocols_len; i++) {
+        p = &cfg.protocols[i];
+        snprintf(labels, sizeof(labels), "protocol=\"%s\",target=\"%s:%s\"",
+                 p->name, p->host, p->port);
+
+        p->counters = NULL;
+        free_slot = -1;
+        for (j = 0; j < METRICS_PROTOCOLS; j++) {
+            m = &metrics->proto[j];
+            if (!m->labels[0]) {
+                if (free_slot == -1) free_slot = j;
+            } else if (!strcmp(m->labels, labels)) {
+                p->counters = m;
+                break;
+            }
+        }
+        if (p->counters)
+            continue;
+        if (free_slot == -1) {
+            log_message(LOG_WARNING, "more than %d protocols, %s is not counted\n",
+                        METRICS_PROTOCOLS, labels);
+            continue;
+        }
+
+        /* The metrics server only shows the slot once the first character
+         * is there */
+        m = &metrics->proto[free_slot];
+        strcpy(m->labels + 1, labels + 1);
+        __atomic_store_n(&m->labels[0], labels[0], __ATOMIC_RELEASE);
+        p->counters = m;
+    }
+}
+
+void metrics_accepted(struct connection* cnx)
+{
+    cnx->metrics.start_us = monotonic_us();
+    if (!metrics) return;
+
+    ADD(metrics->accepted, 1);
+    ADD(metrics->probing, 1);
+    cnx->metrics.probing = 1;
+}
+
+void metrics_probed(struct connection* cnx, int timed_out)
+{
+    struct proto_metrics* m;
+
+    cnx->metrics.probed_us = monotonic_us();
+    if (!metrics) return;
+
+    if (cnx->metrics.probing) {
+        ADD(metrics->probing, -1);
+        cnx->metrics.probing = 0;
+    }
+    m = cnx->proto->counters;
+    if (!m) return;
+
+    if (timed_out)
+        ADD(m->timed_out, 1);
+    else
+        ADD(m->probed, 1);
+    ADD(m->active, 1);
+    cnx->metrics.proto = m;
+    record(&m->hist[H_PROBE], cnx->metrics.probed_us - cnx->metrics.start_us);
+}
+
+void metrics_connect_begin(struct connection* cnx)
+{
+    cnx->metrics.connect_us = monotonic_us();
+}
+
+void metrics_connected(struct connection* cnx)
+{
+    cnx->metrics.connected_us = monotonic_us();
+    if (!metrics || !cnx->metrics.proto) return;
+
+    record(&cnx->metrics.proto->hist[H_CONNECT],
+           cnx->metrics.connected_us - cnx->metrics.connect_us);
+}
+
+void metrics_connect_failed(struct connection* cnx)
+{
+    if (!metrics || !cnx->metrics.proto) return;
+
+    ADD(cnx->metrics.proto->connect_failed, 1);
+}
+
+void metrics_tfo(struct connection* cnx, int syn_data, int accepted)
+{
+    struct proto_metrics* m = cnx->metrics.proto;
+
+    if (!metrics || !m) return;
+
+    ADD(m->tfo_attempted, 1);
+    if (syn_data)
+        ADD(m->tfo_syn_data, 1);
+    if (accepted)
+        ADD(m->tfo_accepted, 1);
+}
+
+void metrics_closed(struct connection* cnx)
+{
+    struct proto_metrics* m = cnx->metrics.proto;
+
+    if (!metrics) return;
+
+    if (cnx->metrics.probing)
+        ADD(metrics->probing, -1);
+    if (m) {
+        ADD(m->active, -1);
+        ADD(m->bytes_client, cnx->q[0].bytes);
+        ADD(m->bytes_target, cnx->q[1].bytes);
+        record(&m->hist[H_LIFETIME], monotonic_us() - cnx->metrics.start_us);
+    }
+    memset(&cnx->metrics, 0, sizeof(cnx->metrics));
+}
+
+void metrics_refused(void)
+{
+    if (metrics)
+        ADD(metrics->refused, 1);
+}
+
+void metrics_memory(enum metrics_memory m, long bytes)
+{
+    if (metrics)
+        ADD(metrics->memory[m], bytes);
+}
+
+
+/* Prometheus exposition */
+
+static const char* hist_names[] = {
+    [H_PROBE] = "sslh_probe_duration_seconds",
+    [H_CONNECT] = "sslh_connect_duration_seconds",
+    [H_LIFETIME] = "sslh_connection_duration_seconds",
+};
+
+static const char* hist_help[] = {
+    [H_PROBE] = "Time from accept to knowing the protocol",
+    [H_CONNECT] = "Time to connect to the target",
+    [H_LIFETIME] = "Time from accept to close",
+};
+
+static const char* memory_names[] = {
+    [MEM_SLOTS] = "slots",
+    [MEM_SETUP] = "setup",
+    [MEM_BUFFERS] = "buffers",
+};
+
+/* Returns true if slot i is used */
+static int slot_used(int i)
+{
+    return __atomic_load_n(&metrics->proto[i].labels[0], __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Writes the labels identifying slot i */
+static void print_labels(FILE* out, int i)
+{
+    fputs(metrics->proto[i].labels, out);
+}
+
+#define PRINT_COUNTER(out, name, help, field)                               \
+    do {                                                                    \
+        fprintf(out, "# HELP " name " " help "\n# TYPE " name " counter\n"); \
+        for (i = 0; i < METRICS_PROTOCOLS; i++) {                           \
+            if (!slot_used(i)) continue;                                    \
+            fprintf(out, name "{");                                         \
+            print_labels(out, i);                                           \
+            fprintf(out, "} %llu\n",                                        \
+                    (unsigned long long)GET(metrics->proto[i].field));      \
+        }                                                                   \
+    } while (0)
+
+static void print_metrics(FILE* out)
+{
+    struct histogram* h;
+    uint64_t cumul;
+    int i, j, k;
+
+    fprintf(out, "# HELP sslh_accepted_total Connections accepted\n"
+            "# TYPE sslh_accepted_total counter\n"
+            "sslh_accepted_total %llu\n",
+            (unsigned long long)GET(metrics->accepted));
+    fprintf(out, "# HELP sslh_refused_total Connections refused by rate_limit, max_probing or max_connections\n"
+            "# TYPE sslh_refused_total counter\n"
+            "sslh_refused_total %llu\n",
+            (unsigned long long)GET(metrics->refused));
+    fprintf(out, "# HELP sslh_probing Connections being probed\n"
+            "# TYPE sslh_probing gauge\n"
+            "sslh_probing %lld\n",
+            (long long)GET(metrics->probing));
+    fprintf(out, "# HELP sslh_memory_bytes Memory held for connections\n"
+            "# TYPE sslh_memory_bytes gauge\n");
+    for (i = 0; i < MEM_NUM; i++)
+        fprintf(out, "sslh_memory_bytes{use=\"%s\"} %lld\n", memory_names[i],
+                (long long)GET(metrics->memory[i]));
+
+    PRINT_COUNTER(out, "sslh_probed_total", "Connections probed as this protocol", probed);
+    PRINT_COUNTER(out, "sslh_timeouts_total", "Connections sent to this protocol on probe timeout", timed_out);
+    PRINT_COUNTER(out, "sslh_connect_failures_total", "Connections that could not reach the target", connect_failed);
+    PRINT_COUNTER(out, "sslh_tfo_attempts_total", "Connections to the target that tried TCP Fast Open", tfo_attempted);
+    PRINT_COUNTER(out, "sslh_tfo_syn_data_total", "TCP Fast Open connections that sent data in the SYN", tfo_syn_data);
+    PRINT_COUNTER(out, "sslh_tfo_accepted_total", "TCP Fast Open connections whose SYN data the target took", tfo_accepted);
+    PRINT_COUNTER(out, "sslh_client_bytes_total", "Bytes forwarded from clients to the target", bytes_client);
+    PRINT_COUNTER(out, "sslh_target_bytes_total", "Bytes forwarded from the target to clients", bytes_target);
+
+    fprintf(out, "# HELP sslh_connections Open connections\n# TYPE sslh_connections gauge\n");
+    for (i = 0; i < METRICS_PROTOCOLS; i++) {
+        if (!slot_used(i)) continue;
+        fprintf(out, "sslh_connections{");
+        print_labels(out, i);
+        fprintf(out, "} %lld\n", (long long)GET(metrics->proto[i].active));
+    }
+
+    for (k = 0; k < H_NUM; k++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", hist_names[k], hist_help[k], hist_names[k]);
+        for (i = 0; i < METRICS_PROTOCOLS; i++) {
+            if (!slot_used(i)) continue;
+            h = &metrics->proto[i].hist[k];
+            cumul = 0;
+            for (j = 0; j < METRICS_BUCKETS - 1; j++) {
+                cumul += GET(h->bucket[j]);
+                fprintf(out, "%s_bucket{", hist_names[k]);
+                print_labels(out, i);
+                fprintf(out, ",le=\"%.6f\"} %llu\n", (double)(1ULL << j) / 1e6,
+                        (unsigned long long)cumul);
+            }
+            fprintf(out, "%s_bucket{", hist_names[k]);
+            print_labels(out, i);
+            fprintf(out, ",le=\"+Inf\"} %llu\n", (unsigned long long)GET(h->count));
+            fprintf(out, "%s_sum{", hist_names[k]);
+            print_labels(out, i);
+            fprintf(out, "} %g\n", GET(h->sum_us) / 1e6);
+            fprintf(out, "%s_count{", hist_names[k]);
+            print_labels(out, i);
+            fprintf(out, "} %llu\n", (unsigned long long)GET(h->count));
+        }
+    }
+}
+
+/* Answers one HTTP request, whatever it is, with the metrics */
+static void serve(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    char buf[BUFSIZ];
+    FILE* out;
+
+    /* Wait a bit for the request, but it doesn't matter what it says */
+    if (poll(&pfd, 1, 1000) == 1)
+        if (read(fd, buf, sizeof(buf)) == -1) { /* nothing to do */ }
+
+    out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        return;
+    }
+    fprintf(out, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Connection: close\r\n\r\n");
+    print_metrics(out);
+    fclose(out);
+}
+
+void start_metrics_server(struct listen_endpoint* listen_sockets, int num_addr_listen)
+{
+    struct pollfd pfd;
+    pid_t parent = getpid();
+    int i, fd;
+
+    if (metrics_socket == -1)
+        return;
+
+    switch (fork()) {
+    case -1:
+        log_message(LOG_ERR, "fork failed: err %d: %s\n", errno, strerror(errno));
+        return;
+    case 0:
+        break;
+    default:
+        close(metrics_socket);
+        return;
+    }
+
+    for (i = 0; i < num_addr_listen; i++)
+        close(listen_sockets[i].socketfd);
+
+    pfd.fd = metrics_socket;
+    pfd.events = POLLIN;
+    /* Check every second that sslh is still there */
+    while (getppid() == parent && !GET(metrics->draining)) {
+        if (poll(&pfd, 1, 1000) != 1)
+            continue;
+        fd = accept(metrics_socket, NULL, NULL);
+        if (fd != -1)
+            serve(fd);
+    }
+    exit(0);
+}
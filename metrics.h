@@ -0,0 +1,122 @@
+/* API for metrics.c: counters and histograms, served in Prometheus format
+ *
+ * With `metrics` set, sslh counts connections and bytes for each protocol, and
+ * records how long probing, connecting to the target, and whole connections
+ * take. Everything lives in shared memory updated with atomic operations, so
+ * the processes of sslh-fork and the threads of sslh-threads all add to the
+ * same figures without locking. A separate process serves them over HTTP on
+ * the `metrics` address (host:port, or path of a Unix socket).
+ *
+ * Bytes are added to the counters when connections close. Memory held for
+ * connections is counted in bytes, as it's allocated and freed, so dividing
+ * it by the number of open connections gives what each one costs.
+ *
+ * Each protocol gets a slot, labelled with its name and target. A reload
+ * gives protocols whose name and target didn't change the same slot, so they
+ * keep counting; the slots of protocols that are gone remain, counting their
+ * last connections. At most METRICS_PROTOCOLS slots are used over the whole
+ * life of sslh: protocols beyond that are not counted.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+struct connection;
+struct listen_endpoint;
+
+/* Histogram buckets: bucket i counts durations below 2^i microseconds; the
+ * last one counts all others */
+#define METRICS_BUCKETS 28
+
+#define METRICS_PROTOCOLS 64
+#define METRICS_LABELS_LEN 320
+
+enum metrics_histogram {
+    H_PROBE,        /* from accept to the protocol being known */
+    H_CONNECT,      /* from start of connection to the target until it succeeds */
+    H_LIFETIME,     /* from accept to close */
+    H_NUM
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t bucket[METRICS_BUCKETS];
+};
+
+struct proto_metrics {
+    uint64_t probed;            /* connections found to be this protocol */
+    uint64_t timed_out;         /* connections sent to it after probe timeout */
+    uint64_t connect_failed;
+    uint64_t tfo_attempted;     /* connections that tried TCP Fast Open */
+    uint64_t tfo_syn_data;      /* ... with data in the SYN (there was a cookie) */
+    uint64_t tfo_accepted;      /* ... that the target took */
+    uint64_t bytes_client;      /* from the client to the target */
+    uint64_t bytes_target;      /* from the target to the client */
+    int64_t active;
+    struct histogram hist[H_NUM];
+    char labels[METRICS_LABELS_LEN];    /* empty if the slot is free */
+};
+
+/* Memory held for connections, in bytes */
+enum metrics_memory {
+    MEM_SLOTS,      /* struct connection of the event loops, in use or free */
+    MEM_SETUP,      /* setup state of connections being probed or connected */
+    MEM_BUFFERS,    /* ring buffers holding deferred data */
+    MEM_NUM
+};
+
+/* What a connection has been counted in. The times (in microseconds, see
+ * monotonic_us()) are kept even with metrics off, for log_connection_end(). */
+struct cnx_metrics {
+    uint64_t start_us;              /* accepted */
+    uint64_t probed_us;             /* protocol known */
+    uint64_t connect_us;            /* started connecting to the target */
+    uint64_t connected_us;
+    struct proto_metrics* proto;    /* counted as active there, or NULL */
+    int probing;                    /* counted as probing */
+};
+
+uint64_t monotonic_us(void);
+
+/* Allocates the counters and opens the metrics socket, if cfg.metrics is set.
+ * Call before forking and dropping privileges. Dies on error. */
+void metrics_setup(void);
+
+/* Gives each of cfg.protocols its slot (p->counters). Called by
+ * metrics_setup(), and again after a reload. */
+void metrics_set_protocols(void);
+
+/* Stops the metrics server, when the sslh we upgraded to serves them (see
+ * upgrade_start()) */
+void metrics_drain(void);
+
+/* Forks the process that serves the metrics, if there is a metrics socket */
+void start_metrics_server(struct listen_endpoint* listen_sockets, int num_addr_listen);
+
+/* A new connection has been accepted */
+void metrics_accepted(struct connection* cnx);
+
+/* cnx->proto is known, by probing or because probing timed out */
+void metrics_probed(struct connection* cnx, int timed_out);
+
+void metrics_connect_begin(struct connection* cnx);
+void metrics_connected(struct connection* cnx);
+void metrics_connect_failed(struct connection* cnx);
+
+/* cnx connected with TCP Fast Open. syn_data: data went in the SYN;
+ * accepted: the target acknowledged it */
+void metrics_tfo(struct connection* cnx, int syn_data, int accepted);
+
+/* cnx is closed */
+void metrics_closed(struct connection* cnx);
+
+/* A connection was refused by admission control (see admission.h) */
+void metrics_refused(void);
+
+/* Memory of kind m is allocated (bytes > 0) or freed (bytes < 0) */
+void metrics_memory(enum metrics_memory m, long bytes);
+
+#endif
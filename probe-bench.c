@@ -0,0 +1,296 @@
+/*
+# probe-bench.c: microbenchmark of the probes on a corpus of first packets
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+/* probe-bench [-n iterations] [-a alpn] [-r pattern]... [sslh options --] <corpus file>...
+ *
+ * Each file holds the first bytes a client sends (see probe-corpus/README).
+ * For each file, runs each configured probe on its own, then the whole probe
+ * chain as sslh does (probe_buffer()), many times over, and prints the time
+ * and the number of allocations per call.
+ *
+ * The protocols are set up from the sslh options before `--` (only command
+ * line options, as sslh would parse them, but targets are not resolved). By
+ * default, all the builtin probes are used, with a few SNI names on tls; -a
+ * also gives tls an ALPN protocol, so it only matches with both, and each -r
+ * adds a pattern to a regex protocol before anyprot (regex protocols can't be
+ * set on the command line).
+ *
+ * A file named <protocol>-... must be found to be that protocol, again-...
+ * must need more data, and garbage-... must fall through to the last
+ * protocol; exits with 1 if any didn't.
+ */
+
+#include "common.h"
+#include "probe.h"
+#include "tls.h"
+#include "regex-probe.h"
+
+const char* server_type = "probe-bench";
+
+/* Allocations, counted through the linker's --wrap (see the Makefile) */
+static long allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+char* __real_strdup(const char* s);
+
+void* __wrap_malloc(size_t size) { allocs++; return __real_malloc(size); }
+void* __wrap_calloc(size_t nmemb, size_t size) { allocs++; return __real_calloc(nmemb, size); }
+void* __wrap_realloc(void* ptr, size_t size) { allocs++; return __real_realloc(ptr, size); }
+char* __wrap_strdup(const char* s) { allocs++; return __real_strdup(s); }
+
+static char* default_options[] = {
+    "probe-bench",
+    "--ssh", "localhost:1",
+    "--openvpn", "localhost:2",
+    "--tinc", "localhost:3",
+    "--xmpp", "localhost:4",
+    "--http", "localhost:5",
+    "--tls", "localhost:6",
+    "--adb", "localhost:7",
+    "--socks5", "localhost:8",
+    "--anyprot", "localhost:9",
+};
+
+static char* default_sni[] = { "www.example.com", "*.example.org", "im.example.net" };
+static char* default_alpn[1];
+static char* default_regex[16];
+static int default_regex_len;
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: probe-bench [-n iterations] [-a alpn] [-r pattern]... [sslh options --] <corpus file>...\n");
+    exit(2);
+}
+
+/* Same as prepare_protocols() in sslh-main.c, without the targets */
+static void setup_protocols(void)
+{
+    struct sslhcfg_protocols_item* p;
+    int i;
+
+    for (i = 0; i < cfg.protocols_len; i++) {
+        p = &cfg.protocols[i];
+        p->probe = get_probe(p->name);
+        if (!p->probe) {
+            fprintf(stderr, "%s: probe unknown\n", p->name);
+            exit(1);
+        }
+
+        if (!strcmp(p->name, "tls")) {
+            p->data = (void*)new_tls_data();
+            if (p->sni_hostnames_len)
+                tls_data_set_list(p->data, 0, (const char**)p->sni_hostnames,
+                                  p->sni_hostnames_len);
+            if (p->alpn_protocols_len)
+                tls_data_set_list(p->data, 1, (const char**)p->alpn_protocols,
+                                  p->alpn_protocols_len);
+        }
+
+        if (!strcmp(p->name, "regex") && regex_compile(p))
+            exit(6);
+    }
+    tls_compile_matchers();
+    build_probe_dispatch();
+}
+
+static void parse_options(int argc, char* argv[], int* first_file, long* iterations)
+{
+    int i, first = 1, sep, res;
+
+    while (argc > first + 1 && argv[first][0] == '-' && argv[first][1] &&
+           !argv[first][2] && strchr("nar", argv[first][1])) {
+        switch (argv[first][1]) {
+        case 'n':
+            *iterations = atol(argv[first + 1]);
+            if (*iterations <= 0) usage();
+            break;
+        case 'a':
+            default_alpn[0] = argv[first + 1];
+            break;
+        case 'r':
+            if (default_regex_len == ARRAY_SIZE(default_regex)) usage();
+            default_regex[default_regex_len++] = argv[first + 1];
+            break;
+        }
+        first += 2;
+    }
+
+    for (sep = first; sep < argc && strcmp(argv[sep], "--"); sep++)
+        ;
+
+    memset(&cfg, 0, sizeof(cfg));
+    if (sep < argc) {
+        /* sslhcfg_cl_parse() wants a program name first */
+        argv[first - 1] = argv[0];
+        res = sslhcfg_cl_parse(sep - first + 1, &argv[first - 1], &cfg);
+        if (res) exit(6);
+        *first_file = sep + 1;
+    } else {
+        res = sslhcfg_cl_parse(ARRAY_SIZE(default_options), default_options, &cfg);
+        if (res) exit(6);
+        for (i = 0; i < cfg.protocols_len; i++) {
+            if (!strcmp(cfg.protocols[i].name, "tls")) {
+                cfg.protocols[i].sni_hostnames = default_sni;
+                cfg.protocols[i].sni_hostnames_len = ARRAY_SIZE(default_sni);
+                if (default_alpn[0]) {
+                    cfg.protocols[i].alpn_protocols = default_alpn;
+                    cfg.protocols[i].alpn_protocols_len = 1;
+                }
+            }
+        }
+        if (default_regex_len) {
+            /* A copy of anyprot for the defaults, moved before it */
+            i = cfg.protocols_len++;
+            cfg.protocols = realloc(cfg.protocols, cfg.protocols_len * sizeof(*cfg.protocols));
+            CHECK_ALLOC(cfg.protocols, "realloc");
+            cfg.protocols[i] = cfg.protocols[i - 1];
+            cfg.protocols[i - 1].name = "regex";
+            cfg.protocols[i - 1].regex_patterns = default_regex;
+            cfg.protocols[i - 1].regex_patterns_len = default_regex_len;
+        }
+        *first_file = first;
+    }
+    if (!cfg.protocols_len) {
+        fprintf(stderr, "no protocols\n");
+        exit(2);
+    }
+    if (*first_file >= argc) usage();
+}
+
+static char* read_file(const char* name, int* len)
+{
+    char* buf;
+    FILE* f;
+    long size;
+
+    f = fopen(name, "r");
+    if (!f) {
+        perror(name);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    buf = malloc(size ? size : 1);
+    CHECK_ALLOC(buf, "malloc");
+    if (fread(buf, 1, size, f) != (size_t)size) {
+        perror(name);
+        exit(1);
+    }
+    fclose(f);
+    *len = size;
+    return buf;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char* result_name(int res, struct sslhcfg_protocols_item* p)
+{
+    switch (res) {
+    case PROBE_NEXT: return "next";
+    case PROBE_AGAIN: return "again";
+    case PROBE_MATCH: return p ? p->name : "match";
+    default: return "?";
+    }
+}
+
+static void print_line(const char* probe, const char* res, uint64_t ns, long calls, long n_allocs)
+{
+    printf("  %-10s %-10s %9.1f ns %6.2f allocs\n", probe, res,
+           (double)ns / calls, (double)n_allocs / calls);
+}
+
+/* Returns 0 if the chain gave what the file name says, 1 otherwise */
+static int run_file(const char* name, long iterations)
+{
+    struct sslhcfg_protocols_item *p, *found = NULL;
+    struct probe_state state;
+    const char* base;
+    char expect[64];
+    char* buf;
+    uint64_t start;
+    long i, a;
+    int j, len, res = 0, ok = 1;
+
+    buf = read_file(name, &len);
+    base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    printf("%s (%d bytes)\n", base, len);
+
+    for (j = 0; j < cfg.protocols_len; j++) {
+        p = &cfg.protocols[j];
+        a = allocs;
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            memset(&state, 0, sizeof(state));
+            res = p->probe(buf, len, p, &state);
+        }
+        print_line(p->name, result_name(res, NULL), now_ns() - start, iterations, allocs - a);
+    }
+
+    a = allocs;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        memset(&state, 0, sizeof(state));
+        res = probe_buffer(buf, len, &state, &found);
+    }
+    print_line("(chain)", result_name(res, found), now_ns() - start, iterations, allocs - a);
+
+    snprintf(expect, sizeof(expect), "%.*s", (int)strcspn(base, "-"), base);
+    if (!strcmp(expect, "again")) {
+        ok = (res == PROBE_AGAIN);
+    } else if (!strcmp(expect, "garbage")) {
+        ok = (res == PROBE_MATCH && found == &cfg.protocols[cfg.protocols_len - 1]);
+    } else {
+        for (j = 0; j < cfg.protocols_len; j++)
+            if (!strcmp(cfg.protocols[j].name, expect))
+                ok = (res == PROBE_MATCH && !strcmp(found->name, expect));
+    }
+    if (!ok)
+        printf("  expected %s\n", expect);
+
+    free(buf);
+    return !ok;
+}
+
+int main(int argc, char* argv[])
+{
+    long iterations = 100000;
+    int i, first_file, failed = 0;
+
+    parse_options(argc, argv, &first_file, &iterations);
+    setup_protocols();
+
+    for (i = first_file; i < argc; i++)
+        failed += run_file(argv[i], iterations);
+
+    if (failed)
+        printf("%d files not probed as expected\n", failed);
+    return failed ? 1 : 0;
+}
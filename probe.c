@@ -21,42 +21,50 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
-#ifdef ENABLE_REGEX
-#ifdef LIBPCRE
-#include <pcreposix.h>
-#else
-#include <regex.h>
-#endif
-#endif
 #include <ctype.h>
 #include "probe.h"
+#include "regex-probe.h"
+#include "proxy-protocol.h"
 
 
 
-static int is_ssh_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*);
-static int is_openvpn_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*);
-static int is_tinc_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*);
-static int is_xmpp_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*);
-static int is_http_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*);
-static int is_tls_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*);
-static int is_adb_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*);
-static int is_socks5_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*);
-static int is_true(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto) { return 1; }
+static int is_ssh_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*, struct probe_state*);
+static int is_openvpn_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*, struct probe_state*);
+static int is_tinc_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*, struct probe_state*);
+static int is_xmpp_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*, struct probe_state*);
+static int is_http_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*, struct probe_state*);
+static int is_tls_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*, struct probe_state*);
+static int is_adb_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*, struct probe_state*);
+static int is_socks5_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item*, struct probe_state*);
+static int is_true(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state) { return 1; }
 
 /* Table of protocols that have a built-in probe
  */
+#define STARTS(s) s, sizeof(s) - 1
+#define ANY NULL, 0
 static struct protocol_probe_desc builtins[] = {
-    /* description  probe  */
-    { "ssh",        is_ssh_protocol},
-    { "openvpn",    is_openvpn_protocol },
-    { "tinc",       is_tinc_protocol },
-    { "xmpp",       is_xmpp_protocol },
-    { "http",       is_http_protocol },
-    { "tls",        is_tls_protocol },
-    { "adb",        is_adb_protocol },
-    { "socks5",     is_socks5_protocol },
-    { "anyprot",    is_true }
+    /* description  probe                   first bytes       next is final */
+    { "ssh",        is_ssh_protocol,        STARTS("S"),      1 },
+    { "openvpn",    is_openvpn_protocol,    ANY,              0 },  /* length of the whole packet */
+    { "tinc",       is_tinc_protocol,       STARTS("0"),      1 },
+    { "xmpp",       is_xmpp_protocol,       ANY,              0 },  /* "jabber" anywhere */
+    { "http",       is_http_protocol,       ANY,              0 },  /* "HTTP" anywhere */
+    { "tls",        is_tls_protocol,        STARTS("\x16"),   1 },
+    { "adb",        is_adb_protocol,        STARTS("C\0"),    1 },
+    { "socks5",     is_socks5_protocol,     STARTS("\x05"),   1 },
+    { "anyprot",    is_true,                ANY,              0 }
 };
+#undef STARTS
+#undef ANY
+
+/* For each possible first byte, the configured protocols that can match a
+ * stream starting with it, in configuration order. The last slot is for
+ * empty buffers, and holds all the probes. */
+static struct sslhcfg_protocols_item** dispatch[257];
+static int dispatch_len[257];
+
+/* Bit i set if protocol i can be left out once its probe said PROBE_NEXT */
+static uint64_t next_is_final;
 
 /* TODO I think this has to go */
 struct protocol_probe_desc*  get_builtins(void) {
@@ -114,7 +122,7 @@ void hexdump(const char *mem, unsigned int len)
 }
 
 /* Is the buffer the beginning of an SSH connection? */
-static int is_ssh_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto)
+static int is_ssh_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
 {
     if (len < 4)
         return PROBE_AGAIN;
@@ -132,7 +140,7 @@ static int is_ssh_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_
  * http://www.fengnet.com/book/vpns%20illustrated%20tunnels%20%20vpnsand%20ipsec/ch08lev1sec5.html
  * and OpenVPN ssl.c, ssl.h and options.c
  */
-static int is_openvpn_protocol (const char*p,ssize_t len, struct sslhcfg_protocols_item* proto)
+static int is_openvpn_protocol (const char*p,ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
 {
     int packet_len;
 
@@ -147,7 +155,7 @@ static int is_openvpn_protocol (const char*p,ssize_t len, struct sslhcfg_protoco
  * Protocol is documented here: http://www.tinc-vpn.org/documentation/tinc.pdf
  * First connection starts with "0 " in 1.0.15)
  * */
-static int is_tinc_protocol( const char *p, ssize_t len, struct sslhcfg_protocols_item* proto)
+static int is_tinc_protocol( const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
 {
     if (len < 2)
         return PROBE_AGAIN;
@@ -159,9 +167,26 @@ static int is_tinc_protocol( const char *p, ssize_t len, struct sslhcfg_protocol
  * (Protocol is documented (http://tools.ietf.org/html/rfc6120) but for lazy
  * clients, just checking first frame containing "jabber" in xml entity)
  * */
-static int is_xmpp_protocol( const char *p, ssize_t len, struct sslhcfg_protocols_item* proto)
+/* Searches for needle in p, skipping what was already searched in the
+ * previous calls on the same buffer */
+static int search_from(const char *p, ssize_t len, const char* needle, int* scanned)
+{
+    int needle_len = strlen(needle);
+    int from = *scanned;
+
+    if (memmem(p + from, len - from, needle, needle_len))
+        return 1;
+
+    /* The next search must start early enough for the needle to straddle
+     * what we have and what is still to come */
+    if (len - needle_len + 1 > from)
+        *scanned = len - needle_len + 1;
+    return 0;
+}
+
+static int is_xmpp_protocol( const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
 {
-    if (memmem(p, len, "jabber", 6))
+    if (search_from(p, len, "jabber", &state->xmpp_scanned))
         return PROBE_MATCH;
 
     /* sometimes the word 'jabber' shows up late in the initial string,
@@ -182,11 +207,11 @@ static int probe_http_method(const char *p, int len, const char *opt)
 }
 
 /* Is the buffer the beginning of an HTTP connection?  */
-static int is_http_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto)
+static int is_http_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
 {
     int res;
     /* If it's got HTTP in the request (HTTP/1.1) then it's HTTP */
-    if (memmem(p, len, "HTTP", 4))
+    if (search_from(p, len, "HTTP", &state->http_scanned))
         return PROBE_MATCH;
 
 #define PROBE_HTTP_METHOD(opt) if ((res = probe_http_method(p, len, opt)) != PROBE_NEXT) return res
@@ -208,10 +233,20 @@ static int is_http_protocol(const char *p, ssize_t len, struct sslhcfg_protocols
 }
 
 /* Says if it's TLS, optionally with SNI and ALPN lists in proto->data */
-static int is_tls_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto)
+static int is_tls_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
 {
-    switch (parse_tls_header(proto->data, p, len)) {
-    case TLS_MATCH: return PROBE_MATCH;
+    /* Don't parse anything until the whole record is there: large
+     * ClientHellos often come in several segments */
+    if ((len >= TLS_HEADER_LEN) && (p[0] == TLS_HANDSHAKE_CONTENT_TYPE) && (p[1] >= 3) &&
+        (len < TLS_HEADER_LEN + (((unsigned char)p[3] << 8) | (unsigned char)p[4])))
+        return PROBE_AGAIN;
+
+    /* The ClientHello is parsed once for all the tls protocols */
+    if (!state->tls_status || state->tls_status == TLS_ELENGTH)
+        state->tls_status = parse_tls_header(p, len, &state->tls_matches);
+
+    switch (state->tls_status) {
+    case TLS_MATCH: return tls_data_matches(proto->data, state->tls_matches) ? PROBE_MATCH : PROBE_NEXT;
     case TLS_NOMATCH: return PROBE_NEXT;
     case TLS_ELENGTH: return PROBE_AGAIN;
     default: return PROBE_NEXT;
@@ -228,7 +263,7 @@ static int probe_adb_cnxn_message(const char *p)
     return !memcmp(&p[0], "CNXN", 4) && !memcmp(&p[24], "host:", 5);
 }
 
-static int is_adb_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto)
+static int is_adb_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
 {
     /* amessage.data_length is not being checked, under the assumption that
      * a packet >= 30 bytes will have "something" in the payload field.
@@ -267,7 +302,7 @@ static int is_adb_protocol(const char *p, ssize_t len, struct sslhcfg_protocols_
     return probe_adb_cnxn_message(&p[sizeof(empty_message)]);
 }
 
-static int is_socks5_protocol(const char *p_in, ssize_t len, struct sslhcfg_protocols_item* proto)
+static int is_socks5_protocol(const char *p_in, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
 {
     unsigned char* p = (unsigned char*)p_in;
     int i;
@@ -300,21 +335,53 @@ static int is_socks5_protocol(const char *p_in, ssize_t len, struct sslhcfg_prot
     return PROBE_MATCH;
 }
 
-static int regex_probe(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto)
+static struct protocol_probe_desc* get_probe_desc(T_PROBE* probe)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(builtins); i++) {
+        if (builtins[i].probe == probe)
+            return &builtins[i];
+    }
+    return NULL;
+}
+
+void build_probe_dispatch(void)
 {
-#ifdef ENABLE_REGEX
-    regex_t **probe = proto->data;
-    regmatch_t pos = { 0, len };
-
-    for (; *probe && regexec(*probe, p, 0, &pos, REG_STARTEND); probe++)
-        /* try them all */;
-
-    return (*probe != NULL);
-#else
-    /* Should never happen as we check when loading config file */
-    fprintf(stderr, "FATAL: regex probe called but not built in\n");
-    exit(5);
-#endif
+    static struct sslhcfg_protocols_item** lists;
+    struct protocol_probe_desc* desc;
+    struct sslhcfg_protocols_item* p;
+    int b, i;
+
+    free(lists);
+    lists = calloc(ARRAY_SIZE(dispatch) * (cfg.protocols_len + 1), sizeof(*lists));
+    CHECK_ALLOC(lists, "calloc");
+
+    for (b = 0; b < ARRAY_SIZE(dispatch); b++) {
+        dispatch[b] = &lists[b * (cfg.protocols_len + 1)];
+        dispatch_len[b] = 0;
+    }
+    next_is_final = 0;
+
+    for (i = 0; i < cfg.protocols_len; i++) {
+        p = &cfg.protocols[i];
+
+        if (! p->probe) continue;
+
+        /* Don't probe last protocol if it is anyprot (and store last protocol) */
+        if ((i == cfg.protocols_len - 1) && (!strcmp(p->name, "anyprot")))
+            break;
+
+        desc = get_probe_desc(p->probe);
+        if (desc && desc->next_is_final && i < 64)
+            next_is_final |= 1ULL << i;
+        for (b = 0; b < ARRAY_SIZE(dispatch); b++) {
+            if (desc && desc->first_bytes && (b < 256) &&
+                !memchr(desc->first_bytes, b, desc->first_bytes_len))
+                continue;
+            dispatch[b][dispatch_len[b]++] = p;
+        }
+    }
 }
 
 /* Run all the probes on a buffer
@@ -323,37 +390,48 @@ static int regex_probe(const char *p, ssize_t len, struct sslhcfg_protocols_item
  *      PROBE_MATCH if protocol is identified, in which case *proto is set to
  *      point to the appropriate protocol
  * */
-int probe_buffer(char* buf, int len, struct sslhcfg_protocols_item** proto)
+int probe_buffer(char* buf, int len, struct probe_state* state,
+                 struct sslhcfg_protocols_item** proto)
 {
-    struct sslhcfg_protocols_item* p;
-    int i, res, again = 0;
+    struct sslhcfg_protocols_item **candidates, *p;
+    int i, res, num, again = 0;
 
-    if (cfg.verbose > 1) {
+    if (VERBOSE_MAX > 1 && cfg.verbose > 1) {
         fprintf(stderr, "hexdump of incoming packet:\n");
         hexdump(buf, len);
     }
 
+    /* The configuration was reloaded since the last call: what was found out
+     * is about protocols that are gone */
+    if (state->generation != config_generation) {
+        memset(state, 0, sizeof(*state));
+        state->generation = config_generation;
+    }
+
+    /* Only run the probes that can match what the buffer starts with */
+    i = len > 0 ? (unsigned char)buf[0] : 256;
+    candidates = dispatch[i];
+    num = dispatch_len[i];
+
     *proto = NULL;
-    for (i = 0; i < cfg.protocols_len; i++) {
+    for (i = 0; i < num; i++) {
         char* probe_str[3] = {"PROBE_NEXT", "PROBE_MATCH", "PROBE_AGAIN"};
-        p = &cfg.protocols[i];
+        p = candidates[i];
 
-        if (! p->probe) continue;
-
-        if (cfg.verbose) fprintf(stderr, "probing for %s\n", p->name);
+        /* Already failed on the beginning of this buffer */
+        if ((p - cfg.protocols < 64) && (state->eliminated & (1ULL << (p - cfg.protocols))))
+            continue;
 
-        /* Don't probe last protocol if it is anyprot (and store last protocol) */
-        if ((i == cfg.protocols_len - 1) && (!strcmp(p->name, "anyprot")))
-            break;
+        print_verbose(1, "probing for %s\n", p->name);
 
         if (p->minlength_is_present && (len < p->minlength )) {
-            fprintf(stderr, "input too short, %d bytes but need %d\n", len , p->minlength);
+            print_verbose(1, "input too short, %d bytes but need %d\n", len , p->minlength);
             again++;
             continue;
         }
 
-        res = p->probe(buf, len, p);
-        if (cfg.verbose) fprintf(stderr, "probed for %s: %s\n", p->name, probe_str[res]);
+        res = p->probe(buf, len, p, state);
+        print_verbose(1, "probed for %s: %s\n", p->name, probe_str[res]);
 
         if (res == PROBE_MATCH) {
             *proto = p;
@@ -361,6 +439,9 @@ int probe_buffer(char* buf, int len, struct sslhcfg_protocols_item** proto)
         }
         if (res == PROBE_AGAIN)
             again++;
+        if ((res == PROBE_NEXT) && (p - cfg.protocols < 64) &&
+            (next_is_final & (1ULL << (p - cfg.protocols))))
+            state->eliminated |= 1ULL << (p - cfg.protocols);
     }
     if (again)
         return PROBE_AGAIN;
@@ -374,14 +455,64 @@ int probe_buffer(char* buf, int len, struct sslhcfg_protocols_item** proto)
  * Read the beginning of data coming from the client connection and check if
  * it's a known protocol.
  * Return PROBE_AGAIN if not enough data, or PROBE_MATCH if it succeeded in
- * which case cnx->proto is set to the appropriate protocol.
+ * which case cnx->proto is set to the appropriate protocol, or PROBE_NEXT if
+ * the client did not send the PROXY header it should have: the connection
+ * must be dropped.
  */
+/* Probes what the client sent so far, which the deferred data of q[1] holds
+ * (at least one new byte) */
+static int probe_deferred(struct connection *cnx)
+{
+    struct queue* q = &cnx->q[1];
+    void* data;
+    int size, res;
+
+    if (cnx->proxy_header) {
+        res = proxy_header_parse(cnx);
+        if (res == PROBE_NEXT)
+            log_message(LOG_ERR, "fd %d: no PROXY header, dropped\n", cnx->q[0].fd);
+        if (res != PROBE_MATCH)
+            return res;
+        /* Now we know who the client is */
+        if (admission_source(cnx) == -1) {
+            admission_reset(cnx->q[0].fd);
+            return PROBE_NEXT;
+        }
+    }
+    data = get_deferred_data(q, &size);
+    if (!size)
+        return PROBE_AGAIN;
+    res = probe_buffer(data, size, &cnx->setup->probe, &cnx->proto);
+    if (res == PROBE_MATCH)
+        cnx->config = config_get();
+    return res;
+}
+
 int probe_client_protocol(struct connection *cnx)
 {
-    char buffer[BUFSIZ];
+    struct queue* q = &cnx->q[1];
+    struct iovec iov[2];
     ssize_t n;
+    int iovcnt;
 
-    n = read(cnx->q[0].fd, buffer, sizeof(buffer));
+    /* Don't read more than we can keep, with room for a PROXY header in
+     * front: that's more than any probe needs, so give up probing */
+    n = deferred_data_space(q) - PROXY_HEADER_MAX;
+    if (n <= 0) {
+        if (cnx->proxy_header)
+            return PROBE_NEXT;
+        cnx->proto = &cfg.protocols[cfg.protocols_len-1];
+        cnx->config = config_get();
+        return PROBE_MATCH;
+    }
+    if (n > BUFSIZ)
+        n = BUFSIZ;
+
+    /* Read straight into the deferred data, which is what gets probed */
+    if (!q->deferred_data)
+        q->deferred_data = ring_new();
+    iovcnt = ring_space_iov(q->deferred_data, iov, n);
+    n = readv(cnx->q[0].fd, iov, iovcnt);
     /* It's possible that read() returns an error, e.g. if the client
      * disconnected between the previous call to select() and now. If that
      * happens, we just connect to the default protocol so the caller of this
@@ -389,17 +520,37 @@ int probe_client_protocol(struct connection *cnx)
      * connection will just fail later normally). */
 
     if (n > 0) {
-        defer_write(&cnx->q[1], buffer, n);
-        return probe_buffer(cnx->q[1].begin_deferred_data,
-                            cnx->q[1].deferred_data_size,
-                            &cnx->proto);
+        cnx->q[0].bytes += n;
+        ring_commit(q->deferred_data, n);
+        return probe_deferred(cnx);
     }
 
     /* read() returned an error, so just connect to the last protocol to die */
+    if (cnx->proxy_header)
+        return PROBE_NEXT;
     cnx->proto = &cfg.protocols[cfg.protocols_len-1];
+    cnx->config = config_get();
     return PROBE_MATCH;
 }
 
+int probe_client_data(struct connection *cnx, const void* buf, size_t len)
+{
+    struct queue* q = &cnx->q[1];
+
+    /* Callers only hand over what probe_client_protocol() would have read */
+    if ((ssize_t)len > deferred_data_space(q) - PROXY_HEADER_MAX) {
+        log_message(LOG_ERR, "fd %d: %zu bytes to probe don't fit, dropped\n",
+                    cnx->q[0].fd, len);
+        return PROBE_NEXT;
+    }
+
+    if (!q->deferred_data)
+        q->deferred_data = ring_new();
+    cnx->q[0].bytes += len;
+    ring_write(q->deferred_data, buf, len);
+    return probe_deferred(cnx);
+}
+
 /* Returns the probe for specified protocol:
  * parameter is the description in builtins[], or "regex" 
  * */
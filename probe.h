@@ -13,11 +13,17 @@ typedef enum {
 } probe_result;
 
 struct sslhcfg_protocols_item;
-typedef int T_PROBE(const char*, ssize_t, struct sslhcfg_protocols_item*);
+typedef int T_PROBE(const char*, ssize_t, struct sslhcfg_protocols_item*, struct probe_state*);
 
 struct protocol_probe_desc {
     const char* name;
     T_PROBE* probe;
+    /* Bytes a stream of that protocol can start with, or NULL if any */
+    const char* first_bytes;
+    int first_bytes_len;
+    /* PROBE_NEXT on the beginning of a stream holds for the whole stream, so
+     * the probe needs not run again on more data */
+    int next_is_final;
 };
 
 
@@ -43,12 +49,30 @@ void set_protocol_list(struct sslhcfg_protocols_item*);
  * Read the beginning of data coming from the client connection and check if
  * it's a known protocol. Then leave the data on the deferred
  * write buffer of the connection and returns a pointer to the protocol
- * structure
+ * structure. If the client must send a PROXY header first, that's parsed first
+ * (see proxy-protocol.h) and PROBE_NEXT means there was none.
  */
 int probe_client_protocol(struct connection *cnx);
 
-/* Probe, but on a buffer */
-int probe_buffer(char* buf, int len, struct sslhcfg_protocols_item** proto);
+/* probe_client_data
+ *
+ * Same as probe_client_protocol(), for `len` bytes the caller already read
+ * from the client. They must fit in the deferred write buffer with room for a
+ * PROXY header, as probe_client_protocol() makes sure of when it reads.
+ */
+int probe_client_data(struct connection *cnx, const void* buf, size_t len);
+
+/* Sorts the configured protocols by the first bytes they can start with, so
+ * probe_buffer() only runs the probes that can still match. Must be called
+ * once the protocols are configured, before any probing, and again when they
+ * change. */
+void build_probe_dispatch(void);
+
+/* Probe, but on a buffer. `state` holds what previous calls found out about
+ * the beginning of the same buffer; it must be zeroed for a new buffer. It is
+ * reset if the configuration changed since. */
+int probe_buffer(char* buf, int len, struct probe_state* state,
+                 struct sslhcfg_protocols_item** proto);
 
 /* set the protocol to connect to in case of timeout */
 void set_ontimeout(const char* name);
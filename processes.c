@@ -0,0 +1,927 @@
+/*
+   processes.c: event loop that probes and shovels connections, shared by
+   sslh-select and sslh-threads
+
+# Copyright (C) 2007-2010  Yves Rutschle
+# 
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+# 
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+# 
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+
+*/
+
+#define __LINUX__
+
+#include "common.h"
+#include <pthread.h>
+#include "probe.h"
+#include "watchers.h"
+#include "timers.h"
+#include "udp-listener.h"
+#include "backends.h"
+#include "proxy-protocol.h"
+#include "processes.h"
+
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+/* All the connections. The event backend keeps pointers to the connections it
+ * watches, so connections must never move: they are allocated in blocks of
+ * per_block, and `block` is an array of pointers to these blocks.
+ * Free connections are kept on a stack, so finding one is O(1).
+ * Once most slots are free, blocks with no connection left are freed (see
+ * compact_collection()). */
+struct cnx_collection {
+    struct connection **block;
+    int num_blocks;
+    int per_block;      /* Number of slots in each block */
+    int num;            /* Number of slots */
+    struct connection **free_slot;
+    int num_free;       /* Number of free slots, on top of free_slot */
+    uint64_t compacted; /* when compact_collection() last ran (monotonic_ms()) */
+};
+
+/* How often to look for blocks to free, in ms */
+#define COMPACT_INTERVAL    10000
+
+/* Everything one event loop works with */
+struct loop_info {
+    struct watchers* watchers;
+    struct timer_wheel timeouts;    /* probe timeouts */
+    struct cnx_collection collection;
+    struct listen_endpoint* listen_sockets;
+    int num_addr_listen;
+    struct udp_listener** udp_listeners;   /* for each listening socket, NULL if TCP */
+    int draining;       /* not accepting anymore, see stop_listening() */
+    pthread_t thread;
+    struct loop_info* next_loop;
+};
+
+/* Event loops hold config_lock for reading while they process a batch of
+ * events, and a reload swaps the configuration in while holding it for
+ * writing. Only one thread handles a signal at a time, under signal_mutex,
+ * which also guards the list of event loops running. */
+static pthread_rwlock_t config_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t signal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct loop_info* loops;
+static int loops_draining;
+
+/* Make the file descriptor non-block  */
+int set_nonblock(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    CHECK_RES_RETURN(flags, "fcntl", -1);
+
+    flags |= O_NONBLOCK;
+
+    flags = fcntl(fd, F_SETFL, flags);
+    CHECK_RES_RETURN(flags, "fcntl", -1);
+
+    return flags;
+}
+
+/* Registers the sockets of connection attempts (see connect.h) */
+static void connect_watch(struct connection* cnx, int fd, int opened, void* arg)
+{
+    struct loop_info* fd_info = arg;
+
+    if (opened)
+        watchers_add_write(fd_info->watchers, fd, cnx);
+    else
+        watchers_del(fd_info->watchers, fd);
+}
+
+/* Closes the connection and puts its slot back on the free stack */
+int tidy_connection(struct connection *cnx, struct loop_info* fd_info)
+{
+    struct cnx_collection* collection = &fd_info->collection;
+    int i, in_use = (cnx->q[0].fd != -1);
+
+    if (in_use) {
+        log_connection_end(cnx);
+        metrics_closed(cnx);
+        admission_closed(cnx);
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (cnx->q[i].fd != -1) {
+            print_verbose(1, "closing fd %d\n", cnx->q[i].fd);
+
+            watchers_del(fd_info->watchers, cnx->q[i].fd);
+            close(cnx->q[i].fd);
+            release_deferred_data(&cnx->q[i]);
+        }
+    }
+    connect_abort(cnx, connect_watch, fd_info);
+    cnx_setup_free(cnx);
+    backend_release(cnx);
+    config_put(cnx->config);
+    timer_del(&fd_info->timeouts, &cnx->timeout);
+    release_splice(cnx);
+    init_cnx(cnx);
+
+    if (in_use)
+        collection->free_slot[collection->num_free++] = cnx;
+
+    return 0;
+}
+
+/* Adds a block of per_block new slots to the collection. Returns -1 if that
+ * fails
+ *
+ * per_block is the number of connection to allocate at once (at start-up,
+ * and then every time we get too many simultaneous connections: e.g. start
+ * with 12 slots, then if we get more than 12 connections allocate another
+ * 12 slots, and so on). We try to allocate as many structures at once as will
+ * fit in one page, so a block is small enough to empty out once the
+ * connections in it close.
+ */
+static int grow_collection(struct cnx_collection* collection)
+{
+    struct connection **new_block, **new_free, *block;
+    int i, per_block;
+
+    if (!collection->per_block) {
+        collection->per_block = getpagesize() / sizeof(struct connection);
+        if (collection->per_block < 1) collection->per_block = 1;
+    }
+    per_block = collection->per_block;
+
+    block = malloc(per_block * sizeof(*block));
+    new_block = realloc(collection->block,
+                        (collection->num_blocks + 1) * sizeof(*new_block));
+    if (new_block) collection->block = new_block;
+    new_free = realloc(collection->free_slot,
+                       (collection->num + per_block) * sizeof(*new_free));
+    if (new_free) collection->free_slot = new_free;
+    if (!block || !new_block || !new_free) {
+        free(block);
+        return -1;
+    }
+
+    for (i = 0; i < per_block; i++) {
+        init_cnx(&block[i]);
+        /* Push in reverse so slots get used in order */
+        collection->free_slot[collection->num_free++] = &block[per_block - 1 - i];
+    }
+    collection->block[collection->num_blocks++] = block;
+    collection->num += per_block;
+    metrics_memory(MEM_SLOTS, per_block * sizeof(*block));
+
+    return 0;
+}
+
+/* When most slots are free, frees the blocks that no connection uses anymore
+ * (but one), and rebuilds the free stack so the slots of the first blocks get
+ * used first, leaving the last ones to empty out. Call between batches of
+ * events, when nothing points to free slots. */
+static void compact_collection(struct cnx_collection* collection)
+{
+    struct connection *block, **array;
+    uint64_t now = monotonic_ms();
+    int i, j, n, in_use, spare = 0;
+
+    if (now - collection->compacted < COMPACT_INTERVAL)
+        return;
+    collection->compacted = now;
+    if (collection->num_blocks < 2 || collection->num_free < collection->num / 2)
+        return;
+
+    for (i = n = 0; i < collection->num_blocks; i++) {
+        block = collection->block[i];
+        for (j = in_use = 0; j < collection->per_block; j++)
+            in_use += (block[j].q[0].fd != -1);
+        if (!in_use && spare++) {
+            free(block);
+            metrics_memory(MEM_SLOTS, -(long)(collection->per_block * sizeof(*block)));
+            continue;
+        }
+        collection->block[n++] = block;
+    }
+
+    collection->num_free = 0;
+    for (i = n - 1; i >= 0; i--)
+        for (j = collection->per_block - 1; j >= 0; j--)
+            if (collection->block[i][j].q[0].fd == -1)
+                collection->free_slot[collection->num_free++] = &collection->block[i][j];
+
+    if (n == collection->num_blocks)
+        return;
+    print_verbose(1, "freed %d blocks of slots\n", collection->num_blocks - n);
+    collection->num_blocks = n;
+    collection->num = n * collection->per_block;
+
+    /* If shrinking fails, the arrays are just bigger than needed */
+    array = realloc(collection->block, n * sizeof(*array));
+    if (array) collection->block = array;
+    array = realloc(collection->free_slot, collection->num * sizeof(*array));
+    if (array) collection->free_slot = array;
+}
+
+/* Reads of a probing client go straight into the backend's buffers (see
+ * watchers_add_recv()) while all they can bring fits with what is kept */
+static int watch_probing(struct connection *cnx, struct loop_info* fd_info)
+{
+    if (deferred_data_space(&cnx->q[1]) - PROXY_HEADER_MAX >= WATCHERS_RECV_MAX)
+        return watchers_add_recv(fd_info->watchers, cnx->q[0].fd, cnx);
+    return watchers_add_read(fd_info->watchers, cnx->q[0].fd, cnx);
+}
+
+static int cnx_accepted(struct listen_endpoint* endpoint, struct loop_info* fd_info,
+                        int in_socket, struct sockaddr_storage* peer, socklen_t peer_len);
+
+/* Accepts a connection from the main socket and assigns it to an empty slot.
+ * If no slots are available, allocate another few. If that fails, drop the
+ * connexion. Connections admission control refuses are reset. Returns 0 if
+ * there was no connection to accept, 1 otherwise. */
+int accept_new_connection(struct listen_endpoint* endpoint, struct loop_info* fd_info)
+{
+    int listen_socket = endpoint->socketfd;
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    int in_socket;
+
+#ifdef SOCK_NONBLOCK
+    in_socket = accept4(listen_socket, (struct sockaddr*)&peer, &peer_len,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    in_socket = accept(listen_socket, (struct sockaddr*)&peer, &peer_len);
+#endif
+    if (in_socket == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0; /* queue drained, or another process got it first */
+    CHECK_RES_RETURN(in_socket, "accept", 0);
+
+#ifndef SOCK_NONBLOCK
+    if (set_nonblock(in_socket) == -1) {
+        close(in_socket);
+        return 0;
+    }
+#endif
+
+    return cnx_accepted(endpoint, fd_info, in_socket, &peer, peer_len);
+}
+
+/* With io_uring, in_socket was accepted from the listening socket fd before
+ * the event came (see watchers_add_accept()) */
+static void accepted_process(int fd, int in_socket, struct loop_info* fd_info)
+{
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    int i;
+
+    for (i = 0; i < fd_info->num_addr_listen; i++) {
+        if (fd_info->listen_sockets[i].socketfd != fd) continue;
+        if (getpeername(in_socket, (struct sockaddr*)&peer, &peer_len) == -1)
+            break;
+        cnx_accepted(&fd_info->listen_sockets[i], fd_info, in_socket, &peer, peer_len);
+        return;
+    }
+    close(in_socket);
+}
+
+/* Sets up the connection in_socket came with, as accepted from endpoint.
+ * Returns 0 if it got dropped for lack of memory, 1 otherwise. */
+static int cnx_accepted(struct listen_endpoint* endpoint, struct loop_info* fd_info,
+                        int in_socket, struct sockaddr_storage* peer, socklen_t peer_len)
+{
+    struct cnx_collection* collection = &fd_info->collection;
+    struct connection *cnx;
+
+    /* Get an empty slot */
+    if (!collection->num_free)  {
+        print_verbose(1, "buying more slots from the slot machine.\n");
+        if (grow_collection(collection) == -1) {
+            log_message(LOG_ERR, "unable to realloc -- dropping connection\n");
+            close(in_socket);
+            return 0;
+        }
+    }
+    cnx = collection->free_slot[collection->num_free - 1];
+
+    cnx->q[0].fd = in_socket;
+    memcpy(&cnx->peer, peer, peer_len);
+    cnx->peer_len = peer_len;
+    cnx->proxy_header = endpoint->proxy_protocol;
+    if (admission_accepted(cnx) == -1) {
+        admission_reset(in_socket);
+        close(in_socket);
+        init_cnx(cnx);
+        return 1;
+    }
+
+    if (cnx_setup_new(cnx) == -1 || watch_probing(cnx, fd_info) == -1) {
+        cnx_setup_free(cnx);
+        admission_closed(cnx);
+        close(in_socket);
+        init_cnx(cnx);
+        return 0;
+    }
+    collection->num_free--;
+
+    cnx->state = ST_PROBING;
+    cnx->timeout.data = cnx;
+    timer_add(&fd_info->timeouts, &cnx->timeout, cfg.timeout * 1000);
+    metrics_accepted(cnx);
+
+    print_verbose(1, "accepted fd %d\n", in_socket);
+
+    return 1;
+}
+
+
+/* The target socket is connected: start shoveling */
+static void cnx_connected(struct connection *cnx, struct loop_info* fd_info)
+{
+    struct watchers* w = fd_info->watchers;
+    struct queue *q = &cnx->q[1];
+
+    cnx->state = ST_SHOVELING;
+    timer_del(&fd_info->timeouts, &cnx->timeout);
+    /* From now on, the connection only holds buffers while data is waiting */
+    cnx_setup_free(cnx);
+
+    watchers_del_write(w, q->fd);
+    watchers_add_read(w, q->fd, cnx);
+    watchers_add_read(w, cnx->q[0].fd, cnx);
+
+    log_connection(NULL, cnx);
+    setup_splice(cnx);
+    flush_deferred(q);
+    if (has_deferred_data(q))
+        watchers_add_write(w, q->fd, cnx);
+    if (deferred_data_full(q))
+        watchers_del_read(w, cnx->q[0].fd);
+}
+
+/* Acts on the result of a connect_*() call */
+static void connect_progress(struct connection *cnx, int status, struct loop_info* fd_info)
+{
+    switch (status) {
+    case CONNECT_DONE:
+        cnx_connected(cnx, fd_info);
+        break;
+
+    case CONNECT_FAILED:
+        tidy_connection(cnx, fd_info);
+        break;
+
+    default: /* CONNECT_PENDING */
+        timer_add(&fd_info->timeouts, &cnx->timeout, connect_wait_ms(cnx));
+        break;
+    }
+}
+
+/* Starts connecting queue 1 of connection to its target */
+static void connect_queue(struct connection *cnx, struct loop_info* fd_info)
+{
+    cnx->state = ST_CONNECTING;
+    /* Anything else the client sends waits until we're connected */
+    watchers_del_read(fd_info->watchers, cnx->q[0].fd);
+
+    connect_progress(cnx, connect_begin(cnx, connect_watch, fd_info), fd_info);
+}
+
+/* shovels data from active fd to the other
+   returns after one socket closed or operation would block
+ */
+void shovel(struct connection *cnx, int active_fd, struct loop_info* fd_info)
+{
+    struct watchers* w = fd_info->watchers;
+    struct queue *read_q, *write_q;
+
+    read_q = &cnx->q[active_fd];
+    write_q = &cnx->q[1-active_fd];
+
+    print_verbose(1, "activity on fd%d\n", read_q->fd);
+
+    switch(fd2fd(write_q, read_q)) {
+    case -1:
+    case FD_CNXCLOSED:
+        tidy_connection(cnx, fd_info);
+        break;
+
+    case FD_STALLED:
+        /* Keep reading until the write queue is full */
+        watchers_add_write(w, write_q->fd, cnx);
+        if (deferred_data_full(write_q))
+            watchers_del_read(w, read_q->fd);
+        break;
+
+    default: /* Nothing */
+        break;
+    }
+}
+
+/* shovels data from one fd to the other and vice-versa
+   returns after one socket closed
+ */
+void shovel_single(struct connection *cnx)
+{
+   fd_set fds_r, fds_w;
+   int res, i;
+   int max_fd = MAX(cnx->q[0].fd, cnx->q[1].fd) + 1;
+
+   FD_ZERO(&fds_r);
+   FD_ZERO(&fds_w);
+   while (1) {
+      for (i = 0; i < 2; i++) {
+         if (has_deferred_data(&cnx->q[i])) {
+            FD_SET(cnx->q[i].fd, &fds_w);
+            FD_CLR(cnx->q[1-i].fd, &fds_r);
+         } else {
+            FD_CLR(cnx->q[i].fd, &fds_w);
+            FD_SET(cnx->q[1-i].fd, &fds_r);
+         }
+      }
+
+      res = select(
+                   max_fd,
+                   &fds_r,
+                   &fds_w,
+                   NULL,
+                   NULL
+                  );
+      CHECK_RES_DIE(res, "select");
+
+      for (i = 0; i < 2; i++) {
+          if (FD_ISSET(cnx->q[i].fd, &fds_w)) {
+              res = flush_deferred(&cnx->q[i]);
+              if ((res == -1) && ((errno == EPIPE) || (errno == ECONNRESET))) {
+                  print_verbose(1, "%s socket closed\n", i ? "server" : "client");
+                  return;
+              }
+          }
+          if (FD_ISSET(cnx->q[i].fd, &fds_r)) {
+              res = fd2fd(&cnx->q[1-i], &cnx->q[i]);
+              if (!res) {
+                  print_verbose(1, "socket closed\n");
+                  return;
+              }
+          }
+      }
+   }
+}
+
+/* Child process that makes internal connection and proxies
+ */
+void connect_proxy(struct connection *cnx)
+{
+    int in_socket;
+    int out_socket;
+
+    /* Minimize the file descriptor value to help select() */
+    in_socket = dup(cnx->q[0].fd);
+    if (in_socket == -1) {
+        in_socket = cnx->q[0].fd;
+    } else {
+        close(cnx->q[0].fd);
+        cnx->q[0].fd = in_socket;
+    }
+
+    /* Connect the target socket */
+    out_socket = connect_addr(cnx);
+    CHECK_RES_DIE(out_socket, "connect");
+
+    cnx->q[1].fd = out_socket;
+
+    log_connection(NULL, cnx);
+
+    setup_splice(cnx);
+
+    shovel_single(cnx);
+
+    release_splice(cnx);
+    backend_release(cnx);
+    log_connection_end(cnx);
+    metrics_closed(cnx);
+    admission_closed(cnx);
+    close(in_socket);
+    close(out_socket);
+
+    print_verbose(1, "connection closed down\n");
+
+    exit(0);
+}
+
+/* A connection has been probed (or timed out): fork a process to serve it if
+ * the protocol requires it, or connect it to its target */
+static void connect_probed(struct connection *cnx, struct loop_info* fd_info)
+{
+    struct cnx_collection* collection = &fd_info->collection;
+    struct connection* other;
+    int i, j;
+
+    cnx->state = ST_SHOVELING;
+    timer_del(&fd_info->timeouts, &cnx->timeout);
+
+    /* max_connections, then libwrap check if required for this protocol */
+    if (admission_probed(cnx) == -1) {
+        admission_reset(cnx->q[0].fd);
+        tidy_connection(cnx, fd_info);
+    } else if (cnx->proto->service &&
+        check_access_rights(cnx, cnx->proto->service)) {
+        tidy_connection(cnx, fd_info);
+    } else if (cnx->proto->proxy_protocol && proxy_header_add(cnx) == -1) {
+        tidy_connection(cnx, fd_info);
+    } else if (cnx->proto->fork) {
+        struct connection cnx_copy = *cnx;
+        switch (fork()) {
+        case 0:  /* child */
+            setup_child_signals();
+            for (i = 0; i < fd_info->num_addr_listen; i++)
+                close(fd_info->listen_sockets[i].socketfd);
+            for (i = 0; i < collection->num; i++) {
+                other = &collection->block[i / collection->per_block][i % collection->per_block];
+                if (other != cnx)
+                    for (j = 0; j < 2; j++)
+                        if (other->q[j].fd != -1)
+                            close(other->q[j].fd);
+            }
+            watchers_close(fd_info->watchers);
+            connect_proxy(&cnx_copy);
+            exit(0);
+        case -1: log_message(LOG_ERR, "fork failed: err %d: %s\n", errno, strerror(errno));
+                 break;
+        default: /* parent */
+                 /* The child counts it from now on */
+                 memset(&cnx->metrics, 0, sizeof(cnx->metrics));
+                 memset(&cnx->admission, 0, sizeof(cnx->admission));
+                 break;
+        }
+        tidy_connection(cnx, fd_info);
+    } else {
+        connect_queue(cnx, fd_info);
+    }
+}
+
+/* We can write to queue j of cnx: flush deferred data, and once it's all
+ * gone, go back to reading the other side */
+static void cnx_write_process(struct connection *cnx, int j, struct loop_info* fd_info)
+{
+    struct watchers* w = fd_info->watchers;
+    int res;
+
+    res = flush_deferred(&cnx->q[j]);
+    if ((res == -1) && ((errno == EPIPE) || (errno == ECONNRESET))) {
+        print_verbose(1, "closing connection on fd %d\n", cnx->q[j].fd);
+        tidy_connection(cnx, fd_info);
+    } else {
+        /* If no deferred data is left, stop monitoring the fd
+         * for write; as soon as there is room, restart monitoring the other
+         * one for reads */
+        if (!has_deferred_data(&cnx->q[j]))
+            watchers_del_write(w, cnx->q[j].fd);
+        if (!deferred_data_full(&cnx->q[j]) && (cnx->q[1-j].fd != -1))
+            watchers_add_read(w, cnx->q[1-j].fd, cnx);
+    }
+}
+
+/* Acts on the result of probing what the client sent so far */
+static void probe_process(struct connection *cnx, int res, struct loop_info* fd_info)
+{
+    if (res == PROBE_AGAIN) {
+        if (watch_probing(cnx, fd_info) == -1)
+            tidy_connection(cnx, fd_info);
+        return;
+    }
+    if (res == PROBE_NEXT) {
+        tidy_connection(cnx, fd_info);
+        return;
+    }
+
+    metrics_probed(cnx, 0);
+    connect_probed(cnx, fd_info);
+}
+
+/* The backend read data from the client already (see watchers_add_recv()) */
+static void cnx_recv_process(struct connection *cnx, const char* buf, ssize_t len,
+                             struct loop_info* fd_info)
+{
+    print_verbose(1, "processing %zd bytes read on fd %d\n", len, cnx->q[0].fd);
+
+    if (cnx->state == ST_PROBING) {
+        probe_process(cnx, probe_client_data(cnx, buf, len), fd_info);
+        return;
+    }
+
+    /* Read as reads stopped, right after what got probed */
+    cnx->q[0].bytes += len;
+    if (defer_write(&cnx->q[1], (void*)buf, len) == -1) {
+        tidy_connection(cnx, fd_info);
+        return;
+    }
+    if (cnx->state == ST_SHOVELING)
+        watchers_add_write(fd_info->watchers, cnx->q[1].fd, cnx);
+}
+
+/* Data is available on queue j of cnx */
+static void cnx_read_process(struct connection *cnx, int j, struct loop_info* fd_info)
+{
+    print_verbose(1, "processing fd%d on fd %d\n", j, cnx->q[j].fd);
+
+    switch (cnx->state) {
+
+    case ST_PROBING:
+        if (j == 1) {
+            fprintf(stderr, "Activity on fd2 while probing, impossible\n");
+            dump_connection(cnx);
+            exit(1);
+        }
+
+        probe_process(cnx, probe_client_protocol(cnx), fd_info);
+        break;
+
+    case ST_SHOVELING:
+        shovel(cnx, j, fd_info);
+        break;
+
+    default: /* illegal */
+        log_message(LOG_ERR, "Illegal connection state %d\n", cnx->state);
+        exit(1);
+    }
+}
+
+/* A listening socket is readable: accept TCP connections (up to
+ * cfg.accept_batch at once, so other sockets get their turn), or forward UDP
+ * datagrams */
+static void listen_process(int fd, struct loop_info* fd_info)
+{
+    int i, n;
+
+    for (i = 0; i < fd_info->num_addr_listen; i++) {
+        if (fd_info->listen_sockets[i].socketfd != fd) continue;
+
+        if (fd_info->udp_listeners[i])
+            udp_extern_forward(fd_info->udp_listeners[i]);
+        else
+            for (n = 0; n < cfg.accept_batch || !n; n++)
+                if (!accept_new_connection(&fd_info->listen_sockets[i], fd_info))
+                    break;
+        return;
+    }
+}
+
+/* The timer of a connection expired. If it's been probing for too long,
+ * connect it to the timeout protocol; if it's connecting, time out attempts
+ * and start new ones */
+static void cnx_timeout(struct timer* t, void* arg)
+{
+    struct connection *cnx = t->data;
+    struct loop_info* fd_info = arg;
+
+    if (cnx->state == ST_CONNECTING) {
+        connect_progress(cnx, connect_update(cnx, connect_watch, fd_info), fd_info);
+        return;
+    }
+
+    if (cnx->proxy_header) {
+        log_message(LOG_ERR, "fd %d: no PROXY header, dropped\n", cnx->q[0].fd);
+        tidy_connection(cnx, fd_info);
+        return;
+    }
+
+    cnx->proto = timeout_protocol();
+    cnx->config = config_get();
+    if (cfg.verbose)
+        log_message(LOG_INFO,
+                    "timed out, connect to %s\n",
+                    cnx->proto->name);
+    metrics_probed(cnx, 1);
+    connect_probed(cnx, fd_info);
+}
+
+/* Reloads the configuration if SIGHUP asked for it, starts a new binary if
+ * SIGUSR2 did. Reading the new configuration is done while other threads'
+ * event loops keep going. */
+static void check_signals(void)
+{
+    struct sslhcfg_item* new_cfg;
+
+    if (!reload_requested && !upgrade_requested)
+        return;
+
+    pthread_mutex_lock(&signal_mutex);
+    if (__atomic_exchange_n(&upgrade_requested, 0, __ATOMIC_ACQ_REL))
+        upgrade_start();
+    if (__atomic_exchange_n(&reload_requested, 0, __ATOMIC_ACQ_REL)) {
+        new_cfg = reload_prepare();
+        if (new_cfg) {
+            pthread_rwlock_wrlock(&config_lock);
+            reload_install(new_cfg);
+            pthread_rwlock_unlock(&config_lock);
+        }
+    }
+    pthread_mutex_unlock(&signal_mutex);
+}
+
+/* SIGQUIT: stops accepting connections, which the sslh we upgraded to (if
+ * any) accepts on the same sockets. UDP sockets stay open, as the replies of
+ * current flows go out through them, but are not read anymore. */
+static void stop_listening(struct loop_info* fd_info)
+{
+    struct loop_info* l;
+    int i;
+
+    /* The signal only interrupted one thread: wake the others up */
+    pthread_mutex_lock(&signal_mutex);
+    if (!loops_draining)
+        for (l = loops; l; l = l->next_loop)
+            if (l != fd_info)
+                pthread_kill(l->thread, SIGQUIT);
+    loops_draining = 1;
+    pthread_mutex_unlock(&signal_mutex);
+
+    for (i = 0; i < fd_info->num_addr_listen; i++) {
+        watchers_del(fd_info->watchers, fd_info->listen_sockets[i].socketfd);
+        if (!fd_info->udp_listeners[i])
+            close(fd_info->listen_sockets[i].socketfd);
+    }
+    fd_info->draining = 1;
+    metrics_drain();
+    log_message(LOG_INFO, "no longer accepting connections\n");
+}
+
+/* Main loop: the idea is as follow:
+ * - Each file descriptor is registered with the event backend (see
+ * watchers.c) with a pointer to its connection, so we only ever look at
+ * connections that have something going on.
+ * - When a file descriptor goes off, process it: read from it, write the data
+ * to its corresponding pair.
+ * - When a file descriptor blocks when writing, move the data to a deferred
+ * buffer (see ring.h), and monitor the write fd for writes. Keep reading into
+ * the deferred buffer until it reaches the high-water mark, then stop
+ * monitoring the read fd.
+ * - When we can write to a file descriptor that has deferred data, we try to
+ * write as much as we can. As soon as there is room in the buffer again,
+ * restart monitoring its corresponding pair for reads. Once all data is
+ * written, stop monitoring the fd for writes and give the buffer back to the
+ * pool.
+ * - Targets are connected without blocking (see connect.h).
+ * - Probe and connect timeouts are kept in a timer wheel (see timers.h); we
+ * wait for events until the nearest one expires.
+ * - UDP datagrams are forwarded by flow (see udp-listener.h); expired flows
+ * are forgotten at the end of each batch of events.
+ * - On SIGHUP, the configuration is reloaded between batches (see
+ * check_signals()).
+ * - On SIGQUIT, we stop accepting, and return once all connections are
+ * closed and all UDP flows have expired.
+ *
+ * That way, memory used by a connection is bounded, and a slow reader only
+ * stalls its own connection.
+ */
+void event_loop(struct listen_endpoint listen_sockets[], int num_addr_listen)
+{
+    struct loop_info fd_info;
+    struct watcher_event events[WATCHERS_MAX_EVENTS];
+    int listen_ready[WATCHERS_MAX_EVENTS];
+    struct loop_info** l;
+    struct connection *cnx;
+    int i, j, n, num_listen_ready, timeout, udp_timeout, udp_flows = 0;
+
+    memset(&fd_info, 0, sizeof(fd_info));
+    fd_info.listen_sockets = listen_sockets;
+    fd_info.num_addr_listen = num_addr_listen;
+    timers_init(&fd_info.timeouts);
+
+    fd_info.watchers = watchers_init();
+    print_verbose(1, "using %s backend\n", watchers_backend());
+    print_verbose(1, "%zu bytes per connection, plus %zu until connected and %zu per buffer in use\n",
+                  sizeof(struct connection), sizeof(struct cnx_setup), ring_capacity());
+
+    fd_info.udp_listeners = calloc(num_addr_listen, sizeof(*fd_info.udp_listeners));
+    CHECK_ALLOC(fd_info.udp_listeners, "calloc");
+
+    for (i = 0; i < num_addr_listen; i++) {
+        /* Listening sockets are the only ones registered without a
+         * connection */
+        set_nonblock(listen_sockets[i].socketfd);
+        if (listen_sockets[i].type == SOCK_DGRAM) {
+            watchers_add_read(fd_info.watchers, listen_sockets[i].socketfd, NULL);
+            fd_info.udp_listeners[i] = udp_listener_new(listen_sockets[i].socketfd,
+                                                        fd_info.watchers);
+        } else {
+            watchers_add_accept(fd_info.watchers, listen_sockets[i].socketfd, NULL);
+        }
+    }
+
+    /* Start with a set pool of slots */
+    if (grow_collection(&fd_info.collection) == -1) {
+        fprintf(stderr, "unable to allocate connections\n");
+        exit(1);
+    }
+
+    fd_info.thread = pthread_self();
+    pthread_mutex_lock(&signal_mutex);
+    fd_info.next_loop = loops;
+    loops = &fd_info;
+    pthread_mutex_unlock(&signal_mutex);
+
+    timeout = -1;
+    while (1)
+    {
+        /* Signals interrupt the wait, so this comes next */
+        check_signals();
+        if (drain_requested && !fd_info.draining)
+            stop_listening(&fd_info);
+        /* UDP flows only go once their timeout expires: replies keep
+         * coming back to their sources until then */
+        if (fd_info.draining && fd_info.collection.num_free == fd_info.collection.num &&
+            !udp_flows)
+            break;
+        print_verbose(1, "waiting... num_probing=%d\n", fd_info.timeouts.count);
+        n = watchers_wait(fd_info.watchers, events, timeout);
+        if (n < 0 && errno != EINTR)
+            perror("watchers_wait");
+        pthread_rwlock_rdlock(&config_lock);
+
+        num_listen_ready = 0;
+        for (i = 0; i < n; i++) {
+            if (!events[i].data) {
+                listen_ready[num_listen_ready++] = i;
+                continue;
+            }
+
+            cnx = events[i].data;
+            /* UDP flows are only freed by udp_reap_timeouts() */
+            if (cnx->state == ST_UDP) {
+                udp_intern_forward(cnx);
+                continue;
+            }
+
+            /* Data the backend read already comes first */
+            if (events[i].buf) {
+                if (cnx->q[0].fd == events[i].fd)
+                    cnx_recv_process(cnx, events[i].buf, events[i].buf_len, &fd_info);
+                if (!events[i].readable)
+                    continue;
+            }
+
+            /* Targets being connected are only watched for writing */
+            if (cnx->state == ST_CONNECTING) {
+                if (events[i].writable)
+                    connect_progress(cnx, connect_ready(cnx, events[i].fd,
+                                                        connect_watch, &fd_info),
+                                     &fd_info);
+                continue;
+            }
+
+            /* The connection may have been closed (and its file descriptors
+             * reused) by an earlier event of this batch */
+            if (cnx->q[0].fd == events[i].fd) j = 0;
+            else if (cnx->q[1].fd == events[i].fd) j = 1;
+            else continue;
+
+            if (events[i].writable)
+                cnx_write_process(cnx, j, &fd_info);
+
+            if (events[i].readable && (cnx->q[j].fd == events[i].fd))
+                cnx_read_process(cnx, j, &fd_info);
+        }
+
+        /* Accept new connections last, so slots freed during this batch
+         * cannot get reused while events still point to them */
+        for (i = 0; i < num_listen_ready; i++) {
+            j = listen_ready[i];
+            if (events[j].accepted != -1)
+                accepted_process(events[j].fd, events[j].accepted, &fd_info);
+            else
+                listen_process(events[j].fd, &fd_info);
+        }
+
+        timers_expire(&fd_info.timeouts, cnx_timeout, &fd_info);
+        compact_collection(&fd_info.collection);
+
+        /* Wait until the next probe timeout or UDP flow expiry */
+        timeout = timers_next(&fd_info.timeouts);
+        udp_flows = 0;
+        for (i = 0; i < num_addr_listen; i++) {
+            if (!fd_info.udp_listeners[i]) continue;
+            udp_flush_replies(fd_info.udp_listeners[i]);
+            udp_timeout = udp_reap_timeouts(fd_info.udp_listeners[i]);
+            if (udp_timeout != -1)
+                udp_flows = 1;
+            if (udp_timeout != -1 && (timeout == -1 || udp_timeout < timeout))
+                timeout = udp_timeout;
+        }
+        pthread_rwlock_unlock(&config_lock);
+    }
+
+    pthread_mutex_lock(&signal_mutex);
+    for (l = &loops; *l != &fd_info; l = &(*l)->next_loop)
+        ;
+    *l = fd_info.next_loop;
+    pthread_mutex_unlock(&signal_mutex);
+    print_verbose(1, "all connections closed\n");
+}
@@ -0,0 +1,14 @@
+/* API for processes.c: event loop used by sslh-select and sslh-threads */
+
+#ifndef PROCESSES_H
+#define PROCESSES_H
+
+#include "common.h"
+
+/* Accepts connections on the specified listening sockets, probes them and
+ * shovels data to their targets. Never returns.
+ * All the state lives on the stack of the caller, so several event loops can
+ * run in parallel threads as long as each has its own listening sockets. */
+void event_loop(struct listen_endpoint listen_sockets[], int num_addr_listen);
+
+#endif
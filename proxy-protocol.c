@@ -0,0 +1,283 @@
+/*
+# proxy-protocol.c: PROXY protocol headers, v1 and v2
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include "probe.h"
+#include "proxy-protocol.h"
+
+/* v1 is a line of text, CRLF included */
+#define V1_MAX      107
+static const char v1_sig[6] = "PROXY ";
+
+/* v2 is binary: signature, version and command, family, length of the
+ * addresses (big endian), addresses */
+#define V2_HEADER   16
+static const char v2_sig[12] = "\r\n\r\n\0\r\nQUIT\n";
+
+#define V2_LOCAL    0x20
+#define V2_PROXY    0x21
+#define V2_UNSPEC   0x00
+#define V2_TCP4     0x11
+#define V2_UDP4     0x12
+#define V2_TCP6     0x21
+#define V2_UDP6     0x22
+
+static void set_addr(struct sockaddr_storage* ss, socklen_t* len, int family,
+                     const void* addr, uint16_t port)
+{
+    memset(ss, 0, sizeof(*ss));
+    if (family == AF_INET) {
+        struct sockaddr_in* sin = (struct sockaddr_in*)ss;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, addr, 4);
+        sin->sin_port = port;
+        *len = sizeof(*sin);
+    } else {
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)ss;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, addr, 16);
+        sin6->sin6_port = port;
+        *len = sizeof(*sin6);
+    }
+}
+
+/* Returns 0 and the port in network order, or -1 if str is not a port */
+static int parse_port(const char* str, uint16_t* port)
+{
+    char* end;
+    long n;
+
+    n = strtol(str, &end, 10);
+    if (!*str || *end || n < 0 || n > 65535)
+        return -1;
+    *port = htons(n);
+    return 0;
+}
+
+/* Both return the length of the header (which is longer than any PROBE_*
+ * code), or PROBE_AGAIN, or PROBE_NEXT */
+static int parse_v1(struct connection* cnx, const char* data, int size)
+{
+    char line[V1_MAX], *fields[6], *save;
+    unsigned char src[16], dst[16];
+    uint16_t sport, dport;
+    const char* end;
+    int i, family, len;
+
+    end = memchr(data, '\n', size < V1_MAX ? size : V1_MAX);
+    if (!end)
+        return size < V1_MAX ? PROBE_AGAIN : PROBE_NEXT;
+    len = end - data + 1;
+    if (len < 2 || end[-1] != '\r')
+        return PROBE_NEXT;
+
+    memcpy(line, data, len - 2);
+    line[len - 2] = 0;
+    fields[0] = strtok_r(line, " ", &save);
+    for (i = 1; i < 6; i++)
+        fields[i] = strtok_r(NULL, " ", &save);
+
+    if (fields[1] && !strcmp(fields[1], "UNKNOWN")) /* the rest is ignored */
+        return len;
+
+    if (!fields[5] || strtok_r(NULL, " ", &save))
+        return PROBE_NEXT;
+    if (!strcmp(fields[1], "TCP4"))
+        family = AF_INET;
+    else if (!strcmp(fields[1], "TCP6"))
+        family = AF_INET6;
+    else
+        return PROBE_NEXT;
+    if (inet_pton(family, fields[2], src) != 1 || inet_pton(family, fields[3], dst) != 1 ||
+        parse_port(fields[4], &sport) || parse_port(fields[5], &dport))
+        return PROBE_NEXT;
+
+    set_addr(&cnx->peer, &cnx->peer_len, family, src, sport);
+    set_addr(&cnx->setup->local, &cnx->setup->local_len, family, dst, dport);
+    return len;
+}
+
+static int parse_v2(struct connection* cnx, const unsigned char* data, int size)
+{
+    uint16_t sport, dport;
+    int len, family, addr_len;
+
+    if (size < V2_HEADER)
+        return PROBE_AGAIN;
+    len = V2_HEADER + (data[14] << 8 | data[15]);
+    if (size < len)
+        return PROBE_AGAIN;
+
+    if (data[12] == V2_LOCAL)           /* e.g. health checks */
+        return len;
+    if (data[12] != V2_PROXY)
+        return PROBE_NEXT;
+
+    switch (data[13]) {
+    case V2_TCP4: case V2_UDP4:
+        family = AF_INET;
+        addr_len = 4;
+        break;
+    case V2_TCP6: case V2_UDP6:
+        family = AF_INET6;
+        addr_len = 16;
+        break;
+    default:    /* unspecified, UNIX sockets: keep the addresses we have */
+        return len;
+    }
+    if (len < V2_HEADER + 2 * addr_len + 4)
+        return PROBE_NEXT;
+
+    data += V2_HEADER;
+    memcpy(&sport, data + 2 * addr_len, 2);
+    memcpy(&dport, data + 2 * addr_len + 2, 2);
+    set_addr(&cnx->peer, &cnx->peer_len, family, data, sport);
+    set_addr(&cnx->setup->local, &cnx->setup->local_len, family, data + addr_len, dport);
+    return len;
+}
+
+int proxy_header_parse(struct connection* cnx)
+{
+    const char* data;
+    int size, res, n;
+
+    data = get_deferred_data(&cnx->q[1], &size);
+    if (!size)
+        return PROBE_AGAIN;
+
+    /* Whatever comes first can only be one of the two */
+    n = size < sizeof(v2_sig) ? size : sizeof(v2_sig);
+    if (!memcmp(data, v2_sig, n)) {
+        res = parse_v2(cnx, (const unsigned char*)data, size);
+    } else {
+        n = size < sizeof(v1_sig) ? size : sizeof(v1_sig);
+        if (memcmp(data, v1_sig, n))
+            return PROBE_NEXT;
+        res = size < sizeof(v1_sig) ? PROBE_AGAIN : parse_v1(cnx, data, size);
+    }
+    if (res == PROBE_AGAIN || res == PROBE_NEXT)
+        return res;
+
+    ring_consume(cnx->q[1].deferred_data, res);
+    cnx->proxy_header = 0;
+    return PROBE_MATCH;
+}
+
+
+/* Fills hdr (PROXY_HEADER_MAX bytes) with the header for addresses src and
+ * dst, or for unknown addresses if they are not both IPv4 or both IPv6.
+ * Returns its length, which is PROXY_HEADER_MAX or more if it didn't fit. */
+static int build_header(char* hdr, int version,
+                        const struct sockaddr_storage* src, const struct sockaddr_storage* dst)
+{
+    const struct sockaddr_in *s4 = (const void*)src, *d4 = (const void*)dst;
+    const struct sockaddr_in6 *s6 = (const void*)src, *d6 = (const void*)dst;
+    char src_str[INET6_ADDRSTRLEN], dst_str[INET6_ADDRSTRLEN];
+    unsigned char* p = (unsigned char*)hdr;
+    int family = src->ss_family;
+
+    if (family != dst->ss_family || (family != AF_INET && family != AF_INET6))
+        family = AF_UNSPEC;
+
+    if (version == 1) {
+        if (family == AF_UNSPEC)
+            return snprintf(hdr, PROXY_HEADER_MAX, "PROXY UNKNOWN\r\n");
+        if (family == AF_INET) {
+            inet_ntop(family, &s4->sin_addr, src_str, sizeof(src_str));
+            inet_ntop(family, &d4->sin_addr, dst_str, sizeof(dst_str));
+            return snprintf(hdr, PROXY_HEADER_MAX, "PROXY TCP4 %s %s %d %d\r\n",
+                            src_str, dst_str, ntohs(s4->sin_port), ntohs(d4->sin_port));
+        }
+        inet_ntop(family, &s6->sin6_addr, src_str, sizeof(src_str));
+        inet_ntop(family, &d6->sin6_addr, dst_str, sizeof(dst_str));
+        return snprintf(hdr, PROXY_HEADER_MAX, "PROXY TCP6 %s %s %d %d\r\n",
+                        src_str, dst_str, ntohs(s6->sin6_port), ntohs(d6->sin6_port));
+    }
+
+    memcpy(p, v2_sig, sizeof(v2_sig));
+    p[12] = V2_PROXY;
+    switch (family) {
+    case AF_INET:
+        p[13] = V2_TCP4;
+        p[14] = 0; p[15] = 12;
+        memcpy(p + 16, &s4->sin_addr, 4);
+        memcpy(p + 20, &d4->sin_addr, 4);
+        memcpy(p + 24, &s4->sin_port, 2);
+        memcpy(p + 26, &d4->sin_port, 2);
+        return V2_HEADER + 12;
+    case AF_INET6:
+        p[13] = V2_TCP6;
+        p[14] = 0; p[15] = 36;
+        memcpy(p + 16, &s6->sin6_addr, 16);
+        memcpy(p + 32, &d6->sin6_addr, 16);
+        memcpy(p + 48, &s6->sin6_port, 2);
+        memcpy(p + 50, &d6->sin6_port, 2);
+        return V2_HEADER + 36;
+    default:
+        p[13] = V2_UNSPEC;
+        p[14] = 0; p[15] = 0;
+        return V2_HEADER;
+    }
+}
+
+int proxy_header_add(struct connection* cnx)
+{
+    struct sockaddr_storage src, dst;
+    socklen_t len;
+    struct queue* q = &cnx->q[1];
+    struct iovec iov[2];
+    struct ring* r;
+    char hdr[PROXY_HEADER_MAX];
+    int i, n, hdr_len;
+
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    len = sizeof(src);
+    if (cnx->peer_len)
+        memcpy(&src, &cnx->peer, cnx->peer_len);
+    else if (getpeername(cnx->q[0].fd, (struct sockaddr*)&src, &len) == -1)
+        src.ss_family = AF_UNSPEC;
+    len = sizeof(dst);
+    if (cnx->setup->local_len)
+        memcpy(&dst, &cnx->setup->local, cnx->setup->local_len);
+    else if (getsockname(cnx->q[0].fd, (struct sockaddr*)&dst, &len) == -1)
+        dst.ss_family = AF_UNSPEC;
+
+    hdr_len = build_header(hdr, cnx->proto->proxy_protocol, &src, &dst);
+    if (hdr_len < 0 || hdr_len >= PROXY_HEADER_MAX) {
+        log_message(LOG_ERR, "PROXY header too long on fd %d\n", cnx->q[0].fd);
+        return -1;
+    }
+
+    /* Ring buffers only append: copy what's deferred after the header */
+    r = ring_new();
+    n = q->deferred_data ? ring_iov(q->deferred_data, iov) : 0;
+    if (hdr_len + (q->deferred_data ? ring_len(q->deferred_data) : 0) > ring_capacity()) {
+        log_message(LOG_ERR, "no room for the PROXY header on fd %d\n", cnx->q[0].fd);
+        ring_free(r);
+        return -1;
+    }
+    ring_write(r, hdr, hdr_len);
+    for (i = 0; i < n; i++)
+        ring_write(r, iov[i].iov_base, iov[i].iov_len);
+    release_deferred_data(q);
+    q->deferred_data = r;
+    return 0;
+}
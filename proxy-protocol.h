@@ -0,0 +1,32 @@
+/* API for proxy-protocol.c: PROXY protocol headers, v1 and v2
+ *
+ * Instead of transparent proxying, which needs privileges and routing rules,
+ * the address of the client can be given to the target in a header sent
+ * before the data (see
+ * https://www.haproxy.org/download/2.4/doc/proxy-protocol.txt). The same
+ * header, sent by a load balancer in front of sslh, tells sslh who the client
+ * is.
+ */
+
+#ifndef PROXY_PROTOCOL_H
+#define PROXY_PROTOCOL_H
+
+struct connection;
+
+/* Longest header: v1 with IPv6 addresses. Probing leaves that much room in the
+ * data deferred for the target, so a header fits in front. */
+#define PROXY_HEADER_MAX    108
+
+/* Parses the header the client must send first, from the data deferred for
+ * the target, and takes it out of there. cnx->peer and cnx->setup->local become
+ * the addresses it gives, if it gives some.
+ * Returns PROBE_MATCH once it's done, PROBE_AGAIN if the header is not all
+ * there yet, PROBE_NEXT if it's not a PROXY header. */
+int proxy_header_parse(struct connection* cnx);
+
+/* Puts a header of version cnx->proto->proxy_protocol in front of the data
+ * deferred for the target, so both go in the first write (or in the SYN, with
+ * TCP Fast Open). Returns 0, or -1 if it doesn't fit. */
+int proxy_header_add(struct connection* cnx);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+# regex-probe.c: regex probes
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <ctype.h>
+#ifdef ENABLE_REGEX
+#ifdef LIBPCRE
+#include <pcreposix.h>
+#else
+#include <regex.h>
+#endif
+#endif
+
+#include "regex-probe.h"
+
+#ifdef ENABLE_REGEX
+
+/* Returns NULL if the pattern is invalid. We only want to know whether it
+ * matches, not where: REG_NOSUB spares the engine tracking sub-matches. */
+static regex_t* compile_pattern(const char* pattern)
+{
+    regex_t* re;
+    size_t errsize;
+    char* err;
+    int res;
+
+    re = malloc(sizeof(*re));
+    CHECK_ALLOC(re, "malloc");
+    res = regcomp(re, pattern, REG_EXTENDED | REG_NOSUB);
+    if (res) {
+        err = malloc(errsize = regerror(res, re, NULL, 0));
+        CHECK_ALLOC(err, "malloc");
+        regerror(res, re, err, errsize);
+        fprintf(stderr, "%s:%s\n", pattern, err);
+        free(err);
+        free(re);
+        return NULL;
+    }
+    return re;
+}
+
+/* Groups are numbered over the whole expression, so a pattern that refers to
+ * one (back-references, libpcre's subroutine calls) must stay on its own */
+static int refers_to_groups(const char* pattern)
+{
+    const char* s;
+
+    for (s = pattern; *s; s++) {
+        if (s[0] == '\\' && s[1]) {
+            if (isdigit((unsigned char)s[1]) || s[1] == 'g' || s[1] == 'k')
+                return 1;
+            s++;
+        } else if (s[0] == '(' && s[1] == '?' && s[2] &&
+                   (isdigit((unsigned char)s[2]) || strchr("+-RP&", s[2]))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns the patterns of p as one expression, "(p1)|(p2)|...", or NULL if
+ * they can't be put together. If they all start with ^, so does the
+ * expression, "^((p1)|(p2)|...)": the regex library then only tries to match
+ * at the start rather than at every byte. */
+static regex_t* compile_alternation(struct sslhcfg_protocols_item* p)
+{
+    size_t size = 3;
+    regex_t* re;
+    char* all;
+    int j, anchored = 1;
+
+    for (j = 0; j < p->regex_patterns_len; j++) {
+        if (refers_to_groups(p->regex_patterns[j]))
+            return NULL;
+        if (p->regex_patterns[j][0] != '^')
+            anchored = 0;
+        size += strlen(p->regex_patterns[j]) + 3;
+    }
+
+    all = malloc(size);
+    CHECK_ALLOC(all, "malloc");
+    strcpy(all, anchored ? "^(" : "");
+    for (j = 0; j < p->regex_patterns_len; j++) {
+        if (j) strcat(all, "|");
+        strcat(all, "(");
+        strcat(all, p->regex_patterns[j] + anchored);
+        strcat(all, ")");
+    }
+    if (anchored)
+        strcat(all, ")");
+
+    re = malloc(sizeof(*re));
+    CHECK_ALLOC(re, "malloc");
+    if (regcomp(re, all, REG_EXTENDED | REG_NOSUB)) {
+        free(re);
+        re = NULL;
+    }
+    free(all);
+    return re;
+}
+
+/* p->data of regex protocols is a NULL-terminated array of expressions: all
+ * the patterns in one where possible, so a buffer is searched once per
+ * protocol rather than once per pattern */
+int regex_compile(struct sslhcfg_protocols_item* p)
+{
+    regex_t** patterns;
+    regex_t* all;
+    int j;
+
+    patterns = calloc(p->regex_patterns_len + 1, sizeof(*patterns));
+    CHECK_ALLOC(patterns, "calloc");
+    p->data = patterns;
+
+    /* Each on its own first, for errors to say which one is wrong */
+    for (j = 0; j < p->regex_patterns_len; j++) {
+        patterns[j] = compile_pattern(p->regex_patterns[j]);
+        if (!patterns[j])
+            return 1;
+    }
+
+    if (p->regex_patterns_len < 2 || !(all = compile_alternation(p)))
+        return 0;
+
+    for (j = 0; j < p->regex_patterns_len; j++) {
+        regfree(patterns[j]);
+        free(patterns[j]);
+        patterns[j] = NULL;
+    }
+    patterns[0] = all;
+    return 0;
+}
+
+void regex_free(struct sslhcfg_protocols_item* p)
+{
+    regex_t** re = p->data;
+
+    for (; re && *re; re++) {
+        regfree(*re);
+        free(*re);
+    }
+    free(p->data);
+    p->data = NULL;
+}
+
+int regex_probe(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
+{
+    regex_t** re = proto->data;
+    regmatch_t pos = { 0, len };
+
+    for (; *re && regexec(*re, p, 0, &pos, REG_STARTEND); re++)
+        /* try them all */;
+
+    return (*re != NULL);
+}
+
+#else /* ENABLE_REGEX */
+
+int regex_compile(struct sslhcfg_protocols_item* p)
+{
+    fprintf(stderr, "regex probes are not built in\n");
+    return 5;
+}
+
+void regex_free(struct sslhcfg_protocols_item* p)
+{
+}
+
+int regex_probe(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state)
+{
+    /* Should never happen as we check when loading config file */
+    fprintf(stderr, "FATAL: regex probe called but not built in\n");
+    exit(5);
+}
+
+#endif /* ENABLE_REGEX */
@@ -0,0 +1,22 @@
+/* API for regex-probe.c: regex probes, with POSIX regex or libpcre's POSIX
+ * API (USELIBPCRE) */
+
+#ifndef REGEX_PROBE_H
+#define REGEX_PROBE_H
+
+#include "common.h"
+#include "probe.h"
+
+/* Compiles the patterns of regex protocol p into p->data, as one
+ * alternation unless a pattern refers to groups. Returns 0, or the
+ * status sslh exits with if a pattern is invalid (1) or regex probes are not
+ * built in (5). */
+int regex_compile(struct sslhcfg_protocols_item* p);
+
+/* Frees what regex_compile() put in p->data, even if it failed */
+void regex_free(struct sslhcfg_protocols_item* p);
+
+/* The probe for regex protocols */
+int regex_probe(const char *p, ssize_t len, struct sslhcfg_protocols_item* proto, struct probe_state* state);
+
+#endif
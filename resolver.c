@@ -0,0 +1,226 @@
+/*
+# resolver.c: background resolution of target names
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <pthread.h>
+#include <poll.h>
+
+#include "common.h"
+#include "sslh-conf.h"
+#include "backends.h"
+#include "resolver.h"
+
+/* Protects the addrs pointers of targets and the reference counts */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The resolver may hold the lock while another thread forks: take it around
+ * fork() so the child doesn't inherit it locked */
+static void lock_fork(void) { pthread_mutex_lock(&lock); }
+static void unlock_fork(void) { pthread_mutex_unlock(&lock); }
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+static void setup_atfork(void)
+{
+    pthread_atfork(lock_fork, unlock_fork, unlock_fork);
+}
+
+struct addr_list* addr_list_new(struct addrinfo* ai)
+{
+    struct addr_list* l = malloc(sizeof(*l));
+    CHECK_ALLOC(l, "malloc");
+
+    l->refcnt = 1;
+    l->ai = ai;
+    return l;
+}
+
+struct addr_list* addr_list_get(struct backend* b)
+{
+    struct addr_list* l;
+
+    pthread_mutex_lock(&lock);
+    l = b->addrs;
+    l->refcnt++;
+    pthread_mutex_unlock(&lock);
+    return l;
+}
+
+void addr_list_put(struct addr_list* l)
+{
+    int last;
+
+    if (!l)
+        return;
+
+    pthread_mutex_lock(&lock);
+    last = !--l->refcnt;
+    pthread_mutex_unlock(&lock);
+
+    if (last) {
+        freeaddrinfo(l->ai);
+        free(l);
+    }
+}
+
+/* Returns 1 if both lists hold the same addresses in the same order */
+static int same_addresses(struct addrinfo* a, struct addrinfo* b)
+{
+    for (; a && b; a = a->ai_next, b = b->ai_next) {
+        if (a->ai_addrlen != b->ai_addrlen ||
+            memcmp(a->ai_addr, b->ai_addr, a->ai_addrlen))
+            return 0;
+    }
+    return !a && !b;
+}
+
+static int is_numeric(const char* host)
+{
+    struct addrinfo hint = { .ai_flags = AI_NUMERICHOST }, *res;
+
+    if (getaddrinfo(host, NULL, &hint, &res))
+        return 0;
+    freeaddrinfo(res);
+    return 1;
+}
+
+static int needs_resolving(struct sslhcfg_protocols_item* p)
+{
+    return p->resolve_interval > 0;
+}
+
+static void resolve_backend(struct sslhcfg_protocols_item* p, struct backend* b)
+{
+    struct addr_list *old, *new;
+    struct addrinfo* ai;
+
+    if (resolve_split_name(&ai, b->host, b->port)) {
+        log_message(LOG_WARNING, "%s: cannot resolve %s:%s, keeping previous addresses\n",
+                    p->name, b->host, b->port);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    old = b->addrs;
+    if (same_addresses(old->ai, ai)) {
+        pthread_mutex_unlock(&lock);
+        freeaddrinfo(ai);
+        return;
+    }
+    new = addr_list_new(ai);
+    b->addrs = new;
+    pthread_mutex_unlock(&lock);
+
+    print_verbose(1, "%s: %s:%s resolved to new addresses\n", p->name, b->host, b->port);
+    addr_list_put(old);
+}
+
+/* A resolver thread works on the protocols of one configuration: after a
+ * reload, it leaves the next time it wakes up, and another thread takes the
+ * new protocols over */
+struct resolver_job {
+    struct sslhcfg_protocols_item* protocols;
+    int num;
+    int generation;     /* config_generation of the protocols */
+    struct config_ref* config;  /* holds them */
+};
+
+static void* resolver_main(void* arg)
+{
+    struct resolver_job* job = arg;
+    struct sslhcfg_protocols_item* p;
+    struct backend* b;
+    uint64_t now, next;
+    int i, j;
+
+    while (__atomic_load_n(&config_generation, __ATOMIC_ACQUIRE) == job->generation) {
+        now = monotonic_ms();
+        next = UINT64_MAX;
+        for (i = 0; i < job->num; i++) {
+            p = &job->protocols[i];
+            if (!needs_resolving(p)) continue;
+
+            for (j = 0; j < p->pool->num; j++) {
+                b = &p->pool->backend[j];
+                if (b->numeric) continue;
+                if (b->next_resolve <= now) {
+                    resolve_backend(p, b);
+                    b->next_resolve = monotonic_ms() + p->resolve_interval * 1000;
+                }
+                if (b->next_resolve < next)
+                    next = b->next_resolve;
+            }
+        }
+        now = monotonic_ms();
+        if (next > now)
+            poll(NULL, 0, next - now);
+    }
+    config_put(job->config);
+    free(job);
+    return NULL;
+}
+
+void start_resolver(void)
+{
+    struct sslhcfg_protocols_item* p;
+    struct resolver_job* job;
+    struct backend* b;
+    pthread_t thread;
+    sigset_t all, old;
+    uint64_t now = monotonic_ms();
+    int i, j, res, any = 0;
+
+    pthread_once(&atfork_once, setup_atfork);
+
+    for (i = 0; i < cfg.protocols_len; i++) {
+        p = &cfg.protocols[i];
+        if (!needs_resolving(p)) continue;
+
+        for (j = 0; j < p->pool->num; j++) {
+            b = &p->pool->backend[j];
+            b->numeric = is_numeric(b->host);
+            b->next_resolve = now + p->resolve_interval * 1000;
+            if (!b->numeric)
+                any = 1;
+        }
+    }
+    if (!any)
+        return;
+
+    job = malloc(sizeof(*job));
+    CHECK_ALLOC(job, "malloc");
+    job->protocols = cfg.protocols;
+    job->num = cfg.protocols_len;
+    job->generation = config_generation;
+    job->config = config_get();
+
+    /* Signals are for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    res = pthread_create(&thread, NULL, resolver_main, job);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res) {
+        log_message(LOG_ERR, "pthread_create: %s -- targets will not be resolved again\n",
+                    strerror(res));
+        config_put(job->config);
+        free(job);
+        return;
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,42 @@
+/* API for resolver.c: refreshes the addresses of targets
+ *
+ * Each target keeps its addresses in a reference-counted addr_list. A
+ * connection takes a reference on the list when it starts connecting, so it
+ * keeps trying the same addresses even if the target is resolved again in
+ * the meantime.
+ *
+ * Targets of protocols with resolve_interval set are resolved again every
+ * that many seconds by a thread (getaddrinfo() blocks), which swaps the new
+ * list in if the addresses changed. Targets given as numeric addresses never
+ * are.
+ */
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "common.h"
+
+struct backend;
+
+struct addr_list {
+    int refcnt;
+    struct addrinfo* ai;
+};
+
+/* Wraps ai, with one reference */
+struct addr_list* addr_list_new(struct addrinfo* ai);
+
+/* Returns the current addresses of b, with a reference taken */
+struct addr_list* addr_list_get(struct backend* b);
+
+/* Drops a reference, freeing the list with the last. NULL is ignored. */
+void addr_list_put(struct addr_list* l);
+
+/* Starts the resolver thread of this process, if any target needs it. Threads
+ * do not survive fork(), so processes that live long after forking and
+ * connect to targets, or fork processes that do, start their own (in
+ * sslh-fork: listeners and prefork workers). After a reload, call again: the
+ * thread of the previous configuration leaves by itself. */
+void start_resolver(void);
+
+#endif
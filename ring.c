@@ -0,0 +1,234 @@
+/*
+# ring.c: pooled fixed-size ring buffers for deferred data
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <sys/mman.h>
+#include "common.h"
+#include "probe.h"
+#include "ring.h"
+
+struct ring {
+    struct ring* next_free;     /* free list link when in the pool */
+    size_t start;               /* offset of the first byte of data */
+    size_t len;                 /* number of bytes of data */
+    char data[];                /* ring_capacity() bytes */
+};
+
+/* Size of the slabs the pool allocates buffers from */
+#define SLAB_SIZE (256 * 1024)
+
+/* Free buffers kept ready for use; the pages of the others are given back to
+ * the system (see ring_free()) */
+#define SPARE_RINGS 64
+
+/* Each thread has its own pool, so the event loops of sslh-threads never
+ * contend on it. Buffers whose pages were given back are on cold_rings, and
+ * only get used once free_rings is empty. */
+static __thread struct ring* free_rings;
+static __thread struct ring* cold_rings;
+static __thread int num_free_rings;
+
+/* Distance between buffers in a slab */
+static size_t ring_stride(void)
+{
+    size_t stride;
+
+    /* Keep each buffer aligned like the struct */
+    stride = sizeof(struct ring) + ring_capacity();
+    return (stride + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+size_t ring_capacity(void)
+{
+    /* The client's first packet must fit for probing to work */
+    if (cfg.deferred_highwater < BUFSIZ)
+        return BUFSIZ;
+    return cfg.deferred_highwater;
+}
+
+/* Allocates a new slab and adds all its buffers to the pool */
+static void grow_pool(void)
+{
+    size_t stride = ring_stride(), num, i;
+    char* slab;
+    struct ring* r;
+
+    num = SLAB_SIZE / stride;
+    if (!num) num = 1;
+
+    slab = malloc(num * stride);
+    CHECK_ALLOC(slab, "malloc");
+
+    /* The pages are only touched once a buffer gets used */
+    for (i = 0; i < num; i++) {
+        r = (struct ring*)(slab + i * stride);
+        r->next_free = cold_rings;
+        cold_rings = r;
+    }
+}
+
+struct ring* ring_new(void)
+{
+    struct ring* r;
+
+    if (free_rings) {
+        r = free_rings;
+        free_rings = r->next_free;
+        num_free_rings--;
+    } else {
+        if (!cold_rings)
+            grow_pool();
+        r = cold_rings;
+        cold_rings = r->next_free;
+    }
+
+    r->next_free = NULL;
+    r->start = 0;
+    r->len = 0;
+    metrics_memory(MEM_BUFFERS, ring_stride());
+    return r;
+}
+
+void ring_free(struct ring* r)
+{
+    uintptr_t page = getpagesize(), start, end;
+
+    metrics_memory(MEM_BUFFERS, -(long)ring_stride());
+    if (num_free_rings < SPARE_RINGS) {
+        r->next_free = free_rings;
+        free_rings = r;
+        num_free_rings++;
+        return;
+    }
+
+    /* Give back the pages that only hold data. The data doesn't matter, and
+     * anonymous pages come back zeroed when touched again. */
+    start = ((uintptr_t)r->data + page - 1) & ~(page - 1);
+    end = ((uintptr_t)r->data + ring_capacity()) & ~(page - 1);
+    if (end > start)
+        madvise((void*)start, end - start, MADV_DONTNEED);
+    r->next_free = cold_rings;
+    cold_rings = r;
+}
+
+size_t ring_len(const struct ring* r)
+{
+    return r->len;
+}
+
+size_t ring_space(const struct ring* r)
+{
+    return ring_capacity() - r->len;
+}
+
+size_t ring_write(struct ring* r, const void* data, size_t len)
+{
+    size_t cap = ring_capacity();
+    size_t end, n;
+
+    if (len > cap - r->len)
+        len = cap - r->len;
+
+    end = (r->start + r->len) % cap;
+    n = cap - end;
+    if (n > len) n = len;
+    memcpy(r->data + end, data, n);
+    memcpy(r->data, (const char*)data + n, len - n);
+
+    r->len += len;
+    return len;
+}
+
+int ring_iov(const struct ring* r, struct iovec iov[2])
+{
+    size_t cap = ring_capacity();
+
+    if (!r->len)
+        return 0;
+
+    iov[0].iov_base = (char*)r->data + r->start;
+    if (r->start + r->len <= cap) {
+        iov[0].iov_len = r->len;
+        return 1;
+    }
+    iov[0].iov_len = cap - r->start;
+    iov[1].iov_base = (char*)r->data;
+    iov[1].iov_len = r->len - iov[0].iov_len;
+    return 2;
+}
+
+int ring_space_iov(const struct ring* r, struct iovec iov[2], size_t max)
+{
+    size_t cap = ring_capacity();
+    size_t end, space = cap - r->len;
+
+    if (space > max)
+        space = max;
+    if (!space)
+        return 0;
+
+    end = (r->start + r->len) % cap;
+    iov[0].iov_base = (char*)r->data + end;
+    if (end + space <= cap) {
+        iov[0].iov_len = space;
+        return 1;
+    }
+    iov[0].iov_len = cap - end;
+    iov[1].iov_base = (char*)r->data;
+    iov[1].iov_len = space - iov[0].iov_len;
+    return 2;
+}
+
+void ring_commit(struct ring* r, size_t len)
+{
+    r->len += len;
+}
+
+void ring_consume(struct ring* r, size_t len)
+{
+    if (len > r->len)
+        len = r->len;
+    r->len -= len;
+    r->start = r->len ? (r->start + len) % ring_capacity() : 0;
+}
+
+void* ring_linearize(struct ring* r)
+{
+    size_t cap = ring_capacity();
+    size_t head;
+    char* tmp;
+
+    if (r->start + r->len <= cap)
+        return r->data + r->start;
+
+    /* Data wraps around: this only happens if probing data gets written out
+     * while it is still being probed, so it's rare enough that a temporary
+     * copy will do */
+    head = cap - r->start;
+    tmp = malloc(r->len);
+    CHECK_ALLOC(tmp, "malloc");
+    memcpy(tmp, r->data + r->start, head);
+    memcpy(tmp + head, r->data, r->len - head);
+    memcpy(r->data, tmp, r->len);
+    free(tmp);
+    r->start = 0;
+
+    return r->data;
+}
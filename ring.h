@@ -0,0 +1,51 @@
+/* API for ring.c: fixed-size ring buffers that hold deferred data
+ *
+ * All ring buffers have the same capacity, set by the `deferred_highwater`
+ * setting, which a reload leaves as it was. They come from a pool private to each thread, which grows by slabs
+ * of several buffers, so a stalled connection costs no allocation once the
+ * pool has warmed up. Connections only hold a buffer while data is waiting,
+ * and beyond a few spare ones, free buffers give their pages back to the
+ * system until they get used again.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ring;
+
+/* Capacity of every ring buffer, in bytes */
+size_t ring_capacity(void);
+
+/* Gets an empty ring buffer from the pool. Dies if out of memory. */
+struct ring* ring_new(void);
+
+/* Returns a ring buffer to the pool */
+void ring_free(struct ring* r);
+
+/* Number of bytes stored, and number of bytes that can still be stored */
+size_t ring_len(const struct ring* r);
+size_t ring_space(const struct ring* r);
+
+/* Appends up to `len` bytes; returns the number of bytes stored */
+size_t ring_write(struct ring* r, const void* data, size_t len);
+
+/* Fills `iov` with the (at most 2) contiguous regions holding the data, in
+ * order. Returns the number of iovec used. */
+int ring_iov(const struct ring* r, struct iovec iov[2]);
+
+/* Fills `iov` with the (at most 2) free regions, in order, up to `max` bytes,
+ * so data can be read straight into the buffer; ring_commit() then adds the
+ * `len` bytes that were. Returns the number of iovec used. */
+int ring_space_iov(const struct ring* r, struct iovec iov[2], size_t max);
+void ring_commit(struct ring* r, size_t len);
+
+/* Drops `len` bytes from the beginning */
+void ring_consume(struct ring* r, size_t len);
+
+/* Makes the data contiguous and returns a pointer to it */
+void* ring_linearize(struct ring* r);
+
+#endif
@@ -410,6 +410,21 @@ struct arg_file* sslhcfg_conffile;
  struct arg_str* sslhcfg_syslog_facility;
  struct arg_str* sslhcfg_on_timeout;
  struct arg_str* sslhcfg_prefix;
+ struct arg_int* sslhcfg_threads;
+ struct arg_lit* sslhcfg_cpu_affinity;
+ struct arg_int* sslhcfg_deferred_highwater;
+ struct arg_lit* sslhcfg_udp_gro;
+ struct arg_int* sslhcfg_prefork;
+ struct arg_int* sslhcfg_prefork_max_spare;
+ struct arg_int* sslhcfg_prefork_max_processes;
+ struct arg_int* sslhcfg_prefork_max_connections;
+ struct arg_str* sslhcfg_metrics;
+ struct arg_int* sslhcfg_accept_batch;
+ struct arg_int* sslhcfg_rate_limit;
+ struct arg_int* sslhcfg_rate_burst;
+ struct arg_int* sslhcfg_rate_prefix4;
+ struct arg_int* sslhcfg_rate_prefix6;
+ struct arg_int* sslhcfg_max_probing;
  	struct arg_str* sslhcfg_listen;
  	struct arg_str* sslhcfg_ssh;
  	struct arg_str* sslhcfg_tls;
@@ -649,6 +664,150 @@ static struct config_desc table_sslhcfg_protocols[] = {
             /* optional */      1, 
             /* default_val*/    .default_val.def_int = 0 
         },
+
+        { 
+            /* name */          "splice", 
+            /* type */          CFG_BOOL, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_protocols_item, splice),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_bool = 0 
+        },
+
+        { 
+            /* name */          "connect_timeout", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_protocols_item, connect_timeout),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 5 
+        },
+
+        { 
+            /* name */          "balance", 
+            /* type */          CFG_STRING, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_protocols_item, balance),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(char*), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_string = "roundrobin" 
+        },
+
+        { 
+            /* name */          "fail_timeout", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_protocols_item, fail_timeout),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 10 
+        },
+
+        { 
+            /* name */          "health_check", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_protocols_item, health_check),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
+
+        { 
+            /* name */          "backends", 
+            /* type */          CFG_ARRAY, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_protocols_item, backends),
+            /* offset_len */    offsetof(struct sslhcfg_protocols_item, backends_len),
+            /* offset_present */ 0,
+            /* size */          sizeof(char*), 
+            /* array_type */    CFG_STRING,
+            /* mandatory */     1, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
+
+        { 
+            /* name */          "resolve_interval", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_protocols_item, resolve_interval),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
+
+        { 
+            /* name */          "proxy_protocol", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_protocols_item, proxy_protocol),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
+
+        { 
+            /* name */          "max_connections", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_protocols_item, max_connections),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
 	{ 0 }
 };
                                              
@@ -718,6 +877,70 @@ static struct config_desc table_sslhcfg_listen[] = {
             /* optional */      0, 
             /* default_val*/    .default_val.def_bool = 0 
         },
+
+        { 
+            /* name */          "backlog", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_listen_item, backlog),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 50 
+        },
+
+        { 
+            /* name */          "defer_accept", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_listen_item, defer_accept),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
+
+        { 
+            /* name */          "tfo_queue", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_listen_item, tfo_queue),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 5 
+        },
+
+        { 
+            /* name */          "proxy_protocol", 
+            /* type */          CFG_BOOL, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        NULL,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_listen_item, proxy_protocol),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_bool = 0 
+        },
 	{ 0 }
 };
                                                                                                              
@@ -947,6 +1170,246 @@ static struct config_desc table_sslhcfg[] = {
             /* optional */      0, 
             /* default_val*/    .default_val.def_int = 0 
         },
+
+        { 
+            /* name */          "threads", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_threads,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, threads),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
+
+        { 
+            /* name */          "cpu_affinity", 
+            /* type */          CFG_BOOL, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_cpu_affinity,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, cpu_affinity),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_bool = 0 
+        },
+
+        { 
+            /* name */          "deferred_highwater", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_deferred_highwater,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, deferred_highwater),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 65536 
+        },
+
+        { 
+            /* name */          "udp_gro", 
+            /* type */          CFG_BOOL, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_udp_gro,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, udp_gro),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_bool = 0 
+        },
+
+        { 
+            /* name */          "prefork", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_prefork,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, prefork),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
+
+        { 
+            /* name */          "prefork_max_spare", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_prefork_max_spare,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, prefork_max_spare),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 10 
+        },
+
+        { 
+            /* name */          "prefork_max_processes", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_prefork_max_processes,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, prefork_max_processes),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 256 
+        },
+
+        { 
+            /* name */          "prefork_max_connections", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_prefork_max_connections,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, prefork_max_connections),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
+
+        { 
+            /* name */          "metrics", 
+            /* type */          CFG_STRING, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_metrics,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, metrics),
+            /* offset_len */    0,
+            /* offset_present */ offsetof(struct sslhcfg_item, metrics_is_present),
+            /* size */          sizeof(char*), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      1, 
+            /* default_val*/    .default_val.def_string = NULL 
+        },
+
+        { 
+            /* name */          "accept_batch", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_accept_batch,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, accept_batch),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 16 
+        },
+
+        { 
+            /* name */          "rate_limit", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_rate_limit,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, rate_limit),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
+
+        { 
+            /* name */          "rate_burst", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_rate_burst,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, rate_burst),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 10 
+        },
+
+        { 
+            /* name */          "rate_prefix4", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_rate_prefix4,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, rate_prefix4),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 24 
+        },
+
+        { 
+            /* name */          "rate_prefix6", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_rate_prefix6,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, rate_prefix6),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 64 
+        },
+
+        { 
+            /* name */          "max_probing", 
+            /* type */          CFG_INT, 
+            /* sub_group*/      NULL,
+            /* arg_cl */        & sslhcfg_max_probing,
+            /* base_addr */     NULL,
+            /* offset */        offsetof(struct sslhcfg_item, max_probing),
+            /* offset_len */    0,
+            /* offset_present */ 0,
+            /* size */          sizeof(int), 
+            /* array_type */    -1,
+            /* mandatory */     0, 
+            /* optional */      0, 
+            /* default_val*/    .default_val.def_int = 0 
+        },
 	{ 0 }
 };
 static struct compound_cl_target sslhcfg_anyprot_targets [] = {
@@ -954,6 +1417,9 @@ static struct compound_cl_target sslhcfg_anyprot_targets [] = {
 	{ & table_sslhcfg_protocols[1], 1, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[2], 2, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[8], 0, .value.def_int = 1 },
+	{ & table_sslhcfg_protocols[15], 0, .value.def_int = 5 },
+	{ & table_sslhcfg_protocols[16], 0, .value.def_string = "roundrobin" },
+	{ & table_sslhcfg_protocols[17], 0, .value.def_int = 10 },
 	{ 0 }
 };
 
@@ -962,6 +1428,9 @@ static struct compound_cl_target sslhcfg_socks5_targets [] = {
 	{ & table_sslhcfg_protocols[1], 1, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[2], 2, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[8], 0, .value.def_int = 1 },
+	{ & table_sslhcfg_protocols[15], 0, .value.def_int = 5 },
+	{ & table_sslhcfg_protocols[16], 0, .value.def_string = "roundrobin" },
+	{ & table_sslhcfg_protocols[17], 0, .value.def_int = 10 },
 	{ 0 }
 };
 
@@ -970,6 +1439,9 @@ static struct compound_cl_target sslhcfg_adb_targets [] = {
 	{ & table_sslhcfg_protocols[1], 1, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[2], 2, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[8], 0, .value.def_int = 1 },
+	{ & table_sslhcfg_protocols[15], 0, .value.def_int = 5 },
+	{ & table_sslhcfg_protocols[16], 0, .value.def_string = "roundrobin" },
+	{ & table_sslhcfg_protocols[17], 0, .value.def_int = 10 },
 	{ 0 }
 };
 
@@ -978,6 +1450,9 @@ static struct compound_cl_target sslhcfg_http_targets [] = {
 	{ & table_sslhcfg_protocols[1], 1, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[2], 2, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[8], 0, .value.def_int = 1 },
+	{ & table_sslhcfg_protocols[15], 0, .value.def_int = 5 },
+	{ & table_sslhcfg_protocols[16], 0, .value.def_string = "roundrobin" },
+	{ & table_sslhcfg_protocols[17], 0, .value.def_int = 10 },
 	{ 0 }
 };
 
@@ -986,6 +1461,9 @@ static struct compound_cl_target sslhcfg_xmpp_targets [] = {
 	{ & table_sslhcfg_protocols[1], 1, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[2], 2, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[8], 0, .value.def_int = 1 },
+	{ & table_sslhcfg_protocols[15], 0, .value.def_int = 5 },
+	{ & table_sslhcfg_protocols[16], 0, .value.def_string = "roundrobin" },
+	{ & table_sslhcfg_protocols[17], 0, .value.def_int = 10 },
 	{ 0 }
 };
 
@@ -995,6 +1473,9 @@ static struct compound_cl_target sslhcfg_tinc_targets [] = {
 	{ & table_sslhcfg_protocols[2], 2, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[8], 0, .value.def_int = 1 },
 	{ & table_sslhcfg_protocols[6], 0, .value.def_bool = 1 },
+	{ & table_sslhcfg_protocols[15], 0, .value.def_int = 5 },
+	{ & table_sslhcfg_protocols[16], 0, .value.def_string = "roundrobin" },
+	{ & table_sslhcfg_protocols[17], 0, .value.def_int = 10 },
 	{ 0 }
 };
 
@@ -1004,6 +1485,9 @@ static struct compound_cl_target sslhcfg_openvpn_targets [] = {
 	{ & table_sslhcfg_protocols[2], 2, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[8], 0, .value.def_int = 1 },
 	{ & table_sslhcfg_protocols[6], 0, .value.def_bool = 1 },
+	{ & table_sslhcfg_protocols[15], 0, .value.def_int = 5 },
+	{ & table_sslhcfg_protocols[16], 0, .value.def_string = "roundrobin" },
+	{ & table_sslhcfg_protocols[17], 0, .value.def_int = 10 },
 	{ 0 }
 };
 
@@ -1013,6 +1497,9 @@ static struct compound_cl_target sslhcfg_tls_targets [] = {
 	{ & table_sslhcfg_protocols[2], 2, .value.def_string = "0" },
 	{ & table_sslhcfg_protocols[8], 0, .value.def_int = 1 },
 	{ & table_sslhcfg_protocols[6], 0, .value.def_bool = 1 },
+	{ & table_sslhcfg_protocols[15], 0, .value.def_int = 5 },
+	{ & table_sslhcfg_protocols[16], 0, .value.def_string = "roundrobin" },
+	{ & table_sslhcfg_protocols[17], 0, .value.def_int = 10 },
 	{ 0 }
 };
 
@@ -1023,12 +1510,17 @@ static struct compound_cl_target sslhcfg_ssh_targets [] = {
 	{ & table_sslhcfg_protocols[5], 0, .value.def_bool = 1 },
 	{ & table_sslhcfg_protocols[8], 0, .value.def_int = 1 },
 	{ & table_sslhcfg_protocols[6], 0, .value.def_bool = 1 },
+	{ & table_sslhcfg_protocols[15], 0, .value.def_int = 5 },
+	{ & table_sslhcfg_protocols[16], 0, .value.def_string = "roundrobin" },
+	{ & table_sslhcfg_protocols[17], 0, .value.def_int = 10 },
 	{ 0 }
 };
 
 static struct compound_cl_target sslhcfg_listen_targets [] = {
 	{ & table_sslhcfg_listen[0], 1, .value.def_string = "0" },
 	{ & table_sslhcfg_listen[1], 2, .value.def_string = "0" },
+	{ & table_sslhcfg_listen[4], 0, .value.def_int = 50 },
+	{ & table_sslhcfg_listen[6], 0, .value.def_int = 5 },
 	{ 0 }
 };
 
@@ -1760,6 +2252,21 @@ int sslhcfg_cl_parse(int argc, char* argv[], struct sslhcfg_item* cfg)
          sslhcfg_syslog_facility = arg_strn(NULL, "syslog-facility", "<str>", 0, 1, "Facility to syslog to"),
          sslhcfg_on_timeout = arg_strn(NULL, "on-timeout", "<str>", 0, 1, "Target to connect to when timing out"),
          sslhcfg_prefix = arg_strn(NULL, "prefix", "<str>", 0, 1, "Reserved for testing"),
+         sslhcfg_threads = arg_intn(NULL, "threads", "<n>", 0, 1, "Number of event loop threads in sslh-threads (0: one per CPU)"),
+         sslhcfg_cpu_affinity = arg_litn(NULL, "cpu-affinity", 0, 1, "Pin each sslh-threads thread to its own CPU"),
+         sslhcfg_deferred_highwater = arg_intn(NULL, "deferred-highwater", "<n>", 0, 1, "Bytes to buffer for a connection that cannot be written to before pausing reads from its other end"),
+         sslhcfg_udp_gro = arg_litn(NULL, "udp-gro", 0, 1, "Use UDP generic receive and segmentation offload (Linux)"),
+         sslhcfg_prefork = arg_intn(NULL, "prefork", "<n>", 0, 1, "sslh-fork: number of idle processes to keep waiting for connections (0: fork for each connection)"),
+         sslhcfg_prefork_max_spare = arg_intn(NULL, "prefork-max-spare", "<n>", 0, 1, "sslh-fork: stop idle processes beyond this number"),
+         sslhcfg_prefork_max_processes = arg_intn(NULL, "prefork-max-processes", "<n>", 0, 1, "sslh-fork: maximum number of processes per listening address in prefork mode"),
+         sslhcfg_prefork_max_connections = arg_intn(NULL, "prefork-max-connections", "<n>", 0, 1, "sslh-fork: replace a process after it has handled this many connections (0: never)"),
+         sslhcfg_metrics = arg_strn(NULL, "metrics", "<str>", 0, 1, "Serve metrics on this host:port, or Unix socket path"),
+         sslhcfg_accept_batch = arg_intn(NULL, "accept-batch", "<n>", 0, 1, "sslh-select and sslh-threads: maximum connections to accept at once on a listening socket"),
+         sslhcfg_rate_limit = arg_intn(NULL, "rate-limit", "<n>", 0, 1, "Refuse connections from a source network beyond that many per second (0: no limit)"),
+         sslhcfg_rate_burst = arg_intn(NULL, "rate-burst", "<n>", 0, 1, "Connections a source network can open at once before rate_limit applies"),
+         sslhcfg_rate_prefix4 = arg_intn(NULL, "rate-prefix4", "<n>", 0, 1, "Prefix length of the IPv4 source networks for rate_limit"),
+         sslhcfg_rate_prefix6 = arg_intn(NULL, "rate-prefix6", "<n>", 0, 1, "Prefix length of the IPv6 source networks for rate_limit"),
+         sslhcfg_max_probing = arg_intn(NULL, "max-probing", "<n>", 0, 1, "Refuse connections beyond that many being probed at once (0: no limit)"),
  	sslhcfg_listen = arg_strn("p", "listen", "<host:port>", 0, 10, "Listen on host:port"),
  	sslhcfg_ssh = arg_strn(NULL, "ssh", "<host:port>", 0, 10, "Set up ssh target"),
  	sslhcfg_tls = arg_strn(NULL, "tls", "<host:port>", 0, 10, "Set up TLS/SSL target"),
@@ -1883,6 +2390,36 @@ static void sslhcfg_protocols_fprint(
         if (! sslhcfg_protocols->minlength_is_present)
             fprintf(out, " <unset>");
         fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "splice: %d", sslhcfg_protocols->splice);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "connect_timeout: %d", sslhcfg_protocols->connect_timeout);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "balance: %s", sslhcfg_protocols->balance);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "fail_timeout: %d", sslhcfg_protocols->fail_timeout);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "health_check: %d", sslhcfg_protocols->health_check);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "backends [%zu]:\n", sslhcfg_protocols->backends_len);
+        for (i = 0; i < sslhcfg_protocols->backends_len; i++) {
+            indent(out, depth+1);
+            fprintf(out, "%d:\t%s\n", i, sslhcfg_protocols->backends[i]);
+        }
+        indent(out, depth);
+        fprintf(out, "resolve_interval: %d", sslhcfg_protocols->resolve_interval);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "proxy_protocol: %d", sslhcfg_protocols->proxy_protocol);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "max_connections: %d", sslhcfg_protocols->max_connections);
+        fprintf(out, "\n");
 }
 
 static void sslhcfg_listen_fprint(
@@ -1903,6 +2440,18 @@ static void sslhcfg_listen_fprint(
         indent(out, depth);
         fprintf(out, "keepalive: %d", sslhcfg_listen->keepalive);
         fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "backlog: %d", sslhcfg_listen->backlog);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "defer_accept: %d", sslhcfg_listen->defer_accept);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "tfo_queue: %d", sslhcfg_listen->tfo_queue);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "proxy_protocol: %d", sslhcfg_listen->proxy_protocol);
+        fprintf(out, "\n");
 }
 
 void sslhcfg_fprint(
@@ -1965,4 +2514,51 @@ void sslhcfg_fprint(
         for (i = 0; i < sslhcfg->protocols_len; i++) {
             sslhcfg_protocols_fprint(out, &sslhcfg->protocols[i], depth+1);
         }
+        indent(out, depth);
+        fprintf(out, "threads: %d", sslhcfg->threads);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "cpu_affinity: %d", sslhcfg->cpu_affinity);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "deferred_highwater: %d", sslhcfg->deferred_highwater);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "udp_gro: %d", sslhcfg->udp_gro);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "prefork: %d", sslhcfg->prefork);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "prefork_max_spare: %d", sslhcfg->prefork_max_spare);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "prefork_max_processes: %d", sslhcfg->prefork_max_processes);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "prefork_max_connections: %d", sslhcfg->prefork_max_connections);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "metrics: %s", sslhcfg->metrics);
+        if (! sslhcfg->metrics_is_present)
+            fprintf(out, " <unset>");
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "accept_batch: %d", sslhcfg->accept_batch);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "rate_limit: %d", sslhcfg->rate_limit);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "rate_burst: %d", sslhcfg->rate_burst);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "rate_prefix4: %d", sslhcfg->rate_prefix4);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "rate_prefix6: %d", sslhcfg->rate_prefix6);
+        fprintf(out, "\n");
+        indent(out, depth);
+        fprintf(out, "max_probing: %d", sslhcfg->max_probing);
+        fprintf(out, "\n");
 }
@@ -45,6 +45,10 @@ struct sslhcfg_listen_item {
 	char*	port;
 	int	is_udp;
 	int	keepalive;
+	int	backlog;
+	int	defer_accept;
+	int	tfo_queue;
+	int	proxy_protocol;
 };
 
 struct sslhcfg_protocols_item {
@@ -67,9 +71,21 @@ struct sslhcfg_protocols_item {
 	char** regex_patterns;
 	int	minlength_is_present;
 	int	minlength;
+	int	splice;
+	int	connect_timeout;
+	char*	balance;
+	int	fail_timeout;
+	int	health_check;
+	size_t	backends_len;
+	char** backends;
+	int	resolve_interval;
+	int	proxy_protocol;
+	int	max_connections;
 	T_PROBE*	probe;
 	struct addrinfo*	saddr;
 	void*	data;
+	struct backend_pool*	pool;
+	struct proto_metrics*	counters;
 };
 
 struct sslhcfg_item {
@@ -92,6 +108,22 @@ struct sslhcfg_item {
 	struct sslhcfg_listen_item* listen;
 	size_t	protocols_len;
 	struct sslhcfg_protocols_item* protocols;
+	int	threads;
+	int	cpu_affinity;
+	int	deferred_highwater;
+	int	udp_gro;
+	int	prefork;
+	int	prefork_max_spare;
+	int	prefork_max_processes;
+	int	prefork_max_connections;
+	int	metrics_is_present;
+	char*	metrics;
+	int	accept_batch;
+	int	rate_limit;
+	int	rate_burst;
+	int	rate_prefix4;
+	int	rate_prefix6;
+	int	max_probing;
 };
 
 int sslhcfg_parse_file(
@@ -20,9 +20,13 @@
 
 */
 
+#include <sys/mman.h>
 #include "common.h"
 #include "probe.h"
 #include "sslh-conf.h"
+#include "udp-listener.h"
+#include "backends.h"
+#include "proxy-protocol.h"
 
 #ifdef LIBBSD
 #include <bsd/unistd.h>
@@ -59,8 +63,7 @@ int shovel(struct connection *cnx)
           if (FD_ISSET(cnx->q[i].fd, &fds)) {
               res = fd2fd(&cnx->q[1-i], &cnx->q[i]);
               if (res == FD_CNXCLOSED) {
-                  if (cfg.verbose) 
-                      fprintf(stderr, "%s %s", i ? "client" : "server", "socket closed\n");
+                  print_verbose(1, "%s %s", i ? "client" : "server", "socket closed\n");
                   return res;
               }
           }
@@ -68,19 +71,48 @@ int shovel(struct connection *cnx)
    }
 }
 
-/* Child process that finds out what to connect to and proxies 
+/* Sets up cnx for the connection accepted on in_socket. peer is the client
+ * address from accept(), or NULL. proxy_header is set if the client must send
+ * a PROXY header first. Returns 0, or -1 after resetting and closing in_socket
+ * if admission control refuses the connection.
  */
-void start_shoveler(int in_socket)
+static int new_connection(struct connection* cnx, int in_socket,
+                          struct sockaddr_storage* peer, socklen_t peer_len, int proxy_header)
 {
+   init_cnx(cnx);
+   cnx->q[0].fd = in_socket;
+   if (peer) {
+       memcpy(&cnx->peer, peer, peer_len);
+       cnx->peer_len = peer_len;
+   }
+   cnx->proxy_header = proxy_header;
+   if (admission_accepted(cnx) == -1) {
+       admission_reset(in_socket);
+       close(in_socket);
+       return -1;
+   }
+   return 0;
+}
+
+/* Finds out what to connect to and proxies, until the connection closes.
+ * Closes the client socket. Returns -1 if the target could not be connected.
+ */
+static int handle_connection(struct connection* cnx)
+{
+   struct cnx_setup setup;
    fd_set fds;
    struct timeval tv;
-   int res = PROBE_AGAIN;
-   int out_socket;
-   struct connection cnx;
+   int res = PROBE_AGAIN, timed_out = 0;
+   int n, out_socket, in_socket = cnx->q[0].fd;
+#ifdef LIBBSD
    struct connection_desc desc;
+#endif
 
-   init_cnx(&cnx);
-   cnx.q[0].fd = in_socket;
+   /* On the stack: it is only needed until connected */
+   memset(&setup, 0, sizeof(setup));
+   cnx->setup = &setup;
+   connect_init(cnx);
+   metrics_accepted(cnx);
 
    FD_ZERO(&fds);
    FD_SET(in_socket, &fds);
@@ -90,48 +122,104 @@ void start_shoveler(int in_socket)
    while (res == PROBE_AGAIN) {
        /* POSIX does not guarantee that tv will be updated, but the client can
         * only postpone the inevitable for so long */
-       res = select(in_socket + 1, &fds, NULL, NULL, &tv);
-       if (res == -1)
+       n = select(in_socket + 1, &fds, NULL, NULL, &tv);
+       if (n == -1)
            perror("select");
 
        if (FD_ISSET(in_socket, &fds)) {
            /* Received data: figure out what protocol it is */
-           res = probe_client_protocol(&cnx);
+           res = probe_client_protocol(cnx);
+       } else if (cnx->proxy_header) {
+           log_message(LOG_ERR, "fd %d: no PROXY header, dropped\n", in_socket);
+           res = PROBE_NEXT;
+           break;
        } else {
            /* Timed out: it's necessarily SSH */
-           cnx.proto = timeout_protocol();
+           cnx->proto = timeout_protocol();
+           cnx->config = config_get();
            if (cfg.verbose) 
-               log_message(LOG_INFO, "timed out, connect to %s\n", cnx.proto->name);
+               log_message(LOG_INFO, "timed out, connect to %s\n", cnx->proto->name);
+           timed_out = 1;
            break;
        }
    }
+   if (res == PROBE_NEXT) {
+       metrics_closed(cnx);
+       admission_closed(cnx);
+       close(in_socket);
+       release_deferred_data(&cnx->q[1]);
+       return 0;
+   }
+   metrics_probed(cnx, timed_out);
+
+   if (admission_probed(cnx) == -1) {
+       admission_reset(in_socket);
+       metrics_closed(cnx);
+       close(in_socket);
+       release_deferred_data(&cnx->q[1]);
+       return 0;
+   }
 
-   if (cnx.proto->service &&
-       check_access_rights(in_socket, cnx.proto->service)) {
-       exit(0);
+   if ((cnx->proto->service &&
+        check_access_rights(cnx, cnx->proto->service)) ||
+       (cnx->proto->proxy_protocol && proxy_header_add(cnx) == -1)) {
+       metrics_closed(cnx);
+       admission_closed(cnx);
+       close(in_socket);
+       release_deferred_data(&cnx->q[1]);
+       return 0;
    }
 
    /* Connect the target socket */
-   out_socket = connect_addr(&cnx, in_socket);
-   CHECK_RES_DIE(out_socket, "connect");
+   out_socket = connect_addr(cnx);
+   if (out_socket == -1) {
+       metrics_closed(cnx);
+       admission_closed(cnx);
+       close(in_socket);
+       release_deferred_data(&cnx->q[1]);
+       return -1;
+   }
 
-   cnx.q[1].fd = out_socket;
+   cnx->q[1].fd = out_socket;
 
-   get_connection_desc(&desc, &cnx);
-   log_connection(&desc, &cnx);
-   set_proctitle_shovel(&desc, &cnx);
+#ifdef LIBBSD
+   get_connection_desc(&desc, cnx);
+   log_connection(&desc, cnx);
+   set_proctitle_shovel(&desc, cnx);
+#else
+   /* Only describe the connection if it gets logged */
+   log_connection(NULL, cnx);
+#endif
 
-   flush_deferred(&cnx.q[1]);
+   setup_splice(cnx);
 
-   shovel(&cnx);
+   flush_deferred(&cnx->q[1]);
 
+   shovel(cnx);
+
+   release_splice(cnx);
+   backend_release(cnx);
+   log_connection_end(cnx);
+   metrics_closed(cnx);
+   admission_closed(cnx);
+   release_deferred_data(&cnx->q[0]);
+   release_deferred_data(&cnx->q[1]);
    close(in_socket);
    close(out_socket);
    
-   if (cfg.verbose)
-      fprintf(stderr, "connection closed down\n");
+   print_verbose(1, "connection closed down\n");
+
+   return 0;
+}
+
+/* Child process that finds out what to connect to and proxies 
+ */
+void start_shoveler(int in_socket)
+{
+   struct connection cnx;
 
-   exit(0);
+   new_connection(&cnx, in_socket, NULL, 0, 0);
+   exit(handle_connection(&cnx) ? 1 : 0);
 }
 
 static pid_t *listener_pid;
@@ -174,222 +262,290 @@ void set_listen_procname(struct listen_endpoint *listen_socket)
  * */
 void tcp_listener(struct listen_endpoint* endpoint, int num_endpoints, int active_endpoint)
 {
+    struct sockaddr_storage peer;
+    struct connection cnx;
+    socklen_t peer_len;
     int i, in_socket;
+    sigset_t sigterm;
+
+    /* A reload stops listeners with SIGTERM: only let it in while waiting,
+     * so a connection accepted is always handled */
+    sigemptyset(&sigterm);
+    sigaddset(&sigterm, SIGTERM);
+    sigprocmask(SIG_BLOCK, &sigterm, NULL);
+
+    /* Connection processes connect with the addresses we have */
+    start_resolver();
 
     while (1) {
-        in_socket = accept(endpoint[active_endpoint].socketfd, 0, 0);
-        if (cfg.verbose) fprintf(stderr, "accepted fd %d\n", in_socket);
+        peer_len = sizeof(peer);
+        sigprocmask(SIG_UNBLOCK, &sigterm, NULL);
+        in_socket = accept(endpoint[active_endpoint].socketfd, (struct sockaddr*)&peer, &peer_len);
+        sigprocmask(SIG_BLOCK, &sigterm, NULL);
+        if (in_socket == -1) {
+            if (errno != EINTR)
+                log_message(LOG_ERR, "accept: %s\n", strerror(errno));
+            continue;
+        }
+        print_verbose(1, "accepted fd %d\n", in_socket);
+        /* Refused before it costs a process */
+        if (new_connection(&cnx, in_socket, &peer, peer_len,
+                           endpoint[active_endpoint].proxy_protocol) == -1)
+            continue;
 
         switch(fork()) {
         case -1: log_message(LOG_ERR, "fork failed: err %d: %s\n", errno, strerror(errno));
+                 admission_closed(&cnx);
                  break;
 
         case 0: /* In child process */
+                 sigprocmask(SIG_UNBLOCK, &sigterm, NULL);
                  /* Shoveler processes don't need to hog file descriptors */
                  for (i = 0; i < num_endpoints; ++i)
                      close(endpoint[i].socketfd);
-                 start_shoveler(in_socket);
-                 exit(0);
+                 exit(handle_connection(&cnx) ? 1 : 0);
 
         default: /* In parent process */
+                 /* The child counts it from now on */
+                 memset(&cnx.admission, 0, sizeof(cnx.admission));
                  break;
         }
         close(in_socket);
     }
 }
 
-/* UDP support types and stuff */
-struct known_udp_source {
-    int allocated;
-    struct sockaddr sockaddr;
-    socklen_t addrlen;
-    time_t last_active;
-
-    struct sslhcfg_protocols_item* proto; /* Where to connect it to */
-    /* We need one local socket for each target server, so we know where to
-     * forward server responses */
-    int target_sock;  
+/* Prefork mode: a pool of worker processes accept connections on the
+ * listening socket and handle them one at a time, so accepting a connection
+ * does not cost a fork(). Workers tell whether they are busy in a scoreboard
+ * shared with the listener process, which starts or stops workers to keep
+ * between cfg.prefork and cfg.prefork_max_spare of them idle.
+ */
+enum worker_state {
+    W_EMPTY = 0,    /* slot unused */
+    W_STARTING,     /* forked, not accepting yet */
+    W_IDLE,         /* waiting in accept() */
+    W_BUSY          /* handling a connection */
 };
 
+struct scoreboard_slot {
+    pid_t pid;                      /* written by the listener */
+    volatile int state;             /* written by the worker once started */
+    volatile int connections;       /* connections handled so far */
+};
 
-/* Find if the specified source has been seen before. -1 if not found
- *
- * TODO This is linear search and needs to be changed to something better for
- * production if we have more than a dozen sources
- * Also, this assumes src_addr from recvfrom() are repeatable for a specific
- * source...
- * */
-int known_source(struct known_udp_source* ks, int ks_len, struct sockaddr* addr, socklen_t addrlen)
+static struct scoreboard_slot* scoreboard;
+static volatile sig_atomic_t prefork_stop = 0;
+
+static void set_prefork_stop(int sig)
 {
-    int i;
+    prefork_stop = 1;
+}
 
-    for (i = 0; i < ks_len; i++) {
-        if (ks[i].allocated) {
-            if (!memcmp(&ks[i].sockaddr, addr, addrlen)) {
-                return i;
-            }
+/* SIGCHLD (a worker left) and SIGUSR1 (a worker got busy) just wake up the
+ * listener */
+static void wake_listener(int sig)
+{
+}
+
+/* Accepts and handles connections until stopped by SIGTERM or, if
+ * cfg.prefork_max_connections is set, until it has handled that many.
+ * Does not return */
+static void prefork_worker(struct listen_endpoint* endpoint, int num_endpoints,
+                           int active_endpoint, struct scoreboard_slot* slot)
+{
+    struct sockaddr_storage peer;
+    struct connection cnx;
+    socklen_t peer_len;
+    int i, in_socket, res;
+    struct sigaction action;
+    sigset_t sigterm;
+
+    for (i = 0; i < num_endpoints; ++i)
+        if (i != active_endpoint)
+            close(endpoint[i].socketfd);
+
+    /* SIGTERM must interrupt accept(), but not a connection: it is blocked
+     * while handling one, and the worker leaves when done */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = set_prefork_stop;
+    res = sigaction(SIGTERM, &action, NULL);
+    CHECK_RES_DIE(res, "sigaction");
+    sigemptyset(&sigterm);
+    sigaddset(&sigterm, SIGTERM);
+    sigprocmask(SIG_SETMASK, &sigterm, NULL);
+
+    start_resolver();
+
+    while (!cfg.prefork_max_connections ||
+           (slot->connections < cfg.prefork_max_connections)) {
+        slot->state = W_IDLE;
+        sigprocmask(SIG_UNBLOCK, &sigterm, NULL);
+        if (prefork_stop)
+            break;
+        peer_len = sizeof(peer);
+        in_socket = accept(endpoint[active_endpoint].socketfd, (struct sockaddr*)&peer, &peer_len);
+        sigprocmask(SIG_BLOCK, &sigterm, NULL);
+        if (in_socket == -1) {
+            if (errno != EINTR)
+                log_message(LOG_ERR, "accept: %s\n", strerror(errno));
+            continue;
         }
+
+        slot->state = W_BUSY;
+        slot->connections++;
+        /* The listener may need to start another worker */
+        kill(getppid(), SIGUSR1);
+        print_verbose(1, "accepted fd %d\n", in_socket);
+        if (new_connection(&cnx, in_socket, &peer, peer_len,
+                           endpoint[active_endpoint].proxy_protocol) == 0)
+            handle_connection(&cnx);
     }
-    return -1;
+    exit(0);
 }
 
-int get_empty_source(struct known_udp_source* ks, int ks_len)
+/* Returns 0 on success, -1 if fork() failed */
+static int prefork_spawn(struct listen_endpoint* endpoint, int num_endpoints,
+                         int active_endpoint, struct scoreboard_slot* slot)
 {
-    int i;
-    for (i = 0; i < ks_len; i++)
-        if (!ks[i].allocated) return i;
-    return -1;
-}
+    pid_t pid;
 
-/* TODO: Make that dynamic... */
-#define MAX_UDP_SRC 1024
-/* Array to keep the UDP sources we have seen before */
-struct known_udp_source udp_known_sources[MAX_UDP_SRC];
+    slot->state = W_STARTING;
+    slot->connections = 0;
 
+    pid = fork();
+    switch (pid) {
+    case -1: log_message(LOG_ERR, "fork failed: err %d: %s\n", errno, strerror(errno));
+             slot->state = W_EMPTY;
+             return -1;
 
-/* Process UDP coming from outside:
- * If it's a new source, probe; otherwise, forward to previous target 
- * Returns: >= 0 sockfd of newly allocated socket, for new connections
- * -1 otherwise
- * */
-int udp_extern_forward(int sockfd) {
-    char addr_str[NI_MAXHOST+1+NI_MAXSERV+1];
-    struct sockaddr src_addr;
-    struct addrinfo addrinfo;
-    struct known_udp_source* src;
-    ssize_t len;
-    socklen_t addrlen;
-    int res, target, out = -1;
-    char data[65536]; /* Theoritical max is 65507 (https://en.wikipedia.org/wiki/User_Datagram_Protocol).
-                         This will do.  Dynamic allocation is possible with the MSG_PEEK flag in recvfrom(2), but that'd imply
-                         malloc/free overhead for each packet, when really 64K is not that much */
-
-    fprintf(stderr, "recvfrom(%d)\n", getpid());
-    addrlen = sizeof(src_addr);
-    len = recvfrom(sockfd, data, sizeof(data), 0, &src_addr, &addrlen);
-    if (len < 0) {
-        perror("recvfrom");
-        return -1;
+    case 0: /* In child process */
+             prefork_worker(endpoint, num_endpoints, active_endpoint, slot);
+
+    default: /* In parent process */
+             slot->pid = pid;
+             return 0;
     }
-    target = known_source(udp_known_sources, ARRAY_SIZE(udp_known_sources), 
-                          &src_addr, addrlen);
-    addrinfo.ai_addr = &src_addr;
-    addrinfo.ai_addrlen = addrlen;
-    if (cfg.verbose) 
-        fprintf(stderr, "received %ld UDP from %d:%s\n", len, target, sprintaddr(addr_str, sizeof(addr_str), &addrinfo));
-    if (target == -1) {
-        target = get_empty_source(udp_known_sources, ARRAY_SIZE(udp_known_sources));
-        fprintf(stderr, "source target index %d\n", target);
-        if (target == -1) exit(0); /* TODO handle this properly */
-        /* A probe worked: save this as an active connection */
-        src = &udp_known_sources[target];
-        src->allocated = 1;
-        src->sockaddr = src_addr;
-        src->addrlen = addrlen;
-        src->last_active = time(NULL);
-
-        res = probe_buffer(data, len, &src->proto);
-        /* First version: if we can't work out the protocol from the first
-         * packet, drop it. Conceivably, we could store several packets to
-         * run probes on packet sets */
-        if (cfg.verbose) fprintf(stderr, "UDP probed: %d\n", res);
-        if (res != PROBE_MATCH) return -1;
-
-        src->target_sock = socket(src->proto->saddr->ai_family, SOCK_DGRAM, 0);
-        out = src->target_sock;
+}
+
+/* Prefork listener: maintains the pool of workers of one listening endpoint,
+ * each time a worker gets busy or exits, and at least once per second.
+ * Does not return */
+void prefork_listener(struct listen_endpoint* endpoint, int num_endpoints, int active_endpoint)
+{
+    int i, res, idle, used, max_spare, at_cap = 0;
+    int num_slots = cfg.prefork_max_processes;
+    struct sigaction action;
+    struct timespec tick;
+    sigset_t sigs, unblocked;
+    pid_t pid;
+
+    max_spare = MAX(cfg.prefork, cfg.prefork_max_spare);
+    if (num_slots < 1) num_slots = 1;
+
+    scoreboard = mmap(NULL, num_slots * sizeof(*scoreboard), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (scoreboard == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
     }
+    memset(scoreboard, 0, num_slots * sizeof(*scoreboard));
 
-    src = &udp_known_sources[target];
-    /* at this point src is the UDP connection */
-    res = sendto(src->target_sock, data, len, 0, 
-                 src->proto->saddr->ai_addr, src->proto->saddr->ai_addrlen);
-    src->last_active = time(NULL);
-    fprintf(stderr, "sending %d to %s", 
-            res, sprintaddr(data, sizeof(data), src->proto->saddr));
-    return out;
-}
+    /* Workers are the only children of this process: unlike connection
+     * processes, they must be waited for to know their slot is free */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wake_listener;
+    res = sigaction(SIGCHLD, &action, NULL);
+    CHECK_RES_DIE(res, "sigaction");
+    res = sigaction(SIGUSR1, &action, NULL);
+    CHECK_RES_DIE(res, "sigaction");
 
+    action.sa_handler = set_prefork_stop;
+    res = sigaction(SIGTERM, &action, NULL);
+    CHECK_RES_DIE(res, "sigaction");
 
-/* Clears old connections from udp_known_sources, and from passed fd_set */
-#define UDP_TIMEOUT 60   /* Timeout before forgetting the connection, in seconds */
-void reap_timeouts(struct known_udp_source* sources, int n_src, fd_set* fd)
-{
-    int i;
-    time_t now = time(NULL);
-    struct known_udp_source* src;
-
-    for (i = 0; i < n_src; i++) {
-        src = &sources[i];
-        if (src->allocated && (now - src->last_active > UDP_TIMEOUT)) {
-            close(src->target_sock);
-            FD_CLR(src->target_sock, fd);
-            memset(&sources[i], 0, sizeof(sources[i]));
-            if (cfg.verbose > 3) 
-                fprintf(stderr, "disconnect %d\n", i);
+    /* Signals are only taken while waiting, so none is missed */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGTERM);
+    sigprocmask(SIG_BLOCK, &sigs, &unblocked);
+
+    while (!prefork_stop) {
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (i = 0; i < num_slots; i++) {
+                if (scoreboard[i].pid == pid) {
+                    scoreboard[i].pid = 0;
+                    scoreboard[i].state = W_EMPTY;
+                }
+            }
         }
-    }
-}
 
+        idle = 0;
+        for (i = 0; i < num_slots; i++)
+            if (scoreboard[i].state == W_IDLE || scoreboard[i].state == W_STARTING)
+                idle++;
 
-/* UDP listener: upon incoming packet, find where it should go */
-void udp_listener(struct listen_endpoint* endpoint, int num_endpoints, int active_endpoint)
-{
-    fd_set fds_r, fds_r_tmp;
-    char data[65536]; /* TODO what? */
-    int max_fd, res, sockfd, i;
-    struct known_udp_source* src;
-    struct timeval tv;
+        for (i = 0; (i < num_slots) && (idle < cfg.prefork); i++) {
+            if (scoreboard[i].state == W_EMPTY &&
+                !prefork_spawn(endpoint, num_endpoints, active_endpoint, &scoreboard[i]))
+                idle++;
+        }
 
-    FD_ZERO(&fds_r);
-    FD_SET(endpoint[active_endpoint].socketfd, &fds_r);
-    max_fd = endpoint[active_endpoint].socketfd + 1;
+        /* New connections wait in the backlog until a worker is done: say so
+         * once each time it happens */
+        used = 0;
+        for (i = 0; i < num_slots; i++)
+            if (scoreboard[i].state != W_EMPTY)
+                used++;
+        if (!idle && used == num_slots) {
+            if (!at_cap)
+                log_message(LOG_WARNING, "prefork: all %d workers busy, connections wait "
+                            "(see prefork_max_processes)\n", num_slots);
+            at_cap = 1;
+        } else {
+            at_cap = 0;
+        }
 
-    while (1) {
-        fds_r_tmp = fds_r;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        res = select(max_fd + 1,  &fds_r_tmp, NULL, NULL, &tv);
-        CHECK_RES_DIE(res, "select");
-
-        if (res) {
-            if (FD_ISSET(endpoint[active_endpoint].socketfd, &fds_r_tmp)) {
-                sockfd = udp_extern_forward(endpoint[active_endpoint].socketfd);
-                if (sockfd >= 0) {
-                    FD_SET(sockfd, &fds_r);
-                    max_fd = MAX(max_fd, sockfd);
-                }
-            } else {
-                for (i = 0; i < ARRAY_SIZE(udp_known_sources); i++) {
-                    src = &udp_known_sources[i];
-                    if (src->allocated) {
-                        sockfd = src->target_sock;
-                        if (FD_ISSET(sockfd, &fds_r_tmp)) {
-                            res = recvfrom(sockfd, data, sizeof(data), 0, NULL, NULL);
-                            fprintf(stderr, "recvfrom %d\n", res);
-                            CHECK_RES_DIE(res, "udp_listener/recvfrom");
-                            res = sendto(endpoint[active_endpoint].socketfd, data, res, 0,
-                                         &src->sockaddr, src->addrlen);
-                            src->last_active = time(NULL);
-                            fprintf(stderr, "sendto %d to\n", res);
-                        }
-                    }
+        /* Stop one idle worker at a time, so the pool shrinks slowly */
+        if (idle > max_spare) {
+            for (i = num_slots - 1; i >= 0; i--) {
+                if (scoreboard[i].state == W_IDLE) {
+                    kill(scoreboard[i].pid, SIGTERM);
+                    break;
                 }
             }
         }
-        reap_timeouts(udp_known_sources, ARRAY_SIZE(udp_known_sources), &fds_r);
+
+        print_verbose(2, "prefork: %d idle workers\n", idle);
+
+        tick.tv_sec = 1;
+        tick.tv_nsec = 0;
+        pselect(0, NULL, NULL, NULL, &tick, &unblocked);
     }
+
+    /* Workers finish their current connection before leaving */
+    for (i = 0; i < num_slots; i++)
+        if (scoreboard[i].pid)
+            kill(scoreboard[i].pid, SIGTERM);
+    exit(0);
 }
 
-void main_loop(struct listen_endpoint listen_sockets[], int num_addr_listen)
+/* sslh-fork already forks one listener process per listening socket */
+int server_threads(void)
 {
-    int i, res;
-    struct sigaction action;
+    return 1;
+}
 
-    listener_pid_number = num_addr_listen;
-    listener_pid = malloc(listener_pid_number * sizeof(listener_pid[0]));
-    CHECK_ALLOC(listener_pid, "malloc");
+/* Nothing to turn off */
+void server_config_check(void)
+{
+}
+
+/* Starts one process for each listening address */
+static void start_listeners(struct listen_endpoint listen_sockets[], int num_addr_listen)
+{
+    int i;
 
-    /* Start one process for each listening address */
     for (i = 0; i < num_addr_listen; i++) {
         listener_pid[i] = fork();
         switch(listener_pid[i]) {
@@ -398,9 +554,16 @@ void main_loop(struct listen_endpoint listen_sockets[], int num_addr_listen)
                  break;
         /* We're in the child, we have work to do  */
         case 0:
+            /* Reloads and upgrades are for the main process, and so is
+             * stop_listeners() after the first start; connection processes
+             * inherit this */
+            setup_child_signals();
+            signal(SIGTERM, SIG_DFL);
             set_listen_procname(&listen_sockets[i]);
             if (listen_sockets[i].type == SOCK_DGRAM)
                 udp_listener(listen_sockets, num_addr_listen, i);
+            else if (cfg.prefork)
+                prefork_listener(listen_sockets, num_addr_listen, i);
             else
                 tcp_listener(listen_sockets, num_addr_listen, i);
 	    break;
@@ -410,6 +573,19 @@ void main_loop(struct listen_endpoint listen_sockets[], int num_addr_listen)
 	    break;
         }
     }
+}
+
+void main_loop(struct listen_endpoint listen_sockets[], int num_addr_listen)
+{
+    int res;
+    struct sigaction action;
+    struct sslhcfg_item* new_cfg;
+
+    listener_pid_number = num_addr_listen;
+    listener_pid = malloc(listener_pid_number * sizeof(listener_pid[0]));
+    CHECK_ALLOC(listener_pid, "malloc");
+
+    start_listeners(listen_sockets, num_addr_listen);
 
     /* Set SIGTERM to "stop_listeners" which further kills all listener
      * processes. Note this won't kill processes that listeners forked, which
@@ -419,8 +595,38 @@ void main_loop(struct listen_endpoint listen_sockets[], int num_addr_listen)
     res = sigaction(SIGTERM, &action, NULL);
     CHECK_RES_DIE(res, "sigaction");
 
-
-    wait(NULL);
+    /* Children are not waited for (see setup_signals()): wait() returns when
+     * they are all gone, or on a signal. On SIGHUP, listeners are started
+     * again with the new configuration; the listening sockets stay open
+     * meanwhile, so no connection is refused, and connection processes keep
+     * going with the configuration they were forked with. On SIGQUIT,
+     * listeners stop and we leave, connection processes finish on their
+     * own. */
+    while (1) {
+        if (!reload_requested && !upgrade_requested && !drain_requested)
+            wait(NULL);
+        if (drain_requested) {
+            log_message(LOG_INFO, "no longer accepting connections\n");
+            stop_listeners(SIGTERM);
+            metrics_drain();
+            break;
+        }
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            upgrade_start();
+            continue;
+        }
+        /* SIGTERM, or no listener left */
+        if (!reload_requested)
+            break;
+        reload_requested = 0;
+        new_cfg = reload_prepare();
+        if (!new_cfg)
+            continue;
+        stop_listeners(SIGTERM);
+        reload_install(new_cfg);
+        start_listeners(listen_sockets, num_addr_listen);
+    }
 }
 
 /* The actual main is in common.c: it's the same for both version of
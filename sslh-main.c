@@ -25,20 +25,16 @@
 #ifdef LIBCONFIG
 #include <libconfig.h>
 #endif
-#ifdef ENABLE_REGEX
-#ifdef LIBPCRE
-#include <pcreposix.h>
-#else
-#include <regex.h>
-#endif
-#endif
-
 #ifdef LIBBSD
 #include <bsd/unistd.h>
 #endif
 
+#include <sys/syscall.h>
 #include "common.h"
 #include "probe.h"
+#include "regex-probe.h"
+#include "backends.h"
+#include "resolver.h"
 
 const char* USAGE_STRING =
 "sslh " VERSION "\n" \
@@ -92,7 +88,7 @@ static void printsettings(void)
     for (i = 0; i < cfg.protocols_len; i++ ) {
         p = &cfg.protocols[i];
         fprintf(stderr,
-                "%s addr: %s. libwrap service: %s log_level: %d family %d %d [%s] [%s] [%s]\n",
+                "%s addr: %s. libwrap service: %s log_level: %d family %d %d [%s] [%s] [%s] [%s]\n",
                 p->name, 
                 sprintaddr(buf, sizeof(buf), p->saddr), 
                 p->service,
@@ -101,7 +97,8 @@ static void printsettings(void)
                 p->saddr->ai_addr->sa_family,
                 p->keepalive ? "keepalive" : "",
                 p->fork ? "fork" : "",
-                p->transparent ? "transparent" : ""
+                p->transparent ? "transparent" : "",
+                p->splice ? "splice" : ""
                 );
     }
     fprintf(stderr, "timeout: %d\non-timeout: %s\n", cfg.timeout,
@@ -109,75 +106,327 @@ static void printsettings(void)
 }
 
 
-static void setup_regex_probe(struct sslhcfg_protocols_item *p)
-#ifdef LIBCONFIG
+/* For each protocol in the configuration c, resolve address and set up
+ * protocol options if required. Targets that are the same as in the previous
+ * configuration (NULL at startup) keep their set-up. Does not touch cfg, nor
+ * what is shared by all protocols (see install_protocols()).
+ * Returns 0, or the status to exit with. */
+static int prepare_protocols(struct sslhcfg_item* c, struct sslhcfg_item* previous)
 {
-    int num_patterns, i, res;
-    regex_t** pattern_list;
-    size_t errsize;
-    char* err;
-
-    num_patterns = p->regex_patterns_len;
-
-    pattern_list = calloc(num_patterns + 1, sizeof(*pattern_list));
-    CHECK_ALLOC(pattern_list, "calloc");
-    p->data = (void*)pattern_list;
-
-    for (i = 0; i < num_patterns; i++) {
-        pattern_list[i] = malloc(sizeof(*(pattern_list[i])));
-        CHECK_ALLOC(pattern_list[i], "malloc");
-        res = regcomp(pattern_list[i], p->regex_patterns[i], REG_EXTENDED);
-        if (res) {
-            err = malloc(errsize = regerror(res, pattern_list[i], NULL, 0));
-            CHECK_ALLOC(err, "malloc");
-            regerror(res, pattern_list[i], err, errsize);
-            fprintf(stderr, "%s:%s\n", p->regex_patterns[i], err);
-            free(err);
-            exit(1);
+    int i, res;
+
+    res = admission_check_config(c);
+    if (res) return res;
+
+    for (i = 0; i < c->protocols_len; i++) {
+        struct sslhcfg_protocols_item* p = &(c->protocols[i]);
+
+        p->probe = get_probe(p->name);
+        if (!p->probe) {
+            fprintf(stderr, "%s: probe unknown\n", p->name);
+            return 1;
+        }
+
+        if (p->proxy_protocol < 0 || p->proxy_protocol > 2) {
+            fprintf(stderr, "%s: proxy_protocol must be 0, 1 or 2\n", p->name);
+            return 1;
+        }
+        if (p->proxy_protocol && p->is_udp) {
+            fprintf(stderr, "%s: no proxy_protocol over UDP, ignored\n", p->name);
+            p->proxy_protocol = 0;
+        }
+
+        if (resolve_split_name(&(p->saddr), p->host, p->port)) {
+            fprintf(stderr, "cannot resolve %s:%s\n", p->host, p->port);
+            return 4;
+        }
+        if (!backends_reuse(p, previous)) {
+            res = backends_setup(p);
+            if (res) return res;
+        }
+
+        if (!strcmp(p->name, "tls")) {
+            p->data = (void*)new_tls_data();
+            if (p->sni_hostnames_len)
+                tls_data_set_list(p->data, 0,
+                                  (const char**) p->sni_hostnames,
+                                  p->sni_hostnames_len);
+            if (p->alpn_protocols_len)
+                tls_data_set_list(p->data, 1, 
+                                  (const char**) p->alpn_protocols,
+                                  p->alpn_protocols_len);
+        }
+
+        if (!strcmp(p->name, "regex")) {
+            res = regex_compile(p);
+            if (res) return res;
         }
     }
+    return 0;
 }
-#else
+
+/* Sets up what all the protocols of cfg share */
+static void install_protocols(void)
 {
-    return;
+    tls_compile_matchers();
+    build_probe_dispatch();
 }
-#endif
 
-/* For each protocol in the configuration, resolve address and set up protocol
- * options if required
- */
-static void config_protocols()
+/* What the first configuration was read from, and set up with: reloads and
+ * upgrades do it again */
+static int main_argc;
+static char** main_argv;
+static char* main_path;     /* the binary, as found from the current directory */
+static struct listen_endpoint* main_listen_sockets;
+static int main_num_addr_listen;
+static int main_copies;
+
+/* Returns the configuration file given on the command line, or NULL */
+static const char* config_file(void)
 {
     int i;
-    for (i = 0; i < cfg.protocols_len; i++) {
-        struct sslhcfg_protocols_item* p = &(cfg.protocols[i]);
-        if (resolve_split_name(&(p->saddr), p->host, p->port)) {
-            fprintf(stderr, "cannot resolve %s:%s\n", p->host, p->port);
-            exit(4);
-        }
 
-        p->probe = get_probe(p->name);
-        if (!p->probe) {
-            fprintf(stderr, "%s: probe unknown\n", p->name);
-            exit(1);
-        }
+    for (i = 1; i < main_argc; i++) {
+        if (!strcmp(main_argv[i], "-F") || !strcmp(main_argv[i], "--config"))
+            return i + 1 < main_argc ? main_argv[i + 1] : NULL;
+        if (!strncmp(main_argv[i], "--config=", 9))
+            return main_argv[i] + 9;
+        if (!strncmp(main_argv[i], "-F", 2))
+            return main_argv[i] + 2;
+    }
+    return NULL;
+}
 
-        if (!strcmp(cfg.protocols[i].name, "regex")) {
-            setup_regex_probe(&cfg.protocols[i]);
-        }
+struct sslhcfg_item* reload_prepare(void)
+{
+    struct sslhcfg_item* new_cfg;
+    const char* file;
+    int res;
+
+    log_message(LOG_INFO, "reloading configuration\n");
+
+    /* It's read after dropping privileges and changing root, which it may
+     * not survive: say so, rather than leave it to the parser */
+    file = config_file();
+    if (file && access(file, R_OK)) {
+        if (cfg.chroot)
+            log_message(LOG_ERR, "configuration not reloaded: can't read %s under chroot %s: %s\n",
+                        file, cfg.chroot, strerror(errno));
+        else
+            log_message(LOG_ERR, "configuration not reloaded: can't read %s: %s\n",
+                        file, strerror(errno));
+        return NULL;
+    }
 
-        if (!strcmp(cfg.protocols[i].name, "tls")) {
-            cfg.protocols[i].data = (void*)new_tls_data();
-            if (cfg.protocols[i].sni_hostnames_len)
-                tls_data_set_list(cfg.protocols[i].data, 0,
-                                  (const char**) cfg.protocols[i].sni_hostnames,
-                                  cfg.protocols[i].sni_hostnames_len);
-            if (cfg.protocols[i].alpn_protocols_len)
-                tls_data_set_list(cfg.protocols[i].data, 1, 
-                                  (const char**) cfg.protocols[i].alpn_protocols,
-                                  cfg.protocols[i].alpn_protocols_len);
-        }
+    new_cfg = calloc(1, sizeof(*new_cfg));
+    CHECK_ALLOC(new_cfg, "calloc");
+
+    res = sslhcfg_cl_parse(main_argc, main_argv, new_cfg);
+    if (!res && !new_cfg->protocols_len) {
+        fprintf(stderr, "At least one target protocol must be specified.\n");
+        res = 2;
     }
+    if (!res) {
+        res = prepare_protocols(new_cfg, &cfg);
+        if (res)
+            config_free_protocols(new_cfg->protocols, new_cfg->protocols_len);
+    }
+    if (res) {
+        /* The strings it was parsed into are not worth tracking down */
+        log_message(LOG_ERR, "configuration not reloaded: errors in it\n");
+        free(new_cfg);
+        return NULL;
+    }
+    return new_cfg;
+}
+
+/* Settings only used at startup: keep the current ones, and say if they
+ * changed */
+#define KEEP_INT(field) \
+    do { \
+        if (new_cfg->field != cfg.field) \
+            log_message(LOG_WARNING, "%s changed: restart sslh to apply\n", #field); \
+        new_cfg->field = cfg.field; \
+    } while (0)
+
+#define KEEP_STR(field) \
+    do { \
+        if (!new_cfg->field != !cfg.field || \
+            (cfg.field && strcmp(new_cfg->field, cfg.field))) \
+            log_message(LOG_WARNING, "%s changed: restart sslh to apply\n", #field); \
+        new_cfg->field = cfg.field; \
+    } while (0)
+
+static void keep_startup_settings(struct sslhcfg_item* new_cfg)
+{
+    int i, changed;
+
+    KEEP_INT(foreground);
+    KEEP_INT(inetd);
+    KEEP_INT(user_is_present);
+    KEEP_STR(user);
+    KEEP_INT(pidfile_is_present);
+    KEEP_STR(pidfile);
+    KEEP_INT(chroot_is_present);
+    KEEP_STR(chroot);
+    KEEP_STR(syslog_facility);
+    KEEP_INT(threads);
+    KEEP_INT(cpu_affinity);
+    KEEP_INT(udp_gro);
+    /* Buffers already allocated have the size it gives (see ring_capacity()) */
+    KEEP_INT(deferred_highwater);
+    KEEP_INT(metrics_is_present);
+    KEEP_STR(metrics);
+
+    changed = (new_cfg->listen_len != cfg.listen_len);
+    for (i = 0; !changed && i < cfg.listen_len; i++) {
+        struct sslhcfg_listen_item *a = &new_cfg->listen[i], *b = &cfg.listen[i];
+        changed = strcmp(a->host, b->host) || strcmp(a->port, b->port) ||
+            a->is_udp != b->is_udp || a->keepalive != b->keepalive ||
+            a->backlog != b->backlog || a->defer_accept != b->defer_accept ||
+            a->tfo_queue != b->tfo_queue || a->proxy_protocol != b->proxy_protocol;
+    }
+    if (changed)
+        log_message(LOG_WARNING, "listen changed: restart sslh to apply\n");
+    new_cfg->listen_len = cfg.listen_len;
+    free(new_cfg->listen);
+    new_cfg->listen = cfg.listen;
+}
+
+/* The previous protocols go once the connections and threads that use them
+ * are done (see config_track()); conf2struct doesn't say which strings it
+ * allocated, so those stay. */
+void reload_install(struct sslhcfg_item* new_cfg)
+{
+    keep_startup_settings(new_cfg);
+    cfg = *new_cfg;
+    free(new_cfg);
+    __atomic_add_fetch(&config_generation, 1, __ATOMIC_RELEASE);
+    config_track();
+
+    server_config_check();
+    install_protocols();
+    metrics_set_protocols();
+    if (cfg.verbose)
+        printsettings();
+
+    start_health_checks();
+    start_resolver();
+
+    log_message(LOG_INFO, "configuration reloaded, %zu protocols\n", cfg.protocols_len);
+}
+
+
+/* The new binary gets the environment, without what a previous upgrade may
+ * have left there, plus the listening sockets (see get_upgrade_sockets()).
+ * Everything is made ready before fork(): the child is a copy of a
+ * multi-threaded process, it should only call async-signal-safe functions
+ * until it execs. */
+static int compare_int(const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* Closes the file descriptors from 3 up, but the num ones of keep (sorted).
+ * It runs between fork() and exec(), so it only makes system calls:
+ * close_range() (Linux 5.9) closes each range between two of keep at once,
+ * and without it, each descriptor up to max_fd is closed in turn. */
+static void close_other_fds(const int* keep, int num, int max_fd)
+{
+    int i, fd, first = 3;
+
+#ifdef __NR_close_range
+    for (i = 0; i <= num; i++) {
+        unsigned last = i < num ? keep[i] - 1 : ~0U;
+        if (i < num && keep[i] < first)
+            continue;
+        if (last >= first && syscall(__NR_close_range, first, last, 0) == -1)
+            break;
+        if (i < num)
+            first = keep[i] + 1;
+    }
+    if (i > num)
+        return;
+#endif
+
+    for (fd = first, i = 0; fd < max_fd; fd++) {
+        while (i < num && keep[i] < fd)
+            i++;
+        if (i == num || keep[i] != fd)
+            close(fd);
+    }
+}
+
+void upgrade_start(void)
+{
+    extern char** environ;
+    char copies[32], pid[32], *fds, **envp;
+    int i, n, len, max_fd, *keep;
+    sigset_t none;
+    pid_t child;
+
+    if (!main_num_addr_listen) {
+        log_message(LOG_ERR, "upgrade: no listening socket to hand over\n");
+        return;
+    }
+    /* The binary, and what it loads, is outside the new root */
+    if (cfg.chroot) {
+        log_message(LOG_ERR, "upgrade: not possible under chroot, restart sslh instead\n");
+        return;
+    }
+
+    len = strlen("SSLH_LISTEN_FDS=") + main_num_addr_listen * 12;
+    fds = malloc(len);
+    CHECK_ALLOC(fds, "malloc");
+    n = snprintf(fds, len, "SSLH_LISTEN_FDS=");
+    for (i = 0; i < main_num_addr_listen; i++)
+        n += snprintf(fds + n, len - n, "%s%d", i ? "," : "",
+                      main_listen_sockets[i].socketfd);
+    snprintf(copies, sizeof(copies), "SSLH_LISTEN_COPIES=%d", main_copies);
+    snprintf(pid, sizeof(pid), "SSLH_UPGRADE_PID=%d", getpid());
+
+    for (n = 0; environ[n]; n++)
+        ;
+    envp = malloc((n + 4) * sizeof(*envp));
+    CHECK_ALLOC(envp, "malloc");
+    for (i = n = 0; environ[i]; i++)
+        if (strncmp(environ[i], "SSLH_", 5))
+            envp[n++] = environ[i];
+    envp[n++] = fds;
+    envp[n++] = copies;
+    envp[n++] = pid;
+    envp[n] = NULL;
+
+    keep = malloc(main_num_addr_listen * sizeof(*keep));
+    CHECK_ALLOC(keep, "malloc");
+    for (i = 0; i < main_num_addr_listen; i++)
+        keep[i] = main_listen_sockets[i].socketfd;
+    qsort(keep, main_num_addr_listen, sizeof(*keep), compare_int);
+    max_fd = sysconf(_SC_OPEN_MAX);
+    sigemptyset(&none);
+
+    child = fork();
+    switch (child) {
+    case -1:
+        log_message(LOG_ERR, "upgrade: fork failed: %s\n", strerror(errno));
+        break;
+
+    case 0:
+        /* Only the listening sockets go to the new binary: not the
+         * connections, which must close when we close them */
+        close_other_fds(keep, main_num_addr_listen, max_fd);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        environ = envp;
+        execvp(main_path, main_argv);
+        _exit(1);
+
+    default:
+        log_message(LOG_INFO, "upgrade: started %s, pid %d\n", main_path, child);
+        break;
+    }
+    free(fds);
+    free(envp);
+    free(keep);
 }
 
 
@@ -214,8 +463,17 @@ int main(int argc, char *argv[], char* envp[])
    if (res) exit(6);
    if (cfg.verbose > 3)
        sslhcfg_fprint(stderr, &cfg, 0);
-   config_protocols();
+   res = prepare_protocols(&cfg, NULL);
+   if (res) exit(res);
+   config_track();
+   install_protocols();
    config_sanity_check(&cfg);
+   main_argc = argc;
+   main_argv = argv;
+   /* So upgrades find the binary even if the current directory changes */
+   main_path = strchr(argv[0], '/') ? realpath(argv[0], NULL) : NULL;
+   if (!main_path)
+       main_path = argv[0];
 
    if (cfg.inetd)
    {
@@ -227,7 +485,13 @@ int main(int argc, char *argv[], char* envp[])
    if (cfg.verbose)
        printsettings();
 
-   num_addr_listen = start_listen_sockets(&listen_sockets);
+   main_copies = server_threads();
+   num_addr_listen = start_listen_sockets(&listen_sockets, main_copies);
+   main_listen_sockets = listen_sockets;
+   main_num_addr_listen = num_addr_listen;
+   metrics_setup();
+   admission_setup();
+   localaddr_setup();
 
 #ifdef SYSTEMD
    if (num_addr_listen < 1) {
@@ -260,6 +524,14 @@ int main(int argc, char *argv[], char* envp[])
    if (cfg.verbose)
        printcaps();
 
+   start_log_writer(listen_sockets, num_addr_listen);
+   start_metrics_server(listen_sockets, num_addr_listen);
+   start_localaddr_monitor(listen_sockets, num_addr_listen);
+   /* Threads last: the processes above are forked while there are none */
+   start_health_checks();
+   start_resolver();
+   upgrade_finish();
+
    main_loop(listen_sockets, num_addr_listen);
 
    return 0;
@@ -0,0 +1,224 @@
+/*
+   sslh-threads: multi-threaded server, one event loop per thread
+
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+
+*/
+
+#include "common.h"
+#include "probe.h"
+#include "processes.h"
+
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#include <linux/filter.h>
+#endif
+
+const char* server_type = "sslh-threads";
+
+/* Each thread runs the same event loop as sslh-select, with its own
+ * connections and its own copy of the listening sockets (bound with
+ * SO_REUSEPORT, so the kernel spreads incoming connections between threads).
+ * Threads share nothing but the read-only configuration. */
+struct worker {
+    pthread_t thread;
+    int id;
+    struct listen_endpoint* listen_sockets;
+    int num_addr_listen;
+};
+
+/* Number of threads: as configured, or one per online CPU */
+int server_threads(void)
+{
+    long n;
+
+    if (cfg.threads > 0)
+        return cfg.threads;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+#ifdef __linux__
+/* Returns the CPU of thread id: the id-th CPU we are allowed to run on */
+static int thread_cpu(const cpu_set_t* allowed, int id)
+{
+    int cpu, n;
+
+    n = id % CPU_COUNT(allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, allowed) && !n--)
+            break;
+    }
+    return cpu;
+}
+#endif
+
+/* Pin the calling thread to its CPU */
+static void pin_thread(int id)
+{
+#ifdef __linux__
+    cpu_set_t allowed, set;
+    int cpu, res;
+
+    res = sched_getaffinity(0, sizeof(allowed), &allowed);
+    if (res == -1) {
+        log_message(LOG_ERR, "sched_getaffinity: %s\n", strerror(errno));
+        return;
+    }
+    cpu = thread_cpu(&allowed, id);
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (res) {
+        log_message(LOG_ERR, "pthread_setaffinity_np: %s\n", strerror(res));
+        return;
+    }
+    print_verbose(1, "thread %d on CPU %d\n", id, cpu);
+#else
+    if (id == 0)
+        log_message(LOG_ERR, "cpu_affinity is not supported on this system\n");
+#endif
+}
+
+/* With threads pinned to CPUs, have the kernel give each connection to the
+ * thread on the CPU its SYN came in on (or each datagram, to the thread on the
+ * CPU it came in on), so it's all handled in that CPU's cache. A classic BPF
+ * program on each group of listening sockets picks the socket by CPU: the n-th
+ * socket of a group is the one of thread n, as they were bound in that order
+ * (see start_listen_sockets()). With more threads than CPUs, or a socket that
+ * is not in the list (e.g. inherited with other copies), the kernel spreads
+ * them as usual. */
+#define STEER_MAX_THREADS   1024
+static void steer_to_cpu(struct listen_endpoint* listen_sockets, int per_thread,
+                         int num_threads)
+{
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    struct sock_filter code[2 * STEER_MAX_THREADS + 2];
+    struct sock_fprog prog;
+    cpu_set_t allowed;
+    int i, n = 0, res;
+
+    if (num_threads < 2 || num_threads > STEER_MAX_THREADS)
+        return;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 ||
+        num_threads > CPU_COUNT(&allowed))
+        return;
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (i = 0; i < num_threads; i++) {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                 thread_cpu(&allowed, i), 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    /* Out of range: the kernel picks one */
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+    prog.len = n;
+    prog.filter = code;
+
+    for (i = 0; i < per_thread; i++) {
+        res = setsockopt(listen_sockets[i].socketfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                         &prog, sizeof(prog));
+        if (res == -1) {
+            log_message(LOG_ERR, "setsockopt(SO_ATTACH_REUSEPORT_CBPF): %s\n", strerror(errno));
+            return;
+        }
+    }
+    print_verbose(1, "connections steered to the thread of their CPU\n");
+#endif
+}
+
+static void* worker_main(void* arg)
+{
+    struct worker* worker = arg;
+
+    if (cfg.cpu_affinity)
+        pin_thread(worker->id);
+
+    event_loop(worker->listen_sockets, worker->num_addr_listen);
+
+    return NULL;
+}
+
+/* Forking a multi-threaded process would leave each child holding the file
+ * descriptors of every other thread's connections */
+void server_config_check(void)
+{
+    int i;
+
+    for (i = 0; i < cfg.protocols_len; i++) {
+        if (cfg.protocols[i].fork) {
+            log_message(LOG_INFO, "%s: fork is not supported by %s, ignored\n",
+                        cfg.protocols[i].name, server_type);
+            cfg.protocols[i].fork = 0;
+        }
+    }
+}
+
+void main_loop(struct listen_endpoint listen_sockets[], int num_addr_listen)
+{
+    struct worker* workers;
+    int i, res, num_threads, per_thread;
+
+    /* start_listen_sockets() made one copy of each listening socket per
+     * thread, one copy after the other */
+    num_threads = server_threads();
+    per_thread = num_addr_listen / num_threads;
+
+    server_config_check();
+
+    workers = calloc(num_threads, sizeof(*workers));
+    CHECK_ALLOC(workers, "calloc");
+
+    print_verbose(1, "starting %d threads\n", num_threads);
+
+    for (i = 0; i < num_threads; i++) {
+        workers[i].id = i;
+        workers[i].listen_sockets = &listen_sockets[i * per_thread];
+        workers[i].num_addr_listen = per_thread;
+    }
+    if (cfg.cpu_affinity)
+        steer_to_cpu(listen_sockets, per_thread, num_threads);
+
+    /* The main thread runs the first event loop itself */
+    for (i = 1; i < num_threads; i++) {
+        res = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (res) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(res));
+            exit(1);
+        }
+    }
+    worker_main(&workers[0]);
+
+    /* After SIGQUIT, event loops return once their connections are done */
+    for (i = 1; i < num_threads; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+
+void start_shoveler(int listen_socket) {
+    fprintf(stderr, "inetd mode is not supported in threaded mode\n");
+    exit(1);
+}
+
+
+/* The actual main is in common.c: it's the same for all versions of
+ * the server
+ */
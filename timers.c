@@ -0,0 +1,206 @@
+/*
+# timers.c: hierarchical timer wheel
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <limits.h>
+#include <time.h>
+
+#include "common.h"
+#include "timers.h"
+
+#define LVL_MASK    (TIMERS_LVL_SIZE - 1)
+/* Farthest a timer can be placed; timers further away than this get placed
+ * there, and are placed again when that slot cascades */
+#define MAX_DELTA   ((1ULL << (TIMERS_LVL_BITS * TIMERS_LEVELS)) - 1)
+
+uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timers_init(struct timer_wheel* tw)
+{
+    int i, j;
+
+    memset(tw, 0, sizeof(*tw));
+    for (i = 0; i < TIMERS_LEVELS; i++) {
+        for (j = 0; j < TIMERS_LVL_SIZE; j++) {
+            tw->slots[i][j].next = &tw->slots[i][j];
+            tw->slots[i][j].prev = &tw->slots[i][j];
+        }
+    }
+    tw->now = monotonic_ms();
+}
+
+static void timer_unlink(struct timer* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/* Links t in the slot that corresponds to its expiry time */
+static void timer_place(struct timer_wheel* tw, struct timer* t)
+{
+    struct timer* head;
+    uint64_t delta, expires;
+    int level;
+
+    expires = t->expires;
+    delta = expires - tw->now;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expires = tw->now + MAX_DELTA;
+    }
+
+    for (level = 0; level < TIMERS_LEVELS - 1; level++) {
+        if (delta < (1ULL << (TIMERS_LVL_BITS * (level + 1))))
+            break;
+    }
+
+    head = &tw->slots[level][(expires >> (TIMERS_LVL_BITS * level)) & LVL_MASK];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void timer_add(struct timer_wheel* tw, struct timer* t, uint64_t delay)
+{
+    if (timer_pending(t))
+        timer_del(tw, t);
+
+    /* Nothing to process in between: catch up with the clock right away */
+    if (!tw->count)
+        tw->now = monotonic_ms();
+
+    t->expires = monotonic_ms() + delay;
+    /* The current tick has been processed already */
+    if (t->expires <= tw->now)
+        t->expires = tw->now + 1;
+
+    timer_place(tw, t);
+    tw->count++;
+}
+
+void timer_del(struct timer_wheel* tw, struct timer* t)
+{
+    if (!timer_pending(t))
+        return;
+
+    timer_unlink(t);
+    tw->count--;
+}
+
+int timer_pending(const struct timer* t)
+{
+    return t->next != NULL;
+}
+
+static int slot_empty(const struct timer* head)
+{
+    return head->next == head;
+}
+
+/* Moves all timers of a slot to where they belong now */
+static void cascade(struct timer_wheel* tw, int level, int index)
+{
+    struct timer *head, *t;
+
+    head = &tw->slots[level][index];
+    while (!slot_empty(head)) {
+        t = head->next;
+        timer_unlink(t);
+        timer_place(tw, t);
+    }
+}
+
+int timers_expire(struct timer_wheel* tw, void (*expire)(struct timer* t, void* arg), void* arg)
+{
+    struct timer *head, *t;
+    uint64_t target = monotonic_ms();
+    int index, level, n = 0;
+
+    while (tw->count && (tw->now < target)) {
+        tw->now++;
+
+        index = tw->now & LVL_MASK;
+        for (level = 1; !index && (level < TIMERS_LEVELS); level++) {
+            index = (tw->now >> (TIMERS_LVL_BITS * level)) & LVL_MASK;
+            cascade(tw, level, index);
+        }
+
+        head = &tw->slots[0][tw->now & LVL_MASK];
+        while (!slot_empty(head)) {
+            t = head->next;
+            timer_unlink(t);
+            tw->count--;
+            n++;
+            expire(t, arg);
+        }
+    }
+
+    /* Nothing to do until the next timer is added */
+    if (!tw->count)
+        tw->now = target;
+
+    return n;
+}
+
+int timers_next(struct timer_wheel* tw)
+{
+    uint64_t best = UINT64_MAX, base, lag;
+    int level, k, shift;
+
+    if (!tw->count)
+        return -1;
+
+    /* Level 0 holds exact expiry times; in the other levels, the best we know
+     * cheaply is when the slot cascades down (which is never after any of its
+     * timers expire) */
+    for (k = 1; k < TIMERS_LVL_SIZE; k++) {
+        if (!slot_empty(&tw->slots[0][(tw->now + k) & LVL_MASK])) {
+            best = k;
+            break;
+        }
+    }
+    for (level = 1; level < TIMERS_LEVELS; level++) {
+        shift = TIMERS_LVL_BITS * level;
+        base = tw->now >> shift;
+        for (k = 1; k <= TIMERS_LVL_SIZE; k++) {
+            if (!slot_empty(&tw->slots[level][(base + k) & LVL_MASK])) {
+                if (((base + k) << shift) - tw->now < best)
+                    best = ((base + k) << shift) - tw->now;
+                break;
+            }
+        }
+    }
+
+    /* Time has passed since the wheel was last advanced */
+    lag = monotonic_ms() - tw->now;
+    if (best <= lag)
+        return 0;
+    best -= lag;
+
+    return best > INT_MAX ? INT_MAX : (int)best;
+}
@@ -0,0 +1,55 @@
+/* API for timers.c: hierarchical timer wheel
+ *
+ * Timers have a resolution of one millisecond and are kept in 4 levels of 64
+ * slots each: level 0 holds timers due in the next 64 ms, level 1 the next
+ * 4 seconds, and so on. Adding, removing and expiring a timer are all
+ * constant-time, whatever the number of timers.
+ * Timers are embedded in the structure they time (e.g. struct connection), so
+ * the wheel never allocates memory.
+ */
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <stdint.h>
+
+#define TIMERS_LVL_BITS     6
+#define TIMERS_LVL_SIZE     (1 << TIMERS_LVL_BITS)
+#define TIMERS_LEVELS       4
+
+struct timer {
+    struct timer *next, *prev;  /* in a wheel slot; next is NULL when idle */
+    uint64_t expires;           /* in ms, on the monotonic_ms() clock */
+    void* data;                 /* for the owner of the timer */
+};
+
+struct timer_wheel {
+    uint64_t now;               /* last tick that has been processed */
+    int count;                  /* number of pending timers */
+    struct timer slots[TIMERS_LEVELS][TIMERS_LVL_SIZE];  /* list heads */
+};
+
+/* Milliseconds since some unspecified point in the past */
+uint64_t monotonic_ms(void);
+
+void timers_init(struct timer_wheel* tw);
+
+/* Arms timer t to expire `delay` ms from now. If t was already armed, it is
+ * moved. */
+void timer_add(struct timer_wheel* tw, struct timer* t, uint64_t delay);
+
+/* Disarms timer t (it's fine if it was not armed) */
+void timer_del(struct timer_wheel* tw, struct timer* t);
+
+/* Returns true if timer t is armed */
+int timer_pending(const struct timer* t);
+
+/* Calls expire() for each timer that has expired (which is disarmed before
+ * the call, so expire() can re-arm it). Returns the number of timers expired. */
+int timers_expire(struct timer_wheel* tw, void (*expire)(struct timer* t, void* arg), void* arg);
+
+/* Returns how many ms until the next timer expires (a bit less if it is still
+ * in a high level), or -1 if no timer is armed. Suitable as a wait timeout. */
+int timers_next(struct timer_wheel* tw);
+
+#endif
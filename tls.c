@@ -34,42 +34,77 @@
 #include "tls.h"
 #include "sslh-conf.h"
 
-#define TLS_HEADER_LEN 5
-#define TLS_HANDSHAKE_CONTENT_TYPE 0x16
 #define TLS_HANDSHAKE_TYPE_CLIENT_HELLO 0x01
 
 #ifndef MIN
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #endif
 
-typedef struct {
-    int tls_match_sni : 1;
-    int tls_match_alpn : 1;
-} TLS_MATCHMODE;
+/* Names (SNI host names or ALPN protocols) are compiled for all the tls
+ * protocols together: looking up a name yields the set of tls protocols it
+ * matches, as a bitmask indexed by tls protocol id. */
+#define TLS_MAX_PROTOCOLS 64
+
+/* Reversed-label trie of SNI names: the node for "example.com" is child
+ * "example" of child "com" of the root */
+struct sni_node {
+    const char* label;
+    size_t label_len;
+    uint64_t exact;             /* protocols with this name */
+    uint64_t wildcard;          /* protocols with "*." followed by this name */
+    struct sni_node *children;  /* sorted, see label_cmp() */
+    int num_children;
+};
+
+/* Patterns that are not just names, matched with fnmatch() */
+struct glob {
+    const char* pattern;
+    uint64_t protocols;
+};
+
+struct alpn_entry {
+    const char* name;           /* NULL for an empty slot */
+    size_t len;
+    uint64_t protocols;
+};
 
 struct TLSProtocol {
-    TLS_MATCHMODE match_mode;
+    int id;                     /* bit in the masks */
     int sni_list_len;
     const char** sni_hostname_list;
     int alpn_list_len;
     const char** alpn_protocol_list;
 };
 
-static int parse_extensions(const struct TLSProtocol *, const char *, size_t);
-static int parse_server_name_extension(const struct TLSProtocol *, const char *, size_t);
-static int parse_alpn_extension(const struct TLSProtocol *, const char *, size_t);
-static int has_match(const char**, size_t, const char*, size_t);
+static struct {
+    uint64_t match_any;         /* protocols with no SNI nor ALPN list */
+    uint64_t match_sni;         /* protocols with a SNI list only */
+    uint64_t match_alpn;        /* protocols with an ALPN list only */
+    uint64_t match_both;        /* protocols with both */
+
+    struct sni_node sni_root;
+    struct glob* sni_globs;
+    int num_sni_globs;
+
+    struct alpn_entry* alpn;    /* open addressing hash table */
+    size_t alpn_size;           /* power of 2 */
+    struct glob* alpn_globs;
+    int num_alpn_globs;
+} matcher;
+
+static uint64_t parse_extensions(const char *, size_t);
+static int parse_server_name_extension(const char *, size_t, uint64_t *);
+static int parse_alpn_extension(const char *, size_t, uint64_t *);
 
 /* Parse a TLS packet for the Server Name Indication and ALPN extension in the client
- * hello handshake, returning a status code
+ * hello handshake, for all the tls protocols at once, returning a status code
  *
  * Returns:
- * 0: no match
- * 1: match
+ * 1: it's TLS, and *matches is set to the tls protocols that match
  *  < 0:  error code (see tls.h)
  */
 int
-parse_tls_header(const struct TLSProtocol *tls_data, const char *data, size_t data_len) {
+parse_tls_header(const char *data, size_t data_len, uint64_t *matches) {
     char tls_content_type;
     char tls_version_major;
     char tls_version_minor;
@@ -82,15 +117,15 @@ parse_tls_header(const struct TLSProtocol *tls_data, const char *data, size_t da
 
     tls_content_type = data[0];
     if (tls_content_type != TLS_HANDSHAKE_CONTENT_TYPE) {
-        if (cfg.verbose) fprintf(stderr, "Request did not begin with TLS handshake.\n");
+        print_verbose(1, "Request did not begin with TLS handshake.\n");
         return TLS_EPROTOCOL;
     }
 
     tls_version_major = data[1];
     tls_version_minor = data[2];
     if (tls_version_major < 3) {
-        if (cfg.verbose) fprintf(stderr, "Received SSL %d.%d handshake which cannot be parsed.\n",
-              tls_version_major, tls_version_minor);
+        print_verbose(1, "Received SSL %d.%d handshake which cannot be parsed.\n",
+                      tls_version_major, tls_version_minor);
 
         return TLS_EVERSION;
     }
@@ -111,7 +146,7 @@ parse_tls_header(const struct TLSProtocol *tls_data, const char *data, size_t da
         return TLS_EPROTOCOL;
     }
     if (data[pos] != TLS_HANDSHAKE_TYPE_CLIENT_HELLO) {
-        if (cfg.verbose) fprintf(stderr, "Not a client hello\n");
+        print_verbose(1, "Not a client hello\n");
 
         return TLS_EPROTOCOL;
     }
@@ -144,7 +179,7 @@ parse_tls_header(const struct TLSProtocol *tls_data, const char *data, size_t da
     pos += 1 + len;
 
     if (pos == data_len && tls_version_major == 3 && tls_version_minor == 0) {
-        if (cfg.verbose) fprintf(stderr, "Received SSL 3.0 handshake without extensions\n");
+        print_verbose(1, "Received SSL 3.0 handshake without extensions\n");
         return TLS_EVERSION;
     }
 
@@ -157,24 +192,21 @@ parse_tls_header(const struct TLSProtocol *tls_data, const char *data, size_t da
     if (pos + len > data_len)
         return TLS_EPROTOCOL;
 
-    /* By now we know it's TLS. if SNI or ALPN is set, parse extensions to see if
-     * they match. Otherwise, it's a match already */
-    if (tls_data && 
-        (tls_data->match_mode.tls_match_alpn || tls_data->match_mode.tls_match_sni)) {
-        return parse_extensions(tls_data, data + pos, len);
-    } else {
-        return TLS_MATCH;
-    }
+    /* By now we know it's TLS. Protocols without SNI or ALPN lists match
+     * already; parse extensions to see which of the others do */
+    *matches = matcher.match_any;
+    if (matcher.match_sni | matcher.match_alpn | matcher.match_both)
+        *matches |= parse_extensions(data + pos, len);
+
+    return TLS_MATCH;
 }
 
-static int
-parse_extensions(const struct TLSProtocol *tls_data, const char *data, size_t data_len) {
+static uint64_t
+parse_extensions(const char *data, size_t data_len) {
     size_t pos = 0;
     size_t len;
-    int sni_match = 0, alpn_match = 0;
-
-    if (tls_data == NULL)
-        return TLS_EINVAL;
+    uint64_t sni_match = 0, alpn_match = 0;
+    int res;
 
     /* Parse each 4 bytes for the extension header */
     while (pos + 4 <= data_len) {
@@ -183,17 +215,17 @@ parse_extensions(const struct TLSProtocol *tls_data, const char *data, size_t da
               (unsigned char) data[pos + 3];
 
         if (pos + 4 + len > data_len)
-            return TLS_EPROTOCOL;
+            return 0;
 
         size_t extension_type = ((unsigned char) data[pos] << 8) +
                                 (unsigned char) data[pos + 1];
 
-        if (extension_type == 0x00 && tls_data->match_mode.tls_match_sni) { /* Server Name */
-            sni_match = parse_server_name_extension(tls_data, data + pos + 4, len);
-            if (sni_match < 0) return sni_match;
-        } else if (extension_type == 0x10 && tls_data->match_mode.tls_match_alpn) { /* ALPN */
-            alpn_match = parse_alpn_extension(tls_data, data + pos + 4, len);
-            if (alpn_match < 0) return alpn_match;
+        if (extension_type == 0x00 && (matcher.match_sni | matcher.match_both)) { /* Server Name */
+            res = parse_server_name_extension(data + pos + 4, len, &sni_match);
+            if (res < 0) sni_match = 0;
+        } else if (extension_type == 0x10 && (matcher.match_alpn | matcher.match_both)) { /* ALPN */
+            res = parse_alpn_extension(data + pos + 4, len, &alpn_match);
+            if (res < 0) alpn_match = 0;
         }
 
         pos += 4 + len; /* Advance to the next extension header */
@@ -201,15 +233,127 @@ parse_extensions(const struct TLSProtocol *tls_data, const char *data, size_t da
 
     /* Check we ended where we expected to */
     if (pos != data_len)
-        return TLS_EPROTOCOL;
+        return 0;
+
+    return (matcher.match_both & sni_match & alpn_match)
+        | (matcher.match_alpn & alpn_match)
+        | (matcher.match_sni & sni_match);
+}
+
+/* Compares a label with a trie node's; the order only needs to be consistent */
+static int
+label_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    if (a_len != b_len)
+        return a_len < b_len ? -1 : 1;
+    return memcmp(a, b, a_len);
+}
+
+static struct sni_node *
+sni_child(const struct sni_node *node, const char *label, size_t len) {
+    int lo = 0, hi = node->num_children - 1, mid, cmp;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        cmp = label_cmp(label, len, node->children[mid].label, node->children[mid].label_len);
+        if (!cmp)
+            return &node->children[mid];
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
 
-    return (sni_match && alpn_match) 
-        || (!tls_data->match_mode.tls_match_sni && alpn_match)
-        || (!tls_data->match_mode.tls_match_alpn && sni_match);
+static uint64_t
+glob_match(const struct glob *globs, int num_globs, const char *name, size_t name_len) {
+    char name_nullterminated[256];
+    uint64_t res = 0;
+    int i;
+
+    /* Both SNI host names and ALPN protocols fit, unless the client sends
+     * garbage */
+    if (!num_globs || name_len >= sizeof(name_nullterminated))
+        return 0;
+    memcpy(name_nullterminated, name, name_len);
+    name_nullterminated[name_len] = '\0';
+
+    for (i = 0; i < num_globs; i++) {
+        if (!fnmatch(globs[i].pattern, name_nullterminated, 0))
+            res |= globs[i].protocols;
+    }
+    return res;
+}
+
+/* Returns the protocols whose SNI list matches name */
+static uint64_t
+sni_match(const char *name, size_t name_len) {
+    const struct sni_node *node = &matcher.sni_root;
+    uint64_t res = 0;
+    size_t start, end = name_len;
+
+    /* Walk the labels from the last one */
+    while (node) {
+        for (start = end; start > 0 && name[start - 1] != '.'; start--)
+            /* nothing */;
+
+        node = sni_child(node, name + start, end - start);
+        if (!node)
+            break;
+
+        if (!start) {
+            res |= node->exact;
+            break;
+        }
+        res |= node->wildcard;
+        end = start - 1;
+    }
+
+    res |= glob_match(matcher.sni_globs, matcher.num_sni_globs, name, name_len);
+
+    print_verbose(1, "SNI [%.*s] matches %#llx\n", (int)name_len, name,
+                  (unsigned long long)res);
+    return res;
+}
+
+static size_t
+alpn_hash(const char *name, size_t len) {
+    size_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct alpn_entry *
+alpn_slot(const char *name, size_t len) {
+    size_t i = alpn_hash(name, len) & (matcher.alpn_size - 1);
+
+    while (matcher.alpn[i].name &&
+           label_cmp(name, len, matcher.alpn[i].name, matcher.alpn[i].len))
+        i = (i + 1) & (matcher.alpn_size - 1);
+    return &matcher.alpn[i];
+}
+
+/* Returns the protocols whose ALPN list matches name */
+static uint64_t
+alpn_match(const char *name, size_t len) {
+    uint64_t res = 0;
+
+    if (matcher.alpn_size)
+        res = alpn_slot(name, len)->protocols;
+    res |= glob_match(matcher.alpn_globs, matcher.num_alpn_globs, name, len);
+
+    print_verbose(1, "ALPN [%.*s] matches %#llx\n", (int)len, name,
+                  (unsigned long long)res);
+    return res;
 }
 
 static int
-parse_server_name_extension(const struct TLSProtocol *tls_data, const char *data, size_t data_len) {
+parse_server_name_extension(const char *data, size_t data_len, uint64_t *match) {
     size_t pos = 2; /* skip server name list length */
     size_t len;
 
@@ -222,14 +366,11 @@ parse_server_name_extension(const struct TLSProtocol *tls_data, const char *data
 
         switch (data[pos]) { /* name type */
             case 0x00: /* host_name */
-                if(has_match(tls_data->sni_hostname_list, tls_data->sni_list_len, data + pos + 3, len)) {
-                    return len;
-                } else {
-                    return TLS_ENOEXT;
-                }
+                *match = sni_match(data + pos + 3, len);
+                return len;
             default:
-                if (cfg.verbose) fprintf(stderr, "Unknown server name extension name type: %d\n",
-                      data[pos]);
+                print_verbose(1, "Unknown server name extension name type: %d\n",
+                              data[pos]);
         }
         pos += 3 + len;
     }
@@ -241,9 +382,10 @@ parse_server_name_extension(const struct TLSProtocol *tls_data, const char *data
 }
 
 static int
-parse_alpn_extension(const struct TLSProtocol *tls_data, const char *data, size_t data_len) {
+parse_alpn_extension(const char *data, size_t data_len, uint64_t *match) {
     size_t pos = 2;
     size_t len;
+    uint64_t res = 0;
 
     while (pos + 1 < data_len) {
         len = (unsigned char)data[pos];
@@ -251,39 +393,16 @@ parse_alpn_extension(const struct TLSProtocol *tls_data, const char *data, size_
         if (pos + 1 + len > data_len)
             return TLS_EPROTOCOL;
 
-        if (len > 0 && has_match(tls_data->alpn_protocol_list, tls_data->alpn_list_len, data + pos + 1, len)) {
-            return len;
-        } else if (len > 0) {
-            if (cfg.verbose) fprintf(stderr, "Unknown ALPN name: %.*s\n", (int)len, data + pos + 1);
-        }
+        if (len > 0)
+            res |= alpn_match(data + pos + 1, len);
         pos += 1 + len;
     }
     /* Check we ended where we expected to */
     if (pos != data_len)
         return TLS_EPROTOCOL;
 
-    return TLS_ENOEXT;
-}
-
-static int
-has_match(const char** list, size_t list_len, const char* name, size_t name_len) {
-    const char **item;
-    int i;
-    char *name_nullterminated = malloc(name_len+1);
-    CHECK_ALLOC(name_nullterminated, "malloc");
-    memcpy(name_nullterminated, name, name_len);
-    name_nullterminated[name_len]='\0';
-
-    for (i = 0; i < list_len; i++) {
-        item = &list[i];
-        if (cfg.verbose) fprintf(stderr, "matching [%.*s] with [%s]\n", (int)name_len, name, *item);
-        if(!fnmatch(*item, name_nullterminated, 0)) {
-            free(name_nullterminated);
-            return 1;
-        }
-    }
-    free(name_nullterminated);
-    return 0;
+    *match = res;
+    return res ? TLS_MATCH : TLS_ENOEXT;
 }
 
 struct TLSProtocol *
@@ -301,12 +420,168 @@ tls_data_set_list(struct TLSProtocol *tls_data, int alpn, const char** list, siz
     if (alpn) {
         tls_data->alpn_protocol_list = list;
         tls_data->alpn_list_len = list_len;
-        tls_data->match_mode.tls_match_alpn = 1;
     } else {
         tls_data->sni_hostname_list = list;
         tls_data->sni_list_len = list_len;
-        tls_data->match_mode.tls_match_sni = 1;
     }
 
     return tls_data;
 }
+
+void
+tls_data_free(struct TLSProtocol *tls_data) {
+    free(tls_data);
+}
+
+int
+tls_data_matches(const struct TLSProtocol *tls_data, uint64_t matches) {
+    return (matches >> tls_data->id) & 1;
+}
+
+/* Names without any fnmatch() special character */
+static int
+is_plain(const char *name) {
+    return !strpbrk(name, "*?[\\");
+}
+
+static void
+add_glob(struct glob **globs, int *num_globs, const char *pattern, int id) {
+    int i;
+
+    for (i = 0; i < *num_globs; i++) {
+        if (!strcmp((*globs)[i].pattern, pattern)) {
+            (*globs)[i].protocols |= 1ULL << id;
+            return;
+        }
+    }
+    *globs = realloc(*globs, (*num_globs + 1) * sizeof(**globs));
+    CHECK_ALLOC(*globs, "realloc");
+    (*globs)[*num_globs].pattern = pattern;
+    (*globs)[*num_globs].protocols = 1ULL << id;
+    (*num_globs)++;
+}
+
+/* Adds a plain name (or a wildcard if `wildcard`) to the SNI trie */
+static void
+sni_add(const char *name, int wildcard, int id) {
+    struct sni_node *node = &matcher.sni_root, *child;
+    size_t start, end = strlen(name);
+    int i;
+
+    while (1) {
+        for (start = end; start > 0 && name[start - 1] != '.'; start--)
+            /* nothing */;
+
+        child = sni_child(node, name + start, end - start);
+        if (!child) {
+            /* Insert, keeping children sorted */
+            node->children = realloc(node->children, (node->num_children + 1) * sizeof(*node->children));
+            CHECK_ALLOC(node->children, "realloc");
+            for (i = node->num_children; i > 0; i--) {
+                child = &node->children[i - 1];
+                if (label_cmp(name + start, end - start, child->label, child->label_len) > 0)
+                    break;
+                node->children[i] = *child;
+            }
+            child = &node->children[i];
+            memset(child, 0, sizeof(*child));
+            child->label = name + start;
+            child->label_len = end - start;
+            node->num_children++;
+        }
+        node = child;
+
+        if (!start)
+            break;
+        end = start - 1;
+    }
+
+    if (wildcard)
+        node->wildcard |= 1ULL << id;
+    else
+        node->exact |= 1ULL << id;
+}
+
+static void
+alpn_add(const char *name, int id) {
+    struct alpn_entry *entry = alpn_slot(name, strlen(name));
+
+    entry->name = name;
+    entry->len = strlen(name);
+    entry->protocols |= 1ULL << id;
+}
+
+static void
+sni_free(struct sni_node *node) {
+    int i;
+
+    for (i = 0; i < node->num_children; i++)
+        sni_free(&node->children[i]);
+    free(node->children);
+}
+
+void
+tls_compile_matchers(void) {
+    struct TLSProtocol *tls_data;
+    const char *name;
+    int i, j, id = 0, num_alpn = 0;
+
+    sni_free(&matcher.sni_root);
+    free(matcher.sni_globs);
+    free(matcher.alpn);
+    free(matcher.alpn_globs);
+    memset(&matcher, 0, sizeof(matcher));
+
+    for (i = 0; i < cfg.protocols_len; i++) {
+        if (strcmp(cfg.protocols[i].name, "tls") || !cfg.protocols[i].data)
+            continue;
+        if (id == TLS_MAX_PROTOCOLS) {
+            fprintf(stderr, "too many tls protocols (at most %d)\n", TLS_MAX_PROTOCOLS);
+            exit(1);
+        }
+        tls_data = cfg.protocols[i].data;
+        tls_data->id = id++;
+        num_alpn += tls_data->alpn_list_len;
+    }
+
+    /* Keep the load factor under 1/2 */
+    if (num_alpn) {
+        for (matcher.alpn_size = 4; matcher.alpn_size < 2 * num_alpn; matcher.alpn_size *= 2)
+            /* nothing */;
+        matcher.alpn = calloc(matcher.alpn_size, sizeof(*matcher.alpn));
+        CHECK_ALLOC(matcher.alpn, "calloc");
+    }
+
+    for (i = 0; i < cfg.protocols_len; i++) {
+        if (strcmp(cfg.protocols[i].name, "tls") || !cfg.protocols[i].data)
+            continue;
+        tls_data = cfg.protocols[i].data;
+
+        if (tls_data->sni_list_len && tls_data->alpn_list_len)
+            matcher.match_both |= 1ULL << tls_data->id;
+        else if (tls_data->sni_list_len)
+            matcher.match_sni |= 1ULL << tls_data->id;
+        else if (tls_data->alpn_list_len)
+            matcher.match_alpn |= 1ULL << tls_data->id;
+        else
+            matcher.match_any |= 1ULL << tls_data->id;
+
+        for (j = 0; j < tls_data->sni_list_len; j++) {
+            name = tls_data->sni_hostname_list[j];
+            if (*name && is_plain(name))
+                sni_add(name, 0, tls_data->id);
+            else if (!strncmp(name, "*.", 2) && name[2] && is_plain(name + 2))
+                sni_add(name + 2, 1, tls_data->id);
+            else
+                add_glob(&matcher.sni_globs, &matcher.num_sni_globs, name, tls_data->id);
+        }
+
+        for (j = 0; j < tls_data->alpn_list_len; j++) {
+            name = tls_data->alpn_protocol_list[j];
+            if (is_plain(name))
+                alpn_add(name, tls_data->id);
+            else
+                add_glob(&matcher.alpn_globs, &matcher.num_alpn_globs, name, tls_data->id);
+        }
+    }
+}
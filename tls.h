@@ -30,10 +30,20 @@
 
 struct TLSProtocol;
 
-int parse_tls_header(const struct TLSProtocol *tls_data, const char *data, size_t data_len);
+int parse_tls_header(const char *data, size_t data_len, uint64_t *matches);
 
 struct TLSProtocol *new_tls_data();
 struct TLSProtocol *tls_data_set_list(struct TLSProtocol *, int, const char**, size_t);
+/* The lists belong to the configuration, and are not freed. NULL is ignored. */
+void tls_data_free(struct TLSProtocol *);
+
+/* Compiles the SNI and ALPN lists of all the tls protocols into one matcher (a
+ * trie of host names, and a hash table of ALPN protocols). Must be called once
+ * all tls protocols are set up, before any call to parse_tls_header(). */
+void tls_compile_matchers(void);
+
+/* Returns true if the tls protocol is in the matches of parse_tls_header() */
+int tls_data_matches(const struct TLSProtocol *, uint64_t matches);
 
 #define TLS_MATCH       1
 #define TLS_NOMATCH     0
@@ -44,5 +54,8 @@ struct TLSProtocol *tls_data_set_list(struct TLSProtocol *, int, const char**, s
 #define TLS_ENOEXT      -4 /* No ALPN or SNI extension found */
 #define TLS_EPROTOCOL   -5 /* Protocol error */
 
+#define TLS_HEADER_LEN 5
+#define TLS_HANDSHAKE_CONTENT_TYPE 0x16
+
 
 #endif
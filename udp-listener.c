@@ -0,0 +1,581 @@
+/*
+# udp-listener.c: UDP flow table and forwarding
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include "common.h"
+#include <netinet/udp.h>
+#include "probe.h"
+#include "watchers.h"
+#include "timers.h"
+#include "udp-listener.h"
+#include "backends.h"
+
+/* Initial number of hash buckets; must be a power of 2 */
+#define FLOW_BUCKETS_INIT 64
+
+/* A flow is handled as a connection in state ST_UDP: q[0] is the listening
+ * socket (shared by all the flows of that listener), and q[1] a socket
+ * connect()ed to the target, so the kernel sorts out which flow replies
+ * belong to. */
+struct udp_flow {
+    struct connection cnx;          /* must be first */
+    struct udp_listener* listener;
+
+    struct sockaddr_storage addr;   /* normalised source address */
+    socklen_t addrlen;
+    uint64_t last_active;           /* in ms, on the monotonic_ms() clock */
+
+    struct udp_flow* hash_next;     /* in the same bucket */
+    struct udp_flow *lru_prev, *lru_next;
+};
+
+/* Flows are hashed on their source address, and also kept in a list ordered
+ * by last activity: the least recently active flow is always first, so
+ * reaping only ever looks at flows that have expired. */
+struct flow_table {
+    struct udp_flow** buckets;
+    unsigned num_buckets;   /* power of 2 */
+    unsigned count;
+    uint32_t seed;          /* so remote hosts can't pick colliding addresses */
+    struct udp_flow lru;    /* list head */
+};
+
+/* Copies the significant part of an address to a zeroed sockaddr_storage, so
+ * that two addresses of the same source always compare (and hash) equal,
+ * whatever the padding or IPv6 flow label. Returns the length of the result,
+ * or 0 for unsupported families. */
+static socklen_t normalise_addr(struct sockaddr_storage* out, const struct sockaddr_storage* in)
+{
+    memset(out, 0, sizeof(*out));
+    out->ss_family = in->ss_family;
+
+    switch (in->ss_family) {
+    case AF_INET: {
+        struct sockaddr_in *o = (struct sockaddr_in*)out, *i = (struct sockaddr_in*)in;
+        o->sin_port = i->sin_port;
+        o->sin_addr = i->sin_addr;
+        return sizeof(*o);
+    }
+    case AF_INET6: {
+        struct sockaddr_in6 *o = (struct sockaddr_in6*)out, *i = (struct sockaddr_in6*)in;
+        o->sin6_port = i->sin6_port;
+        o->sin6_addr = i->sin6_addr;
+        o->sin6_scope_id = i->sin6_scope_id;
+        return sizeof(*o);
+    }
+    default:
+        return 0;
+    }
+}
+
+/* FNV-1a */
+static uint32_t hash_addr(struct flow_table* table, const struct sockaddr_storage* addr, socklen_t len)
+{
+    const unsigned char* p = (const unsigned char*)addr;
+    uint32_t h = 2166136261u ^ table->seed;
+    socklen_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void flow_table_init(struct flow_table* table)
+{
+    memset(table, 0, sizeof(*table));
+    table->num_buckets = FLOW_BUCKETS_INIT;
+    table->buckets = calloc(table->num_buckets, sizeof(*table->buckets));
+    CHECK_ALLOC(table->buckets, "calloc");
+    table->seed = (uint32_t)monotonic_ms() ^ ((uint32_t)getpid() << 16);
+    table->lru.lru_next = table->lru.lru_prev = &table->lru;
+}
+
+static struct udp_flow* flow_lookup(struct flow_table* table, const struct sockaddr_storage* addr, socklen_t len)
+{
+    struct udp_flow* flow;
+
+    flow = table->buckets[hash_addr(table, addr, len) & (table->num_buckets - 1)];
+    for (; flow; flow = flow->hash_next) {
+        if ((flow->addrlen == len) && !memcmp(&flow->addr, addr, len))
+            return flow;
+    }
+    return NULL;
+}
+
+/* Doubles the number of buckets. If that fails, we just carry on with longer
+ * chains. */
+static void flow_table_grow(struct flow_table* table)
+{
+    struct udp_flow **new_buckets, *flow, *next;
+    unsigned i, n = table->num_buckets * 2;
+    uint32_t h;
+
+    new_buckets = calloc(n, sizeof(*new_buckets));
+    if (!new_buckets)
+        return;
+
+    for (i = 0; i < table->num_buckets; i++) {
+        for (flow = table->buckets[i]; flow; flow = next) {
+            next = flow->hash_next;
+            h = hash_addr(table, &flow->addr, flow->addrlen) & (n - 1);
+            flow->hash_next = new_buckets[h];
+            new_buckets[h] = flow;
+        }
+    }
+    free(table->buckets);
+    table->buckets = new_buckets;
+    table->num_buckets = n;
+}
+
+static void lru_unlink(struct udp_flow* flow)
+{
+    flow->lru_prev->lru_next = flow->lru_next;
+    flow->lru_next->lru_prev = flow->lru_prev;
+}
+
+/* Marks the flow as the most recently active */
+static void flow_touch(struct flow_table* table, struct udp_flow* flow)
+{
+    flow->last_active = monotonic_ms();
+    lru_unlink(flow);
+    flow->lru_prev = table->lru.lru_prev;
+    flow->lru_next = &table->lru;
+    table->lru.lru_prev->lru_next = flow;
+    table->lru.lru_prev = flow;
+}
+
+static void flow_insert(struct flow_table* table, struct udp_flow* flow)
+{
+    uint32_t h;
+
+    if (table->count >= table->num_buckets)
+        flow_table_grow(table);
+
+    h = hash_addr(table, &flow->addr, flow->addrlen) & (table->num_buckets - 1);
+    flow->hash_next = table->buckets[h];
+    table->buckets[h] = flow;
+
+    flow->lru_prev = flow->lru_next = flow;
+    flow_touch(table, flow);
+    table->count++;
+}
+
+static void flow_remove(struct flow_table* table, struct udp_flow* flow)
+{
+    struct udp_flow** p;
+
+    p = &table->buckets[hash_addr(table, &flow->addr, flow->addrlen) & (table->num_buckets - 1)];
+    while (*p != flow)
+        p = &(*p)->hash_next;
+    *p = flow->hash_next;
+
+    lru_unlink(flow);
+    table->count--;
+}
+
+/* Datagrams are moved in batches of UDP_BATCH, with one system call per
+ * batch where the system has recvmmsg()/sendmmsg() */
+#define UDP_BATCH   32
+/* Theoritical max is 65507 (https://en.wikipedia.org/wiki/User_Datagram_Protocol),
+ * and that's also the most a GRO datagram can hold. Buffers are allocated
+ * once per listener, so 64K is not that much */
+#define UDP_BUFSIZE 65536
+
+#if !defined(__linux__) && !defined(__FreeBSD__)
+/* Stand-ins for systems without them: one datagram per system call */
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+static int recvmmsg(int sockfd, struct mmsghdr* msgs, unsigned int vlen, int flags, void* timeout)
+{
+    ssize_t res;
+    unsigned i;
+
+    for (i = 0; i < vlen; i++) {
+        res = recvmsg(sockfd, &msgs[i].msg_hdr, flags);
+        if (res < 0)
+            return i ? (int)i : -1;
+        msgs[i].msg_len = res;
+    }
+    return vlen;
+}
+
+static int sendmmsg(int sockfd, struct mmsghdr* msgs, unsigned int vlen, int flags)
+{
+    ssize_t res;
+    unsigned i;
+
+    for (i = 0; i < vlen; i++) {
+        res = sendmsg(sockfd, &msgs[i].msg_hdr, flags);
+        if (res < 0)
+            return i ? (int)i : -1;
+        msgs[i].msg_len = res;
+    }
+    return vlen;
+}
+#endif
+
+struct udp_batch {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_storage addr[UDP_BATCH];
+    int gso_size[UDP_BATCH];    /* segment size of GRO datagrams, or 0 */
+    char control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    char* data;                 /* UDP_BATCH buffers of UDP_BUFSIZE */
+    int num;                    /* number of datagrams held */
+};
+
+struct udp_listener {
+    int sockfd;
+    struct watchers* watchers;
+    struct flow_table table;
+    struct udp_batch in;        /* datagrams from sources */
+    struct udp_batch out;       /* replies, sent at the end of each event batch */
+};
+
+static void udp_batch_init(struct udp_batch* batch)
+{
+    int i;
+
+    memset(batch, 0, sizeof(*batch));
+    batch->data = malloc(UDP_BATCH * UDP_BUFSIZE);
+    CHECK_ALLOC(batch->data, "malloc");
+    for (i = 0; i < UDP_BATCH; i++) {
+        batch->iov[i].iov_base = batch->data + i * UDP_BUFSIZE;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+/* Asks the kernel to coalesce datagrams of the same flow, if configured */
+static void set_gro(int sockfd)
+{
+#ifdef UDP_GRO
+    int one = 1, res;
+
+    if (!cfg.udp_gro) return;
+    res = setsockopt(sockfd, SOL_UDP, UDP_GRO, &one, sizeof(one));
+    if (res == -1)
+        print_verbose(1, "setsockopt(UDP_GRO): %s\n", strerror(errno));
+#endif
+}
+
+/* Receives as many datagrams as are waiting on sockfd and fit in slots
+ * [batch->num, UDP_BATCH) of the batch. If with_addr, source addresses are
+ * stored in the batch. Returns the number of datagrams received. */
+static int udp_recv_batch(int sockfd, struct udp_batch* batch, int with_addr)
+{
+    struct msghdr* hdr;
+    struct cmsghdr* cmsg;
+    int i, n, first = batch->num;
+
+    for (i = first; i < UDP_BATCH; i++) {
+        hdr = &batch->msgs[i].msg_hdr;
+        hdr->msg_name = with_addr ? &batch->addr[i] : NULL;
+        hdr->msg_namelen = with_addr ? sizeof(batch->addr[i]) : 0;
+        hdr->msg_control = batch->control[i];
+        hdr->msg_controllen = sizeof(batch->control[i]);
+        hdr->msg_flags = 0;
+        batch->iov[i].iov_len = UDP_BUFSIZE;
+    }
+
+    n = recvmmsg(sockfd, &batch->msgs[first], UDP_BATCH - first, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && cfg.verbose)
+            perror("recvmmsg");
+        return 0;
+    }
+
+    for (i = first; i < first + n; i++) {
+        hdr = &batch->msgs[i].msg_hdr;
+        batch->iov[i].iov_len = batch->msgs[i].msg_len;
+        batch->gso_size[i] = 0;
+#ifdef UDP_GRO
+        for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                memcpy(&batch->gso_size[i], CMSG_DATA(cmsg), sizeof(int));
+        }
+#else
+        (void)cmsg;
+#endif
+    }
+    batch->num += n;
+    return n;
+}
+
+/* Readies datagram i of the batch for sending to addr: GRO datagrams are
+ * sent as they are, and split again by the kernel (or the NIC) */
+static void udp_prepare_send(struct udp_batch* batch, int i, void* addr, socklen_t addrlen)
+{
+    struct msghdr* hdr = &batch->msgs[i].msg_hdr;
+
+    hdr->msg_name = addr;
+    hdr->msg_namelen = addrlen;
+    hdr->msg_control = NULL;
+    hdr->msg_controllen = 0;
+#ifdef UDP_SEGMENT
+    if (batch->gso_size[i] && batch->gso_size[i] < (int)batch->iov[i].iov_len) {
+        struct cmsghdr* cmsg;
+        uint16_t gso_size = batch->gso_size[i];
+
+        hdr->msg_control = batch->control[i];
+        hdr->msg_controllen = CMSG_SPACE(sizeof(gso_size));
+        cmsg = CMSG_FIRSTHDR(hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+        memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+#endif
+}
+
+/* Sends datagrams [first, first+n) of the batch on sockfd. Datagrams that
+ * can't be sent are dropped, as a router would. */
+static void udp_send_batch(int sockfd, struct udp_batch* batch, int first, int n)
+{
+    int res;
+
+    while (n > 0) {
+        res = sendmmsg(sockfd, &batch->msgs[first], n, 0);
+        if (res <= 0) {
+            print_verbose(1, "sendmmsg on fd %d: %s\n", sockfd, strerror(errno));
+            res = 1;
+        }
+        first += res;
+        n -= res;
+    }
+}
+
+/* Finds the flow a datagram from src belongs to, creating it if the datagram
+ * probes successfully. Returns NULL if the datagram should be dropped. */
+static struct udp_flow* flow_get(struct udp_listener* l, struct sockaddr_storage* src,
+                                 char* data, int len)
+{
+    char addr_str[NI_MAXHOST+1+NI_MAXSERV+1];
+    struct sslhcfg_protocols_item* proto;
+    struct probe_state probe_state;
+    struct sockaddr_storage key;
+    struct addrinfo addrinfo;
+    struct udp_flow* flow;
+    struct backend* b;
+    struct addr_list* addrs;
+    socklen_t keylen;
+    int res, sock;
+
+    keylen = normalise_addr(&key, src);
+    if (!keylen) return NULL;
+
+    flow = flow_lookup(&l->table, &key, keylen);
+    if (VERBOSE_MAX >= 1 && cfg.verbose) {
+        addrinfo.ai_addr = (struct sockaddr*)&key;
+        addrinfo.ai_addrlen = keylen;
+        fprintf(stderr, "received %d UDP from %s (%s flow)\n", len,
+                sprintaddr(addr_str, sizeof(addr_str), &addrinfo),
+                flow ? "known" : "new");
+    }
+    if (flow) {
+        flow_touch(&l->table, flow);
+        return flow;
+    }
+
+    memset(&probe_state, 0, sizeof(probe_state));
+    res = probe_buffer(data, len, &probe_state, &proto);
+    /* First version: if we can't work out the protocol from the first
+     * packet, drop it. Conceivably, we could store several packets to
+     * run probes on packet sets */
+    print_verbose(1, "UDP probed: %d\n", res);
+    if (res != PROBE_MATCH) return NULL;
+
+    flow = malloc(sizeof(*flow));
+    if (!flow) {
+        log_message(LOG_ERR, "malloc: %s -- dropping UDP packet\n", strerror(errno));
+        return NULL;
+    }
+    init_cnx(&flow->cnx);
+    flow->cnx.state = ST_UDP;
+    flow->cnx.proto = proto;
+    flow->cnx.config = config_get();
+    flow->listener = l;
+    flow->addr = key;
+    flow->addrlen = keylen;
+
+    /* No failover in UDP: the first address of the target it is */
+    b = backend_choose(proto, backend_hash_addr((struct sockaddr*)&key), 0);
+    flow->cnx.backend = b;
+    addrs = addr_list_get(b);
+    sock = socket(addrs->ai->ai_family, SOCK_DGRAM, 0);
+    if (sock == -1) {
+        log_message(LOG_ERR, "socket: %s -- dropping UDP packet\n", strerror(errno));
+        addr_list_put(addrs);
+        goto fail;
+    }
+    res = connect(sock, addrs->ai->ai_addr, addrs->ai->ai_addrlen);
+    addr_list_put(addrs);
+    if (res == -1) {
+        log_message(LOG_ERR, "connect: %s -- dropping UDP packet\n", strerror(errno));
+        close(sock);
+        goto fail;
+    }
+    set_gro(sock);
+
+    flow->cnx.q[0].fd = l->sockfd;
+    flow->cnx.q[1].fd = sock;
+
+    if (watchers_add_read(l->watchers, sock, &flow->cnx) == -1) {
+        close(sock);
+        goto fail;
+    }
+    flow_insert(&l->table, flow);
+    return flow;
+
+fail:
+    backend_release(&flow->cnx);
+    config_put(flow->cnx.config);
+    free(flow);
+    return NULL;
+}
+
+struct udp_listener* udp_listener_new(int sockfd, struct watchers* w)
+{
+    struct udp_listener* l;
+
+    l = malloc(sizeof(*l));
+    CHECK_ALLOC(l, "malloc");
+    l->sockfd = sockfd;
+    l->watchers = w;
+    flow_table_init(&l->table);
+    udp_batch_init(&l->in);
+    udp_batch_init(&l->out);
+    set_gro(sockfd);
+
+    return l;
+}
+
+/* Consecutive datagrams of the same flow go out in one system call */
+void udp_extern_forward(struct udp_listener* l)
+{
+    struct udp_flow* flows[UDP_BATCH];
+    struct udp_batch* in = &l->in;
+    int i, j, n, len;
+
+    in->num = 0;
+    n = udp_recv_batch(l->sockfd, in, 1);
+
+    for (i = 0; i < n; i++) {
+        /* Probe GRO datagrams on their first segment only */
+        len = in->iov[i].iov_len;
+        if (in->gso_size[i] && in->gso_size[i] < len)
+            len = in->gso_size[i];
+        flows[i] = flow_get(l, &in->addr[i], in->iov[i].iov_base, len);
+        if (flows[i])
+            udp_prepare_send(in, i, NULL, 0);
+    }
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; (j < n) && (flows[j] == flows[i]); j++)
+            /* nothing */;
+        if (flows[i])
+            udp_send_batch(flows[i]->cnx.q[1].fd, in, i, j - i);
+    }
+}
+
+void udp_flush_replies(struct udp_listener* l)
+{
+    udp_send_batch(l->sockfd, &l->out, 0, l->out.num);
+    l->out.num = 0;
+}
+
+void udp_intern_forward(struct connection* cnx)
+{
+    struct udp_flow* flow = (struct udp_flow*)cnx;
+    struct udp_listener* l = flow->listener;
+    int i, first, n;
+
+    if (l->out.num == UDP_BATCH)
+        udp_flush_replies(l);
+
+    first = l->out.num;
+    n = udp_recv_batch(cnx->q[1].fd, &l->out, 0);
+    if (!n) return;
+
+    for (i = first; i < first + n; i++)
+        udp_prepare_send(&l->out, i, &flow->addr, flow->addrlen);
+    flow_touch(&l->table, flow);
+    print_verbose(1, "queued %d UDP replies on fd %d\n", n, cnx->q[1].fd);
+}
+
+int udp_reap_timeouts(struct udp_listener* l)
+{
+    struct flow_table* table = &l->table;
+    struct udp_flow* flow;
+    uint64_t now = monotonic_ms();
+    uint64_t timeout = UDP_TIMEOUT * 1000;
+
+    while (table->count) {
+        flow = table->lru.lru_next;
+        if (flow->last_active + timeout > now)
+            return flow->last_active + timeout - now;
+
+        print_verbose(4, "disconnect UDP flow on fd %d\n", flow->cnx.q[1].fd);
+        flow_remove(table, flow);
+        watchers_del(l->watchers, flow->cnx.q[1].fd);
+        close(flow->cnx.q[1].fd);
+        backend_release(&flow->cnx);
+        config_put(flow->cnx.config);
+        free(flow);
+    }
+    return -1;
+}
+
+/* UDP listener for sslh-fork: upon incoming packet, find where it should go */
+void udp_listener(struct listen_endpoint* endpoint, int num_endpoints, int active_endpoint)
+{
+    struct watcher_event events[WATCHERS_MAX_EVENTS];
+    struct udp_listener* l;
+    struct watchers* w;
+    int i, n, sockfd = endpoint[active_endpoint].socketfd;
+    int timeout = -1;
+
+    start_resolver();
+    w = watchers_init();
+    l = udp_listener_new(sockfd, w);
+    /* The listening socket is the only one registered without a flow */
+    watchers_add_read(w, sockfd, NULL);
+
+    while (1) {
+        n = watchers_wait(w, events, timeout);
+        if (n < 0 && errno != EINTR)
+            perror("watchers_wait");
+
+        for (i = 0; i < n; i++) {
+            if (!events[i].data)
+                udp_extern_forward(l);
+            else
+                udp_intern_forward(events[i].data);
+        }
+        udp_flush_replies(l);
+
+        timeout = udp_reap_timeouts(l);
+    }
+}
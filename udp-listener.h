@@ -0,0 +1,48 @@
+/* API for udp-listener.c: forwards UDP datagrams to their targets
+ *
+ * UDP has no connections, so each source address (a "flow") is probed on its
+ * first datagram and remembered in a hash table, together with a socket of
+ * its own connected to the target: that socket is how replies find their way
+ * back to the source. Flows are forgotten after UDP_TIMEOUT seconds without
+ * traffic.
+ *
+ * Flows are struct connection in state ST_UDP, and their target socket is
+ * registered with the event backend of their listener, so UDP can share an
+ * event loop with TCP connections (see processes.c).
+ */
+
+#ifndef UDP_LISTENER_H
+#define UDP_LISTENER_H
+
+#include "common.h"
+#include "watchers.h"
+
+/* Timeout before forgetting a flow, in seconds */
+#define UDP_TIMEOUT 60
+
+struct udp_listener;
+
+/* Sets up flow tracking for listening socket sockfd, with target sockets
+ * registered in w. The caller registers sockfd itself. Dies if out of memory. */
+struct udp_listener* udp_listener_new(int sockfd, struct watchers* w);
+
+/* The listening socket is readable: probe datagrams from new sources, and
+ * forward them all to their target */
+void udp_extern_forward(struct udp_listener* l);
+
+/* The target socket of a flow is readable: queue the replies to its source */
+void udp_intern_forward(struct connection* cnx);
+
+/* Sends the queued replies. To be called at the end of each event batch. */
+void udp_flush_replies(struct udp_listener* l);
+
+/* Forgets flows that have been idle for too long. Flows are only ever freed
+ * here, so call it once the event batch has been processed. Returns the number
+ * of ms until the next flow expires, or -1 if there are no flows. */
+int udp_reap_timeouts(struct udp_listener* l);
+
+/* Forwards datagrams received on endpoint[active_endpoint], and their replies.
+ * Does not return. */
+void udp_listener(struct listen_endpoint* endpoint, int num_endpoints, int active_endpoint);
+
+#endif
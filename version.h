@@ -0,0 +1,5 @@
+#ifndef VERSION_H 
+#define VERSION_H 
+
+#define VERSION "heads/master-0-gf71ba09-dirty"
+#endif
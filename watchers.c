@@ -0,0 +1,889 @@
+/*
+# watchers.c: event notification backends (io_uring, epoll, kqueue, select)
+#
+# Copyright (C) 2021  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include "common.h"
+#include "watchers.h"
+
+/* io_uring falls back to epoll where the kernel doesn't have it */
+#if defined(WATCHERS_URING) && !defined(WATCHERS_EPOLL)
+#define WATCHERS_EPOLL
+#endif
+
+#if !defined(WATCHERS_SELECT) && !defined(WATCHERS_KQUEUE) && !defined(WATCHERS_EPOLL)
+#if defined(__linux__)
+#define WATCHERS_EPOLL
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__) || defined(__APPLE__)
+#define WATCHERS_KQUEUE
+#else
+#define WATCHERS_SELECT
+#endif
+#endif
+
+#if defined(WATCHERS_URING)
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(WATCHERS_EPOLL)
+#include <sys/epoll.h>
+#elif defined(WATCHERS_KQUEUE)
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#define WATCH_READ      1
+#define WATCH_WRITE     2
+#define WATCH_RECV      4   /* with WATCH_READ: see watchers_add_recv() */
+#define WATCH_ACCEPT    8   /* with WATCH_READ: see watchers_add_accept() */
+
+/* What we know about each file descriptor, indexed by fd */
+struct fd_watch {
+    void* data;
+    int events;     /* WATCH_* currently monitored */
+#if defined(WATCHERS_URING)
+    uint32_t gen;   /* of the request: completions of older ones are stale */
+    uint32_t del_gen;   /* gen when last removed: data read before is dropped */
+    int armed;      /* kind + 1 of the request in flight, 0 if none */
+    int event;      /* index + 1 of its event in the batch being collected */
+#endif
+};
+
+#if defined(WATCHERS_URING)
+/* The rings shared with the kernel */
+struct uring {
+    int fd;                     /* -1 if not in use */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+
+    /* Buffers the kernel reads into, NULL if it can't (before 5.19, which
+     * also has no multishot accept) */
+    struct io_uring_buf_ring* br;
+    char* bufs;
+    uint16_t br_tail;
+    /* Buffers handed out with the last events, and file descriptors whose
+     * request is to be made again, both before the next wait */
+    int held[WATCHERS_MAX_EVENTS], num_held;
+    int rearm[WATCHERS_MAX_EVENTS], num_rearm;
+};
+#endif
+
+struct watchers {
+    struct fd_watch* fds;
+    int fds_len;
+#if defined(WATCHERS_URING)
+    struct uring ring;
+#endif
+#if defined(WATCHERS_EPOLL)
+    int epfd;
+#elif defined(WATCHERS_KQUEUE)
+    int kq;
+#else
+    fd_set fds_r, fds_w;
+    int max_fd;
+#endif
+};
+
+
+/* Makes sure the fd table can be indexed by fd */
+static void fds_grow(struct watchers* w, int fd)
+{
+    int new_len;
+    struct fd_watch* new;
+
+    if (fd < w->fds_len)
+        return;
+
+    new_len = w->fds_len ? w->fds_len : 64;
+    while (new_len <= fd)
+        new_len *= 2;
+
+    new = realloc(w->fds, new_len * sizeof(*new));
+    CHECK_ALLOC(new, "realloc");
+    memset(new + w->fds_len, 0, (new_len - w->fds_len) * sizeof(*new));
+
+    w->fds = new;
+    w->fds_len = new_len;
+}
+
+#if defined(WATCHERS_URING)
+
+/* Each watched file descriptor has a poll request, which completes when the
+ * file descriptor is ready, and is made again for the next wait (multishot
+ * requests only report new readiness, and the main loop expects to be told
+ * again about data it left unread, as epoll does). Changes to what is
+ * watched only queue requests, which go to the kernel with the next wait: a
+ * whole batch of events costs one io_uring_enter(), where epoll costs an
+ * epoll_ctl() per change on top of epoll_wait().
+ *
+ * Listening sockets watched with watchers_add_accept() have a multishot
+ * accept instead, which completes with each new connection. Sockets watched
+ * with watchers_add_recv() have a receive into a buffer of a ring the kernel
+ * picks from, and the data comes with the completion: neither costs a system
+ * call of its own. A receive is only made again at the next wait, so none is
+ * in flight while the caller acts on the data, and stopping reads can't lose
+ * what comes after. What arrives while a receive is being cancelled still
+ * comes with an event, unless watchers_del() was called. */
+
+#define URING_ENTRIES   1024
+
+/* The buffer ring: enough for the first packets of a batch of connections */
+#define URING_BUFS      64
+#define URING_BGID      0
+
+/* user_data of requests whose completion doesn't matter */
+#define URING_IGNORE    UINT64_MAX
+
+/* Kinds of request */
+enum { URING_POLL, URING_RECV, URING_ACCEPT };
+
+/* Set once io_uring turned out not to work, so it's not tried again */
+static int uring_failed;
+
+/* fd and kind in the low word (fds fit in 30 bits), gen in the high one */
+static uint64_t uring_data(int fd, uint32_t gen, int kind)
+{
+    return (uint64_t)gen << 32 | (uint32_t)kind << 30 | (uint32_t)fd;
+}
+
+static int uring_kind(int events)
+{
+    if (events & WATCH_ACCEPT)
+        return URING_ACCEPT;
+    if (events == (WATCH_READ | WATCH_RECV))
+        return URING_RECV;
+    return URING_POLL;
+}
+
+static void uring_unmap(struct uring* r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+    if (r->br) munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));
+    free(r->bufs);
+    close(r->fd);
+    r->fd = -1;
+}
+
+/* Gives buffer bid back to the kernel, once the tail is published */
+static void uring_buf_return(struct uring* r, int bid)
+{
+    struct io_uring_buf* b = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(r->bufs + bid * WATCHERS_RECV_MAX);
+    b->len = WATCHERS_RECV_MAX;
+    b->bid = bid;
+    r->br_tail++;
+}
+
+/* Sets up the buffer ring, if the kernel has them */
+static void uring_init_bufs(struct uring* r)
+{
+    struct io_uring_buf_reg reg;
+    int i;
+
+    r->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->bufs = malloc(URING_BUFS * WATCHERS_RECV_MAX);
+    if (r->br == MAP_FAILED || !r->bufs)
+        goto fail;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        log_message(LOG_INFO, "io_uring buffer ring: %s, only polling\n", strerror(errno));
+        goto fail;
+    }
+
+    for (i = 0; i < URING_BUFS; i++)
+        uring_buf_return(r, i);
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+    return;
+
+fail:
+    if (r->br != MAP_FAILED)
+        munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));
+    free(r->bufs);
+    r->br = NULL;
+    r->bufs = NULL;
+}
+
+/* Returns 0, or -1 if io_uring can't be used */
+static int uring_init(struct uring* r)
+{
+    struct io_uring_params p;
+    /* Waiting with a timeout needs EXT_ARG (5.11) */
+    unsigned needed = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    char* sq;
+    char* cq;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    if (uring_failed)
+        return -1;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd == -1) {
+        log_message(LOG_INFO, "io_uring_setup: %s, using epoll\n", strerror(errno));
+        uring_failed = 1;
+        return -1;
+    }
+    if ((p.features & needed) != needed) {
+        log_message(LOG_INFO, "io_uring is too old, using epoll\n");
+        uring_failed = 1;
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+        log_message(LOG_ERR, "io_uring mmap: %s, using epoll\n", strerror(errno));
+        uring_unmap(r);
+        return -1;
+    }
+
+    sq = r->sq_ptr;
+    cq = r->cq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+    uring_init_bufs(r);
+    return 0;
+}
+
+/* Submits the queued requests and, with wait set, waits for at least one
+ * completion for at most timeout ms (-1: no limit) */
+static int uring_enter(struct uring* r, int wait, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit;
+    int res;
+
+    to_submit = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (!wait) {
+        if (!to_submit) return 0;
+        return syscall(__NR_io_uring_enter, r->fd, to_submit, 0, 0, NULL, 0);
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    res = syscall(__NR_io_uring_enter, r->fd, to_submit, 1,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (res == -1 && errno == ETIME)
+        res = 0;
+    return res;
+}
+
+/* Returns a cleared request to fill in, queued to go with the next
+ * uring_enter(), or NULL if the queue is full and can't be submitted */
+static struct io_uring_sqe* uring_sqe(struct uring* r)
+{
+    unsigned tail = *r->sq_tail, index;
+    struct io_uring_sqe* sqe;
+
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        uring_enter(r, 0, 0);
+        if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+            return NULL;
+    }
+
+    index = tail & *r->sq_mask;
+    sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* Makes a request of that kind for what fd is watched for */
+static int uring_arm(struct watchers* w, int fd, int kind)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&w->ring);
+    int events = w->fds[fd].events;
+
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->fd = fd;
+    sqe->user_data = uring_data(fd, w->fds[fd].gen, kind);
+    switch (kind) {
+    case URING_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        break;
+    case URING_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->len = WATCHERS_RECV_MAX;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        break;
+    default:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        if (events & WATCH_READ) sqe->poll32_events |= POLLIN;
+        if (events & WATCH_WRITE) sqe->poll32_events |= POLLOUT;
+        break;
+    }
+    w->fds[fd].armed = kind + 1;
+    return 0;
+}
+
+static int uring_update(struct watchers* w, int fd, int old_events, int new_events)
+{
+    struct io_uring_sqe* sqe;
+    int kind = w->fds[fd].armed - 1;
+
+    if (w->fds[fd].armed) {
+        sqe = uring_sqe(&w->ring);
+        if (!sqe) {
+            errno = EBUSY;
+            return -1;
+        }
+        sqe->opcode = kind == URING_POLL ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = uring_data(fd, w->fds[fd].gen, kind);
+        sqe->user_data = URING_IGNORE;
+        w->fds[fd].armed = 0;
+    }
+    w->fds[fd].gen++;
+
+    /* uring_arm() looks at what fd is watched for */
+    w->fds[fd].events = new_events;
+    if (new_events)
+        return uring_arm(w, fd, uring_kind(new_events));
+    return 0;
+}
+
+/* Returns the event of fd in the batch, which it starts if needed */
+static struct watcher_event* uring_event(struct watchers* w, struct watcher_event* events,
+                                         int* n, int fd)
+{
+    struct watcher_event* ev;
+
+    if (w->fds[fd].event)
+        return &events[w->fds[fd].event - 1];
+
+    ev = &events[(*n)++];
+    memset(ev, 0, sizeof(*ev));
+    ev->fd = fd;
+    ev->accepted = -1;
+    w->fds[fd].event = *n;
+    return ev;
+}
+
+static int uring_wait(struct watchers* w, struct watcher_event* events, int timeout)
+{
+    struct uring* r = &w->ring;
+    struct io_uring_cqe* cqe;
+    struct watcher_event* ev;
+    unsigned head, tail;
+    uint32_t gen;
+    int i, n = 0, fd, res, mask, kind, bid;
+
+    /* The caller is done with the last events */
+    for (i = 0; i < r->num_held; i++)
+        uring_buf_return(r, r->held[i]);
+    r->num_held = 0;
+    for (i = 0; i < r->num_rearm; i++) {
+        fd = r->rearm[i];
+        if (fd < w->fds_len && w->fds[fd].events && !w->fds[fd].armed)
+            uring_arm(w, fd, uring_kind(w->fds[fd].events));
+    }
+    r->num_rearm = 0;
+
+    /* Don't sleep if completions are left from last time */
+    head = *r->cq_head;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    res = uring_enter(r, head == tail, timeout);
+    if (res == -1 && errno != EBUSY)
+        return -1;
+
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && n < WATCHERS_MAX_EVENTS; head++) {
+        cqe = &r->cqes[head & *r->cq_mask];
+        if (cqe->user_data == URING_IGNORE)
+            continue;
+        fd = (uint32_t)cqe->user_data & ((1U << 30) - 1);
+        kind = ((uint32_t)cqe->user_data >> 30) & 3;
+        gen = cqe->user_data >> 32;
+        res = cqe->res;
+        bid = (cqe->flags & IORING_CQE_F_BUFFER) ? cqe->flags >> IORING_CQE_BUFFER_SHIFT : -1;
+        if (bid >= 0 && res <= 0) {
+            uring_buf_return(r, bid);
+            bid = -1;
+        }
+        /* One buffer per fd and per batch: the rest waits for the next */
+        if (bid >= 0 && fd < w->fds_len && w->fds[fd].event &&
+            events[w->fds[fd].event - 1].buf)
+            break;
+
+        if (fd >= w->fds_len || w->fds[fd].gen != gen || !w->fds[fd].events) {
+            /* From a request removed since. Connections accepted meanwhile
+             * go, as they would have with the listening socket; data read
+             * meanwhile goes to whoever still has fd. */
+            if (kind == URING_ACCEPT && res >= 0)
+                close(res);
+            if (bid < 0)
+                continue;
+            if (fd >= w->fds_len || gen < w->fds[fd].del_gen || !w->fds[fd].data) {
+                uring_buf_return(r, bid);
+                continue;
+            }
+        } else if (kind == URING_ACCEPT) {
+            /* One event per connection. If accepting failed, fd is said
+             * readable, for accept() to tell why. */
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                w->fds[fd].armed = 0;
+                r->rearm[r->num_rearm++] = fd;
+            }
+            ev = &events[n++];
+            memset(ev, 0, sizeof(*ev));
+            ev->fd = fd;
+            ev->accepted = res >= 0 ? res : -1;
+            ev->readable = res < 0;
+            continue;
+        } else if (kind == URING_RECV && res == -ENOBUFS) {
+            /* All buffers are out: wait for the data with a poll instead,
+             * and read it the usual way */
+            uring_arm(w, fd, URING_POLL);
+            continue;
+        } else if (kind == URING_RECV || uring_kind(w->fds[fd].events) == URING_RECV) {
+            /* Not before the caller is done reading */
+            w->fds[fd].armed = 0;
+            r->rearm[r->num_rearm++] = fd;
+        }
+
+        if (bid >= 0) {
+            ev = uring_event(w, events, &n, fd);
+            r->held[r->num_held++] = bid;
+            ev->buf = r->bufs + bid * WATCHERS_RECV_MAX;
+            ev->buf_len = res;
+            continue;
+        }
+
+        /* If the request failed, say the fd is ready so the error comes out
+         * of the next read() or write(). Receives that got no data (end of
+         * file, error) say so the same way. */
+        mask = res;
+        if (kind == URING_RECV)
+            mask = POLLIN;
+        else if (mask < 0)
+            mask = POLLERR;
+        else if (w->fds[fd].armed)
+            uring_arm(w, fd, URING_POLL);
+
+        /* Several completions for one fd make one event */
+        ev = uring_event(w, events, &n, fd);
+        /* Errors and hang-ups are reported to whoever is interested, so the
+         * following read() or write() sees them */
+        if ((mask & (POLLIN | POLLERR | POLLHUP)) && (w->fds[fd].events & WATCH_READ))
+            ev->readable = 1;
+        if ((mask & (POLLOUT | POLLERR | POLLHUP)) && (w->fds[fd].events & WATCH_WRITE))
+            ev->writable = 1;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    if (r->br)
+        __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+
+    for (i = 0; i < n; i++)
+        w->fds[events[i].fd].event = 0;
+    return n;
+}
+
+#endif
+
+#if defined(WATCHERS_EPOLL)
+
+const char* watchers_backend(void)
+{
+#if defined(WATCHERS_URING)
+    if (!uring_failed) return "io_uring";
+#endif
+    return "epoll";
+}
+
+static int backend_init(struct watchers* w)
+{
+#if defined(WATCHERS_URING)
+    if (!uring_init(&w->ring))
+        return 0;
+#endif
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return w->epfd;
+}
+
+static int backend_update(struct watchers* w, int fd, int old_events, int new_events)
+{
+    struct epoll_event ev;
+    int op, res;
+
+#if defined(WATCHERS_URING)
+    if (w->ring.fd != -1)
+        return uring_update(w, fd, old_events, new_events);
+#endif
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (new_events & WATCH_READ) ev.events |= EPOLLIN;
+    if (new_events & WATCH_WRITE) ev.events |= EPOLLOUT;
+
+    if (!old_events)
+        op = EPOLL_CTL_ADD;
+    else if (!new_events)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    res = epoll_ctl(w->epfd, op, fd, &ev);
+
+    /* Our idea of what is registered can be wrong if the file descriptor got
+     * closed behind our back: fix it up */
+    if (res == -1 && op == EPOLL_CTL_MOD && errno == ENOENT)
+        res = epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+    else if (res == -1 && op == EPOLL_CTL_ADD && errno == EEXIST)
+        res = epoll_ctl(w->epfd, EPOLL_CTL_MOD, fd, &ev);
+
+    return res;
+}
+
+static int backend_wait(struct watchers* w, struct watcher_event* events, int timeout)
+{
+    struct epoll_event ev[WATCHERS_MAX_EVENTS];
+    int i, n, fd;
+
+#if defined(WATCHERS_URING)
+    if (w->ring.fd != -1)
+        return uring_wait(w, events, timeout);
+#endif
+
+    n = epoll_wait(w->epfd, ev, ARRAY_SIZE(ev), timeout);
+    for (i = 0; i < n; i++) {
+        fd = ev[i].data.fd;
+        events[i].fd = fd;
+        /* Errors and hang-ups are reported to whoever is interested, so the
+         * following read() or write() sees them */
+        events[i].readable = (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            && (w->fds[fd].events & WATCH_READ);
+        events[i].writable = (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            && (w->fds[fd].events & WATCH_WRITE);
+        events[i].accepted = -1;
+        events[i].buf = NULL;
+        events[i].buf_len = 0;
+    }
+    return n;
+}
+
+static void backend_close(struct watchers* w)
+{
+#if defined(WATCHERS_URING)
+    if (w->ring.fd != -1) {
+        uring_unmap(&w->ring);
+        return;
+    }
+#endif
+    close(w->epfd);
+}
+
+#elif defined(WATCHERS_KQUEUE)
+
+const char* watchers_backend(void) { return "kqueue"; }
+
+static int backend_init(struct watchers* w)
+{
+    w->kq = kqueue();
+    return w->kq;
+}
+
+static int backend_update(struct watchers* w, int fd, int old_events, int new_events)
+{
+    struct kevent changes[2];
+    int n = 0;
+
+    if ((old_events ^ new_events) & WATCH_READ) {
+        EV_SET(&changes[n++], fd, EVFILT_READ,
+               (new_events & WATCH_READ) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+    }
+    if ((old_events ^ new_events) & WATCH_WRITE) {
+        EV_SET(&changes[n++], fd, EVFILT_WRITE,
+               (new_events & WATCH_WRITE) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+    }
+    if (!n)
+        return 0;
+    return kevent(w->kq, changes, n, NULL, 0, NULL);
+}
+
+static int backend_wait(struct watchers* w, struct watcher_event* events, int timeout)
+{
+    struct kevent ev[WATCHERS_MAX_EVENTS];
+    struct timespec ts, *pts = NULL;
+    int i, n;
+
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        pts = &ts;
+    }
+
+    n = kevent(w->kq, NULL, 0, ev, ARRAY_SIZE(ev), pts);
+    for (i = 0; i < n; i++) {
+        events[i].fd = ev[i].ident;
+        events[i].readable = (ev[i].filter == EVFILT_READ);
+        events[i].writable = (ev[i].filter == EVFILT_WRITE);
+        events[i].accepted = -1;
+        events[i].buf = NULL;
+        events[i].buf_len = 0;
+    }
+    return n;
+}
+
+static void backend_close(struct watchers* w)
+{
+    close(w->kq);
+}
+
+#else /* WATCHERS_SELECT */
+
+const char* watchers_backend(void) { return "select"; }
+
+static int backend_init(struct watchers* w)
+{
+    FD_ZERO(&w->fds_r);
+    FD_ZERO(&w->fds_w);
+    w->max_fd = -1;
+    return 0;
+}
+
+static int backend_update(struct watchers* w, int fd, int old_events, int new_events)
+{
+    /* if fd becomes higher than FD_SETSIZE, things won't work so well with
+     * FD_SET and FD_CLR. Need to drop connections if we go above that limit */
+    if (fd >= FD_SETSIZE) {
+        log_message(LOG_ERR, "too many open file descriptor to monitor them all -- dropping connection\n");
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (new_events & WATCH_READ) FD_SET(fd, &w->fds_r); else FD_CLR(fd, &w->fds_r);
+    if (new_events & WATCH_WRITE) FD_SET(fd, &w->fds_w); else FD_CLR(fd, &w->fds_w);
+
+    if (new_events && fd > w->max_fd)
+        w->max_fd = fd;
+
+    return 0;
+}
+
+static int backend_wait(struct watchers* w, struct watcher_event* events, int timeout)
+{
+    fd_set readfds, writefds;
+    struct timeval tv, *ptv = NULL;
+    int fd, n, res;
+
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        ptv = &tv;
+    }
+
+    memcpy(&readfds, &w->fds_r, sizeof(readfds));
+    memcpy(&writefds, &w->fds_w, sizeof(writefds));
+
+    res = select(w->max_fd + 1, &readfds, &writefds, NULL, ptv);
+    if (res <= 0)
+        return res;
+
+    n = 0;
+    for (fd = 0; (fd <= w->max_fd) && (n < WATCHERS_MAX_EVENTS); fd++) {
+        if (FD_ISSET(fd, &readfds) || FD_ISSET(fd, &writefds)) {
+            events[n].fd = fd;
+            events[n].readable = FD_ISSET(fd, &readfds);
+            events[n].writable = FD_ISSET(fd, &writefds);
+            events[n].accepted = -1;
+            events[n].buf = NULL;
+            events[n].buf_len = 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+static void backend_close(struct watchers* w)
+{
+}
+
+#endif
+
+
+struct watchers* watchers_init(void)
+{
+    struct watchers* w;
+    int res;
+
+    w = calloc(1, sizeof(*w));
+    CHECK_ALLOC(w, "calloc");
+
+    res = backend_init(w);
+    CHECK_RES_DIE(res, "watchers_init");
+
+    return w;
+}
+
+/* Changes the set of monitored events for fd */
+static int watchers_set(struct watchers* w, int fd, int events, void* data)
+{
+    int res;
+
+    fds_grow(w, fd);
+
+    if (w->fds[fd].events != events) {
+        res = backend_update(w, fd, w->fds[fd].events, events);
+        /* Removing a file descriptor that is already closed fails, but it
+         * is gone from the backend all the same */
+        if (res == -1 && events) {
+            log_message(LOG_ERR, "watchers_set(%d): %s\n", fd, strerror(errno));
+            return res;
+        }
+        w->fds[fd].events = events;
+    }
+    w->fds[fd].data = data;
+
+    return 0;
+}
+
+/* Whether the backend has requests that accept or read themselves */
+static int watchers_completes(struct watchers* w)
+{
+#if defined(WATCHERS_URING)
+    return w->ring.fd != -1 && w->ring.br;
+#else
+    return 0;
+#endif
+}
+
+int watchers_add_read(struct watchers* w, int fd, void* data)
+{
+    fds_grow(w, fd);
+    return watchers_set(w, fd, (w->fds[fd].events & ~(WATCH_RECV | WATCH_ACCEPT)) | WATCH_READ,
+                        data);
+}
+
+int watchers_add_accept(struct watchers* w, int fd, void* data)
+{
+    if (!watchers_completes(w))
+        return watchers_add_read(w, fd, data);
+    fds_grow(w, fd);
+    return watchers_set(w, fd, w->fds[fd].events | WATCH_READ | WATCH_ACCEPT, data);
+}
+
+int watchers_add_recv(struct watchers* w, int fd, void* data)
+{
+    if (!watchers_completes(w))
+        return watchers_add_read(w, fd, data);
+    fds_grow(w, fd);
+    return watchers_set(w, fd, w->fds[fd].events | WATCH_READ | WATCH_RECV, data);
+}
+
+int watchers_add_write(struct watchers* w, int fd, void* data)
+{
+    fds_grow(w, fd);
+    return watchers_set(w, fd, w->fds[fd].events | WATCH_WRITE, data);
+}
+
+void watchers_del_read(struct watchers* w, int fd)
+{
+    if (fd < 0 || fd >= w->fds_len) return;
+    watchers_set(w, fd, w->fds[fd].events & ~(WATCH_READ | WATCH_RECV | WATCH_ACCEPT),
+                 w->fds[fd].data);
+}
+
+void watchers_del_write(struct watchers* w, int fd)
+{
+    if (fd < 0 || fd >= w->fds_len) return;
+    watchers_set(w, fd, w->fds[fd].events & ~WATCH_WRITE, w->fds[fd].data);
+}
+
+void watchers_del(struct watchers* w, int fd)
+{
+    if (fd < 0 || fd >= w->fds_len) return;
+    watchers_set(w, fd, 0, NULL);
+#if defined(WATCHERS_URING)
+    w->fds[fd].del_gen = w->fds[fd].gen;
+#endif
+}
+
+int watchers_wait(struct watchers* w, struct watcher_event* events, int timeout)
+{
+    int i, n;
+
+    n = backend_wait(w, events, timeout);
+
+    for (i = 0; i < n; i++)
+        events[i].data = w->fds[events[i].fd].data;
+
+    return n;
+}
+
+void watchers_close(struct watchers* w)
+{
+    backend_close(w);
+    free(w->fds);
+    free(w);
+}
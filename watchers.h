@@ -0,0 +1,69 @@
+/* API for watchers.c: event notification backend used by sslh-select
+ *
+ * The backend is chosen at compile time: epoll(7) on Linux, kqueue(2) on the
+ * BSDs and MacOS, and select(2) everywhere else (or when WATCHERS_SELECT is
+ * defined). With WATCHERS_URING, Linux uses io_uring if the kernel has it,
+ * and epoll otherwise. Each watched file descriptor carries an opaque pointer which is
+ * handed back with the events, so the main loop only ever looks at the file
+ * descriptors that are ready.
+ */
+
+#ifndef WATCHERS_H
+#define WATCHERS_H
+
+struct watchers;
+
+/* One event returned by watchers_wait() */
+struct watcher_event {
+    int fd;
+    void* data;     /* pointer given when the fd was registered */
+    int readable;
+    int writable;
+    int accepted;   /* new connection on a watchers_add_accept() fd, or -1 */
+    const char* buf;    /* data read from a watchers_add_recv() fd, or NULL */
+    ssize_t buf_len;
+};
+
+/* Maximum number of events returned by one call to watchers_wait() */
+#define WATCHERS_MAX_EVENTS 256
+
+/* Most data one event from a watchers_add_recv() fd carries */
+#define WATCHERS_RECV_MAX 4096
+
+/* Creates a new, empty set of watchers. Dies on failure. */
+struct watchers* watchers_init(void);
+
+/* Start/stop monitoring fd for reads or writes. `data` is associated to the
+ * file descriptor (the last one given wins).
+ * Returns 0 on success, -1 on failure (e.g. fd too high with select()) */
+int watchers_add_read(struct watchers* w, int fd, void* data);
+int watchers_add_write(struct watchers* w, int fd, void* data);
+void watchers_del_read(struct watchers* w, int fd);
+void watchers_del_write(struct watchers* w, int fd);
+
+/* Like watchers_add_read(), but where the backend can (io_uring on 5.19 and
+ * later), the work is done before the event comes, without a system call:
+ * connections on the listening socket fd come each with an event whose
+ * `accepted` is the new, non-blocking socket; data read from fd comes in
+ * `buf`, valid until the next watchers_wait(). Otherwise, or when something
+ * went wrong, fd is said readable as with watchers_add_read(). Data read
+ * before watchers_del_read() still comes; only watchers_del() drops it. */
+int watchers_add_accept(struct watchers* w, int fd, void* data);
+int watchers_add_recv(struct watchers* w, int fd, void* data);
+
+/* Stop monitoring fd altogether. Must be called before closing fd. */
+void watchers_del(struct watchers* w, int fd);
+
+/* Waits for events, at most `timeout` milliseconds (-1 to wait forever).
+ * Fills up to WATCHERS_MAX_EVENTS entries of `events`.
+ * Returns the number of events, 0 on timeout, -1 on error */
+int watchers_wait(struct watchers* w, struct watcher_event* events, int timeout);
+
+/* Releases the backend without touching the watched file descriptors
+ * (used by children after fork) */
+void watchers_close(struct watchers* w);
+
+/* Name of the backend compiled in, for logging */
+const char* watchers_backend(void);
+
+#endif